@@ -76,6 +76,11 @@ TEST_CASE("recycle ip", "[dns]") {
     ip = ziti_dns_register_hostname(&za, new ziti_service);
     CHECK(ip != nullptr);
     CHECK_THAT(ipaddr_ntoa(ip), Catch::Equals("100.64.0.103"));
+    CHECK_THAT(ziti_dns_reverse_lookup("100.64.0.103"), Catch::Equals("just.one.more"));
+
+    // reserved and out of range ips have no hostname
+    CHECK(ziti_dns_reverse_lookup("100.64.0.2") == nullptr);
+    CHECK(ziti_dns_reverse_lookup("10.0.0.1") == nullptr);
 
     // tun ip (.0.1), dns_ip (.0.2), network ip (.0.0), and broadcast ip (.0.255) should not be returned
     // first ip should not be tun or dns ip
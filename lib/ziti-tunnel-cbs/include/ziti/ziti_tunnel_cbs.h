@@ -314,6 +314,8 @@ DECLARE_MODEL(ext_signer_event, EXT_SIGNER_EVENT_MODEL)
 typedef struct tunneled_service_s tunneled_service_t;
 
 #define MAX_PENDING_BYTES (128 * 1024)
+// tcp connections are kept well below this by their receive window. it is the last resort against unbounded buffering
+#define MAX_PENDING_BYTES_TCP (4 * 1024 * 1024)
 
 /** context passed through the tunneler SDK for network i/o */
 typedef struct ziti_io_ctx_s {
@@ -321,6 +323,8 @@ typedef struct ziti_io_ctx_s {
     bool ziti_eof;
     bool tnlr_eof;
     uint64_t pending_wbytes;
+    uint64_t max_pending_wbytes; // writes are refused beyond this, and resumed when pending_wbytes drains below half of it
+    bool write_blocked;  // a write was refused since pending_wbytes was last below half of max_pending_wbytes
 } ziti_io_context;
 
 
@@ -345,6 +349,9 @@ void *ziti_sdk_c_dial(const void *app_intercept_ctx, struct io_ctx_s *io);
 /** called from tunneler SDK when intercepted client sends data */
 ssize_t ziti_sdk_c_write(const void *ziti_io_ctx, void *write_ctx, const void *data, size_t len);
 
+/** called from tunneler SDK when intercepted client sends data that spans multiple buffers */
+ssize_t ziti_sdk_c_writev(const void *ziti_io_ctx, void *write_ctx, const uv_buf_t *bufs, int nbufs);
+
 /** called by tunneler SDK after a client connection's RX is closed
  * return 0 if TX should still be open, 1 if both sides are closed */
 int ziti_sdk_c_close(void *io_ctx);
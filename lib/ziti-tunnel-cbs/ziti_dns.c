@@ -78,17 +78,25 @@ typedef struct dns_domain_s {
 
 } dns_domain_t;
 
-// hostname or domain
+// hostname. the name is allocated with the entry, and shared by both tables
 typedef struct dns_entry_s {
-    char name[MAX_DNS_NAME];
-    char ip[MAX_IP_LENGTH];
     ip_addr_t addr;
     dns_domain_t *domain;
 
     model_map intercepts;
 
+    uint32_t hash;
+    char name[];
 } dns_entry_t;
 
+#define DNS_TABLE_MIN_SIZE 64
+#define DNS_IP_TABLE_MIN_SIZE 256
+
+// marks a removed hostname slot, so probing continues past it
+static dns_entry_t deleted_entry;
+// marks the tun and dns ips, which are never assigned to a hostname
+static dns_entry_t reserved_entry;
+
 struct ziti_dns_s {
 
     struct {
@@ -98,11 +106,20 @@ struct ziti_dns_s {
         uint32_t capacity;
     } ip_pool;
 
-    // map[hostname -> dns_entry_t]
-    model_map hostnames;
+    // hostname -> dns_entry_t. open addressing with linear probing
+    struct {
+        dns_entry_t **slots;
+        uint32_t size;    // power of 2
+        uint32_t count;
+        uint32_t deleted;
+    } hostnames;
 
-    // map[ip4_addr_t -> dns_entry_t]
-    model_map ip_addresses;
+    // ip pool offset -> dns_entry_t. grows up to the highest offset that has been assigned
+    struct {
+        dns_entry_t **entries;
+        uint32_t size;
+        uint32_t count;   // including reserved ips
+    } ip_addresses;
 
     // map[domain -> dns_domain_t]
     model_map domains;
@@ -117,11 +134,116 @@ struct ziti_dns_s {
     struct sockaddr_in6 upstream_addr[MAX_UPSTREAMS];
 } ziti_dns;
 
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261U; // FNV-1a
+    while (*name) {
+        h = (h ^ (uint8_t) *name++) * 16777619U;
+    }
+    return h;
+}
+
+/** the slot that holds `name`, or the empty slot where probing for it stopped */
+static dns_entry_t **hostname_slot(const char *name, uint32_t hash) {
+    uint32_t mask = ziti_dns.hostnames.size - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        dns_entry_t **slot = &ziti_dns.hostnames.slots[i];
+        if (*slot == NULL) {
+            return slot;
+        }
+        if (*slot != &deleted_entry && (*slot)->hash == hash && strcmp((*slot)->name, name) == 0) {
+            return slot;
+        }
+    }
+}
+
+static dns_entry_t *hostname_get(const char *name) {
+    if (ziti_dns.hostnames.count == 0) {
+        return NULL;
+    }
+    return *hostname_slot(name, name_hash(name));
+}
+
+/** rehash into `size` slots. this also drops the deleted markers */
+static bool hostname_resize(uint32_t size) {
+    dns_entry_t **slots = calloc(size, sizeof(dns_entry_t *));
+    if (slots == NULL) {
+        return false;
+    }
+    dns_entry_t **old = ziti_dns.hostnames.slots;
+    uint32_t old_size = ziti_dns.hostnames.size;
+    ziti_dns.hostnames.slots = slots;
+    ziti_dns.hostnames.size = size;
+    ziti_dns.hostnames.deleted = 0;
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (old[i] != NULL && old[i] != &deleted_entry) {
+            *hostname_slot(old[i]->name, old[i]->hash) = old[i];
+        }
+    }
+    free(old);
+    return true;
+}
+
+/** add an entry whose name is not in the table */
+static bool hostname_put(dns_entry_t *entry) {
+    // keep the load, including deleted slots, under 3/4
+    if ((ziti_dns.hostnames.count + ziti_dns.hostnames.deleted + 1) * 4 > ziti_dns.hostnames.size * 3) {
+        uint32_t size = ziti_dns.hostnames.size ? ziti_dns.hostnames.size : DNS_TABLE_MIN_SIZE;
+        if ((ziti_dns.hostnames.count + 1) * 2 > size) {
+            size *= 2;
+        }
+        if (!hostname_resize(size)) {
+            return false;
+        }
+    }
+    *hostname_slot(entry->name, entry->hash) = entry;
+    ziti_dns.hostnames.count++;
+    return true;
+}
+
+/** the slot of `ip4` (network order) in the ip table, or NULL if it is not in the pool. the table grows if `grow` is set */
+static dns_entry_t **ip_slot(uint32_t ip4, bool grow) {
+    uint32_t host = ntohl(ip4);
+    if ((host & ~ziti_dns.ip_pool.counter_mask) != ziti_dns.ip_pool.base) {
+        return NULL;
+    }
+    uint32_t offset = host & ziti_dns.ip_pool.counter_mask;
+    if (offset >= ziti_dns.ip_addresses.size) {
+        if (!grow) {
+            return NULL;
+        }
+        uint32_t size = ziti_dns.ip_addresses.size ? ziti_dns.ip_addresses.size : DNS_IP_TABLE_MIN_SIZE;
+        while (size <= offset) {
+            size *= 2;
+        }
+        if (size - 1 > ziti_dns.ip_pool.counter_mask) {
+            size = ziti_dns.ip_pool.counter_mask + 1;
+        }
+        dns_entry_t **entries = realloc(ziti_dns.ip_addresses.entries, size * sizeof(dns_entry_t *));
+        if (entries == NULL) {
+            return NULL;
+        }
+        memset(entries + ziti_dns.ip_addresses.size, 0, (size - ziti_dns.ip_addresses.size) * sizeof(dns_entry_t *));
+        ziti_dns.ip_addresses.entries = entries;
+        ziti_dns.ip_addresses.size = size;
+    }
+    return &ziti_dns.ip_addresses.entries[offset];
+}
+
+/** the hostname entry that `ip4` (network order) is assigned to */
+static dns_entry_t *ip_entry(uint32_t ip4) {
+    dns_entry_t **slot = ip_slot(ip4, false);
+    if (slot == NULL || *slot == &reserved_entry) {
+        return NULL;
+    }
+    return *slot;
+}
+
 static uint32_t next_ipv4() {
     uint32_t candidate;
     uint32_t i = 0; // track how many candidates have been considered. should never exceed pool capacity.
+    dns_entry_t **slot;
 
-    if (model_map_size(&ziti_dns.ip_addresses) == ziti_dns.ip_pool.capacity) {
+    if (ziti_dns.ip_addresses.count == ziti_dns.ip_pool.capacity) {
         ZITI_LOG(ERROR, "DNS ip pool exhausted (%u IPs). Try rerunning with larger DNS range.",
                  ziti_dns.ip_pool.capacity);
         return INADDR_NONE;
@@ -133,7 +255,7 @@ static uint32_t next_ipv4() {
         if (ziti_dns.ip_pool.counter == ziti_dns.ip_pool.counter_mask) {
             ziti_dns.ip_pool.counter = 1;
         }
-    } while ((model_map_getl(&ziti_dns.ip_addresses, candidate) != NULL) && i < ziti_dns.ip_pool.capacity);
+    } while ((slot = ip_slot(candidate, false)) != NULL && *slot != NULL && i < ziti_dns.ip_pool.capacity);
 
     if (i == ziti_dns.ip_pool.capacity) {
         ZITI_LOG(ERROR, "no IPs available after scanning entire pool");
@@ -191,13 +313,17 @@ int ziti_dns_setup(tunneler_context tnlr, const char *dns_addr, const char *dns_
     intercept_ctx_override_cbs(dns_intercept, on_dns_client, on_dns_req, on_dns_close, on_dns_close);
     ziti_tunneler_intercept(tnlr, dns_intercept);
 
-    // reserve tun and dns ips by adding to ip_addresses with empty dns entries
+    // reserve tun and dns ips, if they are in the pool
     ziti_address_from_string(&tun_zaddr, dns_cidr); // assume tun ip is first in dns_cidr
     ziti_address *reserved[] = { &tun_zaddr, &dns_zaddr };
     size_t n = sizeof(reserved) / sizeof(ziti_address *);
     for (int i = 0; i < n; i++) {
         struct in_addr *in4_p = (struct in_addr *) &reserved[i]->addr.cidr.ip;
-        model_map_setl(&ziti_dns.ip_addresses, in4_p->s_addr, calloc(1, sizeof(dns_entry_t)));
+        dns_entry_t **slot = ip_slot(in4_p->s_addr, true);
+        if (slot != NULL && *slot == NULL) {
+            *slot = &reserved_entry;
+            ziti_dns.ip_addresses.count++;
+        }
     }
     return 0;
 }
@@ -334,25 +460,40 @@ static bool check_name(const char *name, char clean_name[MAX_DNS_NAME], bool *is
 }
 
 static dns_entry_t* new_ipv4_entry(const char *host) {
-    dns_entry_t *entry = calloc(1, sizeof(dns_entry_t));
-    strncpy(entry->name, host, sizeof(entry->name));
     uint32_t next = next_ipv4();
     if (next == INADDR_NONE) {
         return NULL;
     }
 
+    size_t len = strlen(host);
+    dns_entry_t *entry = calloc(1, sizeof(dns_entry_t) + len + 1);
+    dns_entry_t **ip = ip_slot(next, true);
+    if (entry == NULL || ip == NULL) {
+        ZITI_LOG(ERROR, "failed to allocate DNS entry for %s", host);
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->name, host, len + 1);
+    entry->hash = name_hash(entry->name);
     ip_addr_set_ip4_u32(&entry->addr, next);
-    ipaddr_ntoa_r(&entry->addr, entry->ip, sizeof(entry->ip));
 
-    model_map_set(&ziti_dns.hostnames, host, entry);
-    model_map_setl(&ziti_dns.ip_addresses, ip_2_ip4(&entry->addr)->addr, entry);
-    ZITI_LOG(INFO, "registered DNS entry %s -> %s", host, entry->ip);
+    if (!hostname_put(entry)) {
+        ZITI_LOG(ERROR, "failed to grow DNS table for %s", host);
+        free(entry);
+        return NULL;
+    }
+    *ip = entry;
+    ziti_dns.ip_addresses.count++;
+    ZITI_LOG(INFO, "registered DNS entry %s -> %s", host, ipaddr_ntoa(&entry->addr));
 
     return entry;
 }
 
 const char *ziti_dns_reverse_lookup_domain(const ip_addr_t *addr) {
-     dns_entry_t *entry = model_map_getl(&ziti_dns.ip_addresses, ip_2_ip4(addr)->addr);
+     if (!IP_IS_V4(addr)) {
+         return NULL;
+     }
+     dns_entry_t *entry = ip_entry(ip_2_ip4(addr)->addr);
      if (entry && entry->domain) {
          return entry->domain->name;
      }
@@ -361,8 +502,10 @@ const char *ziti_dns_reverse_lookup_domain(const ip_addr_t *addr) {
 
 const char *ziti_dns_reverse_lookup(const char *ip_addr) {
     ip_addr_t addr = {0};
-    ipaddr_aton(ip_addr, &addr);
-    dns_entry_t *entry = model_map_getl(&ziti_dns.ip_addresses, ip_2_ip4(&addr)->addr);
+    if (!ipaddr_aton(ip_addr, &addr) || !IP_IS_V4(&addr)) {
+        return NULL;
+    }
+    dns_entry_t *entry = ip_entry(ip_2_ip4(&addr)->addr);
 
     return entry ? entry->name : NULL;
 }
@@ -385,7 +528,7 @@ static dns_entry_t *ziti_dns_lookup(const char *hostname) {
         return NULL;
     }
 
-    dns_entry_t *entry = model_map_get(&ziti_dns.hostnames, clean);
+    dns_entry_t *entry = hostname_get(clean);
 
     if (!entry) {         // try domains
         dns_domain_t *domain = find_domain(clean);
@@ -419,17 +562,25 @@ void ziti_dns_deregister_intercept(void *intercept) {
         it = model_map_it_next(it);
     }
 
-    it = model_map_iterator(&ziti_dns.hostnames);
-    while (it != NULL) {
-        dns_entry_t *e = model_map_it_value(it);
+    for (uint32_t i = 0; i < ziti_dns.hostnames.size; i++) {
+        dns_entry_t *e = ziti_dns.hostnames.slots[i];
+        if (e == NULL || e == &deleted_entry) {
+            continue;
+        }
         model_map_remove_key(&e->intercepts, &intercept, sizeof(intercept));
         if (model_map_size(&e->intercepts) == 0 && (e->domain == NULL || model_map_size(&e->domain->intercepts) == 0)) {
-            it = model_map_it_remove(it);
-            model_map_removel(&ziti_dns.ip_addresses, ip_2_ip4(&e->addr)->addr);
-            ZITI_LOG(DEBUG, "%zu active hostnames mapped to %zu IPs", model_map_size(&ziti_dns.hostnames), model_map_size(&ziti_dns.ip_addresses));
-            ZITI_LOG(INFO, "DNS mapping %s -> %s is now inactive", e->name, e->ip);
-        } else {
-            it = model_map_it_next(it);
+            ziti_dns.hostnames.slots[i] = &deleted_entry;
+            ziti_dns.hostnames.count--;
+            ziti_dns.hostnames.deleted++;
+            dns_entry_t **ip = ip_slot(ip_2_ip4(&e->addr)->addr, false);
+            if (ip != NULL && *ip == e) {
+                *ip = NULL;
+                ziti_dns.ip_addresses.count--;
+            }
+            ZITI_LOG(DEBUG, "%u active hostnames mapped to %u IPs", ziti_dns.hostnames.count, ziti_dns.ip_addresses.count);
+            ZITI_LOG(INFO, "DNS mapping %s -> %s is now inactive", e->name, ipaddr_ntoa(&e->addr));
+            model_map_clear(&e->intercepts, NULL);
+            free(e);
         }
     }
 
@@ -470,7 +621,7 @@ const ip_addr_t *ziti_dns_register_hostname(const ziti_address *addr, void *inte
         model_map_set_key(&domain->intercepts, &intercept, sizeof(intercept), intercept);
         return NULL;
     } else {
-        dns_entry_t *entry = model_map_get(&ziti_dns.hostnames, clean);
+        dns_entry_t *entry = hostname_get(clean);
         if (!entry) {
             entry = new_ipv4_entry(clean);
         }
@@ -656,7 +807,8 @@ static void process_host_req(struct dns_req *req) {
             dns_answer *a = calloc(1, sizeof(dns_answer));
             a->ttl = 60;
             a->type = NS_T_A;
-            a->data = strdup(entry->ip);
+            char ip[MAX_IP_LENGTH];
+            a->data = strdup(ipaddr_ntoa_r(&entry->addr, ip, sizeof(ip)));
             req->msg.answer = calloc(2, sizeof(dns_answer *));
             req->msg.answer[0] = a;
         }
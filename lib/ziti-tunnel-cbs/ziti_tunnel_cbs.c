@@ -295,6 +295,8 @@ void * ziti_sdk_c_dial(const void *intercept_ctx, struct io_ctx_s *io) {
     ziti_io_ctx->ziti_eof = false;
     ziti_io_ctx->tnlr_eof = false;
     ziti_io_ctx->pending_wbytes = 0;
+    ziti_io_ctx->max_pending_wbytes = MAX_PENDING_BYTES;
+    ziti_io_ctx->write_blocked = false;
 
     ziti_context ziti_ctx = zi_ctx->ztx;
     if (ziti_conn_init(ziti_ctx, &ziti_io_ctx->ziti_conn, io) != ZITI_OK) {
@@ -328,6 +330,9 @@ void * ziti_sdk_c_dial(const void *intercept_ctx, struct io_ctx_s *io) {
     }
 
     dial_opts.stream = strcmp(app_data.dst_protocol, "tcp") == 0;
+    if (dial_opts.stream) {
+        ziti_io_ctx->max_pending_wbytes = MAX_PENDING_BYTES_TCP;
+    }
 
     char resolved_dial_identity[128];
     if (dial_opts.identity != NULL && dial_opts.identity[0] != '\0') {
@@ -361,6 +366,18 @@ void * ziti_sdk_c_dial(const void *intercept_ctx, struct io_ctx_s *io) {
     return ziti_io_ctx;
 }
 
+/** let the tunneler write data that was refused, once enough of the pending writes have completed */
+static void resume_if_drained(struct io_ctx_s *io) {
+    if (io == NULL || io->ziti_io == NULL) {
+        return;
+    }
+    ziti_io_context *zio = io->ziti_io;
+    if (zio->write_blocked && zio->pending_wbytes < zio->max_pending_wbytes / 2) {
+        zio->write_blocked = false;
+        ziti_tunneler_resume_writes(io);
+    }
+}
+
 /** called by ziti SDK when data transfer initiated by ziti_write completes */
 static void on_ziti_write(ziti_connection ziti_conn, ssize_t len, void *ctx) {
     struct io_ctx_s *io = ziti_conn_data(ziti_conn);
@@ -379,12 +396,13 @@ static void on_ziti_write(ziti_connection ziti_conn, ssize_t len, void *ctx) {
     // in case of error this should N(negative)ACK,
     // but connection is being closed anyway, so it is probably ok
     ziti_tunneler_ack(ctx);
+    resume_if_drained(io);
 }
 
 /** called from tunneler SDK when intercepted client sends data */
 ssize_t ziti_sdk_c_write(const void *ziti_io_ctx, void *write_ctx, const void *data, size_t len) {
     struct ziti_io_ctx_s *_ziti_io_ctx = (struct ziti_io_ctx_s *)ziti_io_ctx;
-    if (_ziti_io_ctx->pending_wbytes + len < MAX_PENDING_BYTES) {
+    if (_ziti_io_ctx->pending_wbytes + len < _ziti_io_ctx->max_pending_wbytes) {
         int zs = ziti_write(_ziti_io_ctx->ziti_conn, (void *) data, len, on_ziti_write, write_ctx);
         if (zs == ZITI_OK) {
             _ziti_io_ctx->pending_wbytes += len;
@@ -393,9 +411,82 @@ ssize_t ziti_sdk_c_write(const void *ziti_io_ctx, void *write_ctx, const void *d
     }
 
     ZITI_LOG(VERBOSE, "applying backpressure %" PRIu64 " pending bytes", _ziti_io_ctx->pending_wbytes);
+    _ziti_io_ctx->write_blocked = true;
     return ERR_WOULDBLOCK;
 }
 
+/** tracks the ziti_write calls of a vectored write, so the tunneler is acked once */
+struct ziti_writev_s {
+    void *write_ctx;
+    int pending;
+};
+
+static void on_ziti_writev(ziti_connection ziti_conn, ssize_t len, void *ctx) {
+    struct ziti_writev_s *wv = ctx;
+    struct io_ctx_s *io = ziti_conn_data(ziti_conn);
+    if (io != NULL) {
+        ziti_io_context *zio = io->ziti_io;
+        if (len < 0) {
+            ZITI_LOG(ERROR, "ziti_write(ziti_conn[%p]) failed: %s", ziti_conn, ziti_errorstr(len));
+            ziti_close(ziti_conn, ziti_conn_close_cb);
+        } else {
+            zio->pending_wbytes -= len;
+        }
+    }
+
+    if (--wv->pending == 0) {
+        ziti_tunneler_ack(wv->write_ctx);
+        free(wv);
+        resume_if_drained(io);
+    }
+}
+
+/** called from tunneler SDK when intercepted client sends data that spans multiple buffers */
+ssize_t ziti_sdk_c_writev(const void *ziti_io_ctx, void *write_ctx, const uv_buf_t *bufs, int nbufs) {
+    struct ziti_io_ctx_s *_ziti_io_ctx = (struct ziti_io_ctx_s *)ziti_io_ctx;
+    size_t len = 0;
+    for (int i = 0; i < nbufs; i++) {
+        len += bufs[i].len;
+    }
+    if (_ziti_io_ctx->pending_wbytes + len >= _ziti_io_ctx->max_pending_wbytes) {
+        ZITI_LOG(VERBOSE, "applying backpressure %" PRIu64 " pending bytes", _ziti_io_ctx->pending_wbytes);
+        _ziti_io_ctx->write_blocked = true;
+        return ERR_WOULDBLOCK;
+    }
+
+    struct ziti_writev_s *wv = calloc(1, sizeof(struct ziti_writev_s));
+    if (wv == NULL) {
+        ZITI_LOG(ERROR, "failed to allocate writev context");
+        return ZITI_ALLOC_FAILED;
+    }
+    wv->write_ctx = write_ctx;
+    wv->pending = 1; // held until every buffer is queued
+    ssize_t queued = 0;
+    for (int i = 0; i < nbufs; i++) {
+        int zs = ziti_write(_ziti_io_ctx->ziti_conn, (uint8_t *) bufs[i].base, bufs[i].len, on_ziti_writev, wv);
+        if (zs != ZITI_OK) {
+            if (i == 0) {
+                free(wv);
+                return zs;
+            }
+            // the queued buffers still reference the data, so write_ctx is acked when they complete.
+            // the tunneler closes the connection when it sees the partial write
+            ZITI_LOG(ERROR, "ziti_write(ziti_conn[%p]) failed after %zd bytes: %s", _ziti_io_ctx->ziti_conn, queued, ziti_errorstr(zs));
+            break;
+        }
+        wv->pending++;
+        queued += (ssize_t) bufs[i].len;
+        _ziti_io_ctx->pending_wbytes += bufs[i].len;
+    }
+
+    bool partial = queued < (ssize_t) len;
+    if (--wv->pending == 0) {
+        ziti_tunneler_ack(wv->write_ctx);
+        free(wv);
+    }
+    return partial ? queued : ZITI_OK;
+}
+
 ziti_intercept_t *new_ziti_intercept(ziti_context ztx, ziti_service *service, ziti_intercept_t *curr_i) {
     ziti_intercept_t *zi_ctx = calloc(1, sizeof(ziti_intercept_t));
     zi_ctx->ztx = ztx;
@@ -466,7 +557,6 @@ static const ziti_address  *intercept_addr_from_cfg_addr(const ziti_address *cfg
 
 intercept_ctx_t *new_intercept_ctx(tunneler_context tnlr_ctx, ziti_intercept_t *zi_ctx) {
     intercept_ctx_t *i_ctx = intercept_ctx_new(tnlr_ctx, zi_ctx->service_name, zi_ctx);
-    intercept_ctx_set_match_addr(i_ctx, intercept_match_addr);
 
     const ziti_address *za;
     switch (zi_ctx->cfg_desc->cfgtype) {
@@ -488,6 +578,10 @@ intercept_ctx_t *new_intercept_ctx(tunneler_context tnlr_ctx, ziti_intercept_t *
             MODEL_LIST_FOREACH(addr, config->addresses) {
                 za = intercept_addr_from_cfg_addr(addr, zi_ctx);
                 intercept_ctx_add_address(i_ctx, za);
+                // hostnames are intercepted by their assigned ip, only wildcard domains need to be matched on lookup
+                if (addr->type == ziti_address_hostname && addr->addr.hostname[0] == '*') {
+                    intercept_ctx_set_match_addr(i_ctx, intercept_match_addr);
+                }
             }
             MODEL_LIST_FOREACH(addr, config->allowed_source_addresses) {
                 za = intercept_addr_from_cfg_addr(addr, zi_ctx);
@@ -587,6 +681,7 @@ void remove_intercepts(ziti_context ziti_ctx, void *tnlr_ctx) {
 
     struct ziti_instance_s *ziti_instance = ziti_app_ctx(ziti_ctx);
 
+    ziti_tunneler_begin_intercept_batch(tnlr_ctx);
     model_map_iter it = model_map_iterator(&ziti_instance->intercepts);
     while(it) {
         ziti_intercept_t *zi_ctx = model_map_it_value(it);
@@ -595,6 +690,7 @@ void remove_intercepts(ziti_context ziti_ctx, void *tnlr_ctx) {
         }
         it = model_map_it_remove(it);
     }
+    ziti_tunneler_commit_intercept_batch(tnlr_ctx);
 }
 
 /** called by ziti sdk after ziti_close completes */
@@ -178,25 +178,74 @@ static void ip_dump(const tunnel_ip_stats *stats, dump_writer writer, void *writ
     int i;
 
     writer(writer_ctx, "\n=================\nMemory Pools:\n");
-    writer(writer_ctx, "%-16s%-12s%-12s%-12s\n", "Pool Name", "In Use", "Max Used", "Limit");
+    writer(writer_ctx, "%-16s%-12s%-12s%-12s%-12s\n", "Pool Name", "In Use", "Max Used", "Limit", "Exhausted");
     tunnel_ip_mem_pool_array pools = stats->pools;
     for (i = 0; pools[i] != NULL; i++) {
-        writer(writer_ctx, "%-16s%-12d%-12d%-12d\n", pools[i]->name, pools[i]->used, pools[i]->max, pools[i]->avail);
+        writer(writer_ctx, "%-16s%-12ld%-12ld%-12ld%-12ld\n", pools[i]->name, pools[i]->used, pools[i]->max, pools[i]->limit,
+               pools[i]->exhausted);
     }
 
     writer(writer_ctx, "\n=================\nIP Connections:\n");
-    writer(writer_ctx, "%-12s%-40s%-40s%-16s%-24s\n",
-           "Protocol", "Local Address", "Remote Address", "State", "Ziti Service");
+    writer(writer_ctx, "%-12s%-40s%-40s%-16s%-24s%-12s%-12s\n",
+           "Protocol", "Local Address", "Remote Address", "State", "Ziti Service", "Blocked ms", "Dropped");
     tunnel_ip_conn_array conns = stats->connections;
     char local_addr[64];
     char remote_addr[64];
     for (i = 0; conns[i] != NULL; i++) {
         snprintf(local_addr, sizeof(local_addr), "%s:%ld", conns[i]->local_ip, conns[i]->local_port);
         snprintf(remote_addr, sizeof(remote_addr), "%s:%ld", conns[i]->remote_ip, conns[i]->remote_port);
-        writer(writer_ctx, "%-12s%-40s%-40s%-16s%-24s\n",
-               conns[i]->protocol, local_addr, remote_addr, conns[i]->state, conns[i]->service);
+        writer(writer_ctx, "%-12s%-40s%-40s%-16s%-24s%-12ld%-12ld\n",
+               conns[i]->protocol, local_addr, remote_addr, conns[i]->state, conns[i]->service, conns[i]->blocked_ms,
+               conns[i]->dropped);
     }
 
+    if (stats->netif) {
+        const tunnel_netif_stats *netif = stats->netif;
+        writer(writer_ctx, "\n=================\nNetif Reads:\n");
+        writer(writer_ctx, "%-24s%ld\n", "Read Events", netif->read_events);
+        writer(writer_ctx, "%-24s%ld\n", "Packets Read", netif->packets_read);
+        writer(writer_ctx, "%-24s%ld/%ld packets, %ld usec\n", "Budget",
+               netif->budget_packets, netif->budget_max_packets, netif->budget_usec);
+        writer(writer_ctx, "%-24s%ld\n", "Packet Budget Exhausted", netif->count_budget_exhausted);
+        writer(writer_ctx, "%-24s%ld\n", "Time Budget Exhausted", netif->time_budget_exhausted);
+    }
+
+    if (stats->intercept_cache) {
+        const tunnel_intercept_cache_stats *cache = stats->intercept_cache;
+        writer(writer_ctx, "\n=================\nIntercept Cache:\n");
+        writer(writer_ctx, "%-24s%ld\n", "Size", cache->size);
+        writer(writer_ctx, "%-24s%ld\n", "Hits", cache->hits);
+        writer(writer_ctx, "%-24s%ld\n", "Misses", cache->misses);
+        writer(writer_ctx, "%-24s%ld\n", "Evictions", cache->evictions);
+        writer(writer_ctx, "%-24s%ld\n", "Uncacheable", cache->uncacheable);
+        writer(writer_ctx, "%-24s%ld\n", "Flushes", cache->flushes);
+        writer(writer_ctx, "%-24s%ld\n", "Invalidations", cache->invalidations);
+    }
+
+    if (stats->udp_services && stats->udp_services[0]) {
+        writer(writer_ctx, "\n=================\nUDP Services:\n");
+        writer(writer_ctx, "%-32s%-12s%-12s%-12s%-12s\n", "Ziti Service", "Flows", "Limit", "Reclaimed", "Refused");
+        tunnel_udp_service_stats_array udp = stats->udp_services;
+        for (i = 0; udp[i] != NULL; i++) {
+            writer(writer_ctx, "%-32s%-12ld%-12ld%-12ld%-12ld\n",
+                   udp[i]->service, udp[i]->flows, udp[i]->limit, udp[i]->reclaimed, udp[i]->refused);
+        }
+    }
+
+    if (stats->latency && stats->latency[0]) {
+        writer(writer_ctx, "\n=================\nLatency (usec):\n");
+        writer(writer_ctx, "%-32s%-12s%-12s%-12s%-12s%-12s%-12s%-12s%-12s\n",
+               "Ziti Service", "Stage", "Count", "Mean", "P50", "P90", "P99", "P99.9", "Max");
+        tunnel_service_latency_array services = stats->latency;
+        for (i = 0; services[i] != NULL; i++) {
+            for (int s = 0; services[i]->stages[s] != NULL; s++) {
+                const tunnel_latency_stage *st = services[i]->stages[s];
+                writer(writer_ctx, "%-32s%-12s%-12ld%-12ld%-12ld%-12ld%-12ld%-12ld%-12ld\n",
+                       services[i]->service, st->stage, st->count, st->mean_usec,
+                       st->p50_usec, st->p90_usec, st->p99_usec, st->p999_usec, st->max_usec);
+            }
+        }
+    }
 }
 
 static void disconnect_identity(ziti_context ziti_ctx, void *tnlr_ctx) {
@@ -1069,6 +1118,7 @@ static void on_ziti_event(ziti_context ztx, const ziti_event_t *event) {
             };
 
             bool send_event = false;
+            ziti_tunneler_begin_intercept_batch(CMD_CTX.tunnel_ctx);
             if (event->service.removed != NULL) {
                 ev.removed_services = event->service.removed;
                 for (zs = event->service.removed; *zs != NULL; zs++) {
@@ -1102,6 +1152,7 @@ static void on_ziti_event(ziti_context ztx, const ziti_event_t *event) {
                     CMD_CTX.on_event((const base_event *) &ev);
                 }
             }
+            ziti_tunneler_commit_intercept_batch(CMD_CTX.tunnel_ctx);
 
             ziti_tunnel_commit_routes(CMD_CTX.tunnel_ctx);
             break;
@@ -0,0 +1,179 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "mock_netif.h"
+
+#define MOCK_RX_INITIAL_CAP 1024
+#define MOCK_TX_SCRATCH_SIZE (0xffff + 1)
+
+static int mock_close(netif_handle dev) {
+    return 0;
+}
+
+static const char *mock_get_name(netif_handle dev) {
+    return "mock0";
+}
+
+static int mock_add_route(netif_handle dev, const char *dest) {
+    return 0;
+}
+
+static int mock_delete_route(netif_handle dev, const char *dest) {
+    return 0;
+}
+
+static int mock_read_batch(netif_handle dev, uv_buf_t *bufs, int nbufs) {
+    int n = 0;
+    while (n < nbufs && dev->rx_count > 0) {
+        struct mock_pkt_s *pkt = &dev->rx[dev->rx_head];
+        size_t copy = pkt->len < bufs[n].len ? pkt->len : bufs[n].len;
+        memcpy(bufs[n].base, pkt->data, copy);
+        bufs[n].len = pkt->len;
+        dev->rx_head = (dev->rx_head + 1) % dev->rx_cap;
+        dev->rx_count--;
+        dev->rx_packets++;
+        dev->rx_bytes += pkt->len;
+        if (dev->on_rx) {
+            dev->on_rx(pkt->tag, dev->ctx);
+        }
+        n++;
+    }
+    if (n > 0) {
+        dev->rx_batches++;
+    }
+    return n;
+}
+
+static ssize_t mock_read(netif_handle dev, void *buf, size_t buf_len) {
+    uv_buf_t b = uv_buf_init(buf, buf_len);
+    int n = mock_read_batch(dev, &b, 1);
+    return n > 0 ? (ssize_t) b.len : 0;
+}
+
+static ssize_t mock_write(netif_handle dev, const void *buf, size_t len) {
+    dev->tx_packets++;
+    dev->tx_bytes += len;
+    if (dev->on_tx) {
+        dev->on_tx(buf, len, dev->ctx);
+    }
+    return (ssize_t) len;
+}
+
+static ssize_t mock_writev(netif_handle dev, const uv_buf_t *bufs, int nbufs) {
+    size_t len = 0;
+    for (int i = 0; i < nbufs; i++) {
+        if (len + bufs[i].len > MOCK_TX_SCRATCH_SIZE) {
+            return -1;
+        }
+        memcpy(dev->tx_scratch + len, bufs[i].base, bufs[i].len);
+        len += bufs[i].len;
+    }
+    return mock_write(dev, dev->tx_scratch, len);
+}
+
+static int mock_write_batch(netif_handle dev, const uv_buf_t *bufs, int nbufs) {
+    for (int i = 0; i < nbufs; i++) {
+        mock_write(dev, bufs[i].base, bufs[i].len);
+    }
+    return nbufs;
+}
+
+netif_driver mock_netif_open(mock_rx_cb on_rx, mock_tx_cb on_tx, void *ctx) {
+    struct netif_handle_s *dev = calloc(1, sizeof(struct netif_handle_s));
+    netif_driver driver = calloc(1, sizeof(netif_driver_t));
+    if (dev == NULL || driver == NULL) {
+        free(dev);
+        free(driver);
+        return NULL;
+    }
+
+    dev->rx_cap = MOCK_RX_INITIAL_CAP;
+    dev->rx = calloc(dev->rx_cap, sizeof(struct mock_pkt_s));
+    dev->tx_scratch = malloc(MOCK_TX_SCRATCH_SIZE);
+    dev->on_rx = on_rx;
+    dev->on_tx = on_tx;
+    dev->ctx = ctx;
+
+    driver->handle       = dev;
+    driver->read         = mock_read;
+    driver->read_batch   = mock_read_batch;
+    driver->write        = mock_write;
+    driver->writev       = mock_writev;
+    driver->write_batch  = mock_write_batch;
+    driver->close        = mock_close;
+    driver->add_route    = mock_add_route;
+    driver->delete_route = mock_delete_route;
+    driver->get_name     = mock_get_name;
+
+    return driver;
+}
+
+void mock_netif_close(netif_driver driver) {
+    if (driver == NULL) {
+        return;
+    }
+    struct netif_handle_s *dev = driver->handle;
+    for (size_t i = 0; i < dev->rx_cap; i++) {
+        free(dev->rx[i].data);
+    }
+    free(dev->rx);
+    free(dev->tx_scratch);
+    free(dev);
+    free(driver);
+}
+
+static int grow_rx(netif_handle dev) {
+    size_t cap = dev->rx_cap * 2;
+    struct mock_pkt_s *rx = calloc(cap, sizeof(struct mock_pkt_s));
+    if (rx == NULL) {
+        return -1;
+    }
+    // unwrap the ring so the queued packets start at 0. the slots that were free keep their buffers
+    for (size_t i = 0; i < dev->rx_cap; i++) {
+        rx[i] = dev->rx[(dev->rx_head + i) % dev->rx_cap];
+    }
+    free(dev->rx);
+    dev->rx = rx;
+    dev->rx_head = 0;
+    dev->rx_cap = cap;
+    return 0;
+}
+
+int mock_netif_push(netif_handle dev, const void *pkt, size_t len, uint64_t tag) {
+    if (dev->rx_count == dev->rx_cap && grow_rx(dev) != 0) {
+        return -1;
+    }
+    struct mock_pkt_s *slot = &dev->rx[(dev->rx_head + dev->rx_count) % dev->rx_cap];
+    if (slot->cap < len) {
+        uint8_t *data = realloc(slot->data, len);
+        if (data == NULL) {
+            return -1;
+        }
+        slot->data = data;
+        slot->cap = len;
+    }
+    memcpy(slot->data, pkt, len);
+    slot->len = len;
+    slot->tag = tag;
+    dev->rx_count++;
+    return 0;
+}
+
+size_t mock_netif_pending(netif_handle dev) {
+    return dev->rx_count;
+}
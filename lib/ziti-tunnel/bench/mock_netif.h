@@ -0,0 +1,64 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+/**
+ * in-memory netif driver for benchmarks. packets are queued by the benchmark and handed to the
+ * tunneler through `read_batch`, and packets emitted by the tunneler are passed to a callback.
+ */
+
+#ifndef ZITI_TUNNELER_SDK_MOCK_NETIF_H
+#define ZITI_TUNNELER_SDK_MOCK_NETIF_H
+
+#include <stdint.h>
+#include "ziti/netif_driver.h"
+
+/** called when the tunneler reads the packet that was queued with `tag` */
+typedef void (*mock_rx_cb)(uint64_t tag, void *ctx);
+/** called for each packet written by the tunneler */
+typedef void (*mock_tx_cb)(const uint8_t *pkt, size_t len, void *ctx);
+
+struct mock_pkt_s {
+    uint8_t *data;
+    size_t cap;                // slot buffers are reused so queueing doesn't allocate in steady state
+    size_t len;
+    uint64_t tag;
+};
+
+struct netif_handle_s {
+    struct mock_pkt_s *rx;     // ring of queued packets
+    size_t rx_cap;
+    size_t rx_head;
+    size_t rx_count;
+    mock_rx_cb on_rx;
+    mock_tx_cb on_tx;
+    void *ctx;
+    uint8_t *tx_scratch;       // flattens packets written with writev
+
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_batches;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+};
+
+extern netif_driver mock_netif_open(mock_rx_cb on_rx, mock_tx_cb on_tx, void *ctx);
+extern void mock_netif_close(netif_driver driver);
+
+/** queue a copy of `pkt` to be read by the tunneler. returns 0 on success */
+extern int mock_netif_push(netif_handle dev, const void *pkt, size_t len, uint64_t tag);
+extern size_t mock_netif_pending(netif_handle dev);
+
+#endif //ZITI_TUNNELER_SDK_MOCK_NETIF_H
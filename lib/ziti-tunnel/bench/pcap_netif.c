@@ -0,0 +1,548 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pcap_netif.h"
+
+#define PCAP_MAGIC_USEC   0xa1b2c3d4u
+#define PCAP_MAGIC_NSEC   0xa1b23c4du
+#define PCAPNG_SHB        0x0a0d0d0au
+#define PCAPNG_IDB        0x00000001u
+#define PCAPNG_SPB        0x00000003u
+#define PCAPNG_EPB        0x00000006u
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4du
+
+#define LINKTYPE_NULL      0
+#define LINKTYPE_ETHERNET  1
+#define LINKTYPE_RAW       101
+#define LINKTYPE_LOOP      108
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4      228
+#define LINKTYPE_IPV6      229
+#define LINKTYPE_LINUX_SLL2 276
+
+#define MAX_RECORD_SIZE (16 * 1024 * 1024)
+#define TX_SCRATCH_SIZE (0xffff + 1)
+
+struct pcap_if_s {
+    uint16_t linktype;
+    uint8_t tsresol;     // pcapng if_tsresol. the default is microseconds
+};
+
+struct netif_handle_s {
+    FILE *in;
+    FILE *out;
+    bool ng;
+    bool swapped;
+    bool nsec;
+    uint32_t linktype;   // pcap link type. pcapng link types are per interface
+    struct pcap_if_s *ifs;
+    size_t nifs;
+
+    double speed;
+    bool started;
+    uint64_t start_ns;
+    uint64_t first_ts;
+
+    uint8_t *rec;
+    size_t rec_cap;
+
+    /* the next ip packet to be read, which points into `rec` */
+    bool have_next;
+    bool eof;
+    uint64_t next_ts;
+    const uint8_t *next_pkt;
+    size_t next_len;
+
+    uint8_t *tx_scratch;
+    struct pcap_netif_stats_s stats;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint16_t get16(netif_handle dev, const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return dev->swapped ? (uint16_t) (v >> 8 | v << 8) : v;
+}
+
+static uint32_t get32(netif_handle dev, const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    if (dev->swapped) {
+        v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+    }
+    return v;
+}
+
+static uint16_t be16(const uint8_t *p) {
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static bool read_rec(netif_handle dev, size_t len) {
+    if (len > MAX_RECORD_SIZE) {
+        return false;
+    }
+    if (len > dev->rec_cap) {
+        uint8_t *r = realloc(dev->rec, len);
+        if (r == NULL) {
+            return false;
+        }
+        dev->rec = r;
+        dev->rec_cap = len;
+    }
+    return fread(dev->rec, 1, len, dev->in) == len;
+}
+
+/** find the ip packet in a link layer frame */
+static bool frame_to_ip(uint32_t linktype, const uint8_t *frame, size_t len, const uint8_t **ip, size_t *ip_len) {
+    size_t off;
+    uint16_t proto = 0;
+    switch (linktype) {
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6:
+            off = 0;
+            break;
+        case LINKTYPE_NULL:
+        case LINKTYPE_LOOP:
+            // the address family is in host or network byte order, so rely on the ip version instead
+            off = 4;
+            break;
+        case LINKTYPE_ETHERNET:
+            off = 12;
+            if (len < off + 2) return false;
+            proto = be16(frame + off);
+            while ((proto == 0x8100 || proto == 0x88a8) && len >= off + 6) {
+                off += 4;
+                proto = be16(frame + off);
+            }
+            off += 2;
+            break;
+        case LINKTYPE_LINUX_SLL:
+            off = 16;
+            if (len < off) return false;
+            proto = be16(frame + 14);
+            break;
+        case LINKTYPE_LINUX_SLL2:
+            off = 20;
+            if (len < off) return false;
+            proto = be16(frame);
+            break;
+        default:
+            return false;
+    }
+    if (proto != 0 && proto != 0x0800 && proto != 0x86dd) {
+        return false;
+    }
+    if (len <= off) {
+        return false;
+    }
+    uint8_t version = frame[off] >> 4;
+    if (version != 4 && version != 6) {
+        return false;
+    }
+    *ip = frame + off;
+    *ip_len = len - off;
+    return true;
+}
+
+static uint64_t pcapng_ts_ns(const struct pcap_if_s *iface, uint64_t ts) {
+    uint8_t res = iface->tsresol;
+    if (res & 0x80) {
+        uint8_t shift = res & 0x7f;
+        if (shift >= 64) return 0;
+        return (ts >> shift) * 1000000000ull + (((ts & ((1ull << shift) - 1)) * 1000000000ull) >> shift);
+    }
+    uint64_t scale = 1;
+    if (res <= 9) {
+        for (int i = res; i < 9; i++) scale *= 10;
+        return ts * scale;
+    }
+    for (int i = 9; i < res && i < 19; i++) scale *= 10;
+    return ts / scale;
+}
+
+static bool pcapng_add_if(netif_handle dev, const uint8_t *body, size_t len) {
+    if (len < 8) {
+        return false;
+    }
+    struct pcap_if_s *ifs = realloc(dev->ifs, (dev->nifs + 1) * sizeof(struct pcap_if_s));
+    if (ifs == NULL) {
+        return false;
+    }
+    dev->ifs = ifs;
+    struct pcap_if_s *iface = &dev->ifs[dev->nifs++];
+    iface->linktype = get16(dev, body);
+    iface->tsresol = 6;
+    for (size_t off = 8; off + 4 <= len; ) {
+        uint16_t code = get16(dev, body + off);
+        uint16_t olen = get16(dev, body + off + 2);
+        if (code == 0 || off + 4 + olen > len) break;
+        if (code == 9 && olen >= 1) {
+            iface->tsresol = body[off + 4];
+        }
+        off += 4 + ((olen + 3u) & ~3u);
+    }
+    return true;
+}
+
+/** read the next pcapng block. sets `frame` when the block carries a packet */
+static bool pcapng_next(netif_handle dev, uint32_t *linktype, uint64_t *ts, const uint8_t **frame, size_t *len, uint32_t *orig_len) {
+    uint8_t hdr[8];
+    *frame = NULL;
+    if (fread(hdr, 1, sizeof(hdr), dev->in) != sizeof(hdr)) {
+        return false;
+    }
+    uint32_t type = get32(dev, hdr);
+    if (type == PCAPNG_SHB) {
+        uint8_t bom[4];
+        if (fread(bom, 1, sizeof(bom), dev->in) != sizeof(bom)) {
+            return false;
+        }
+        dev->swapped = false;
+        if (get32(dev, bom) != PCAPNG_BYTE_ORDER) {
+            dev->swapped = true;
+            if (get32(dev, bom) != PCAPNG_BYTE_ORDER) {
+                return false;
+            }
+        }
+        uint32_t block_len = get32(dev, hdr + 4);
+        if (block_len < 16) {
+            return false;
+        }
+        // interface ids are scoped to a section
+        dev->nifs = 0;
+        return read_rec(dev, block_len - 12);
+    }
+
+    uint32_t block_len = get32(dev, hdr + 4);
+    if (block_len < 12 || !read_rec(dev, block_len - 8)) {
+        return false;
+    }
+    const uint8_t *body = dev->rec;
+    size_t body_len = block_len - 12;
+
+    switch (type) {
+        case PCAPNG_IDB:
+            return pcapng_add_if(dev, body, body_len);
+        case PCAPNG_EPB: {
+            if (body_len < 20) return false;
+            uint32_t ifid = get32(dev, body);
+            if (ifid >= dev->nifs) return true;
+            uint64_t raw_ts = (uint64_t) get32(dev, body + 4) << 32 | get32(dev, body + 8);
+            uint32_t cap_len = get32(dev, body + 12);
+            if (cap_len > body_len - 20) return false;
+            *linktype = dev->ifs[ifid].linktype;
+            *ts = pcapng_ts_ns(&dev->ifs[ifid], raw_ts);
+            *orig_len = get32(dev, body + 16);
+            *frame = body + 20;
+            *len = cap_len;
+            return true;
+        }
+        case PCAPNG_SPB: {
+            if (body_len < 4 || dev->nifs == 0) return true;
+            *orig_len = get32(dev, body);
+            *len = *orig_len < body_len - 4 ? *orig_len : body_len - 4;
+            *linktype = dev->ifs[0].linktype;
+            *ts = dev->next_ts; // simple packets have no timestamp
+            *frame = body + 4;
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+static bool pcap_next(netif_handle dev, uint32_t *linktype, uint64_t *ts, const uint8_t **frame, size_t *len, uint32_t *orig_len) {
+    uint8_t hdr[16];
+    if (fread(hdr, 1, sizeof(hdr), dev->in) != sizeof(hdr)) {
+        return false;
+    }
+    uint32_t cap_len = get32(dev, hdr + 8);
+    if (!read_rec(dev, cap_len)) {
+        return false;
+    }
+    *linktype = dev->linktype;
+    *ts = (uint64_t) get32(dev, hdr) * 1000000000ull + (uint64_t) get32(dev, hdr + 4) * (dev->nsec ? 1 : 1000);
+    *orig_len = get32(dev, hdr + 12);
+    *frame = dev->rec;
+    *len = cap_len;
+    return true;
+}
+
+/** advance to the next ip packet in the capture */
+static void load_next(netif_handle dev) {
+    dev->have_next = false;
+    while (!dev->eof) {
+        uint32_t linktype = 0, orig_len = 0;
+        uint64_t ts = 0;
+        const uint8_t *frame = NULL;
+        size_t len = 0;
+        bool ok = dev->ng ? pcapng_next(dev, &linktype, &ts, &frame, &len, &orig_len) :
+                            pcap_next(dev, &linktype, &ts, &frame, &len, &orig_len);
+        if (!ok) {
+            dev->eof = true;
+            break;
+        }
+        if (frame == NULL) {
+            continue;
+        }
+        if (len < orig_len || !frame_to_ip(linktype, frame, len, &dev->next_pkt, &dev->next_len)) {
+            dev->stats.skipped++;
+            continue;
+        }
+        dev->next_ts = ts;
+        dev->have_next = true;
+        break;
+    }
+}
+
+static bool next_is_due(netif_handle dev) {
+    if (!dev->have_next) {
+        return false;
+    }
+    if (!dev->started) {
+        dev->started = true;
+        dev->start_ns = now_ns();
+        dev->first_ts = dev->next_ts;
+    }
+    if (dev->speed <= 0) {
+        return true;
+    }
+    uint64_t offset = dev->next_ts > dev->first_ts ? dev->next_ts - dev->first_ts : 0;
+    return (double) (now_ns() - dev->start_ns) * dev->speed >= (double) offset;
+}
+
+static int pcap_read_batch(netif_handle dev, uv_buf_t *bufs, int nbufs) {
+    int n = 0;
+    while (n < nbufs && next_is_due(dev)) {
+        size_t copy = dev->next_len < bufs[n].len ? dev->next_len : bufs[n].len;
+        memcpy(bufs[n].base, dev->next_pkt, copy);
+        bufs[n].len = dev->next_len;
+        dev->stats.packets++;
+        dev->stats.bytes += dev->next_len;
+        n++;
+        load_next(dev);
+    }
+    return n;
+}
+
+static ssize_t pcap_read(netif_handle dev, void *buf, size_t buf_len) {
+    uv_buf_t b = uv_buf_init(buf, buf_len);
+    return pcap_read_batch(dev, &b, 1) > 0 ? (ssize_t) b.len : 0;
+}
+
+static ssize_t pcap_write(netif_handle dev, const void *buf, size_t len) {
+    dev->stats.written++;
+    dev->stats.written_bytes += len;
+    if (dev->out == NULL) {
+        return (ssize_t) len;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint32_t hdr[4] = {
+            (uint32_t) ts.tv_sec,
+            (uint32_t) (ts.tv_nsec / 1000),
+            (uint32_t) len,
+            (uint32_t) len,
+    };
+    if (fwrite(hdr, sizeof(hdr), 1, dev->out) != 1 || fwrite(buf, 1, len, dev->out) != len) {
+        return -1;
+    }
+    return (ssize_t) len;
+}
+
+static ssize_t pcap_writev(netif_handle dev, const uv_buf_t *bufs, int nbufs) {
+    size_t len = 0;
+    for (int i = 0; i < nbufs; i++) {
+        if (len + bufs[i].len > TX_SCRATCH_SIZE) {
+            return -1;
+        }
+        memcpy(dev->tx_scratch + len, bufs[i].base, bufs[i].len);
+        len += bufs[i].len;
+    }
+    return pcap_write(dev, dev->tx_scratch, len);
+}
+
+static int pcap_write_batch(netif_handle dev, const uv_buf_t *bufs, int nbufs) {
+    for (int i = 0; i < nbufs; i++) {
+        if (pcap_write(dev, bufs[i].base, bufs[i].len) < 0) {
+            return i > 0 ? i : -1;
+        }
+    }
+    return nbufs;
+}
+
+static int pcap_close(netif_handle dev) {
+    return 0;
+}
+
+static const char *pcap_get_name(netif_handle dev) {
+    return "pcap0";
+}
+
+static int pcap_add_route(netif_handle dev, const char *dest) {
+    return 0;
+}
+
+static int pcap_delete_route(netif_handle dev, const char *dest) {
+    return 0;
+}
+
+static bool open_input(netif_handle dev, char *error, size_t error_len) {
+    uint8_t magic[4];
+    if (fread(magic, 1, sizeof(magic), dev->in) != sizeof(magic)) {
+        snprintf(error, error_len, "failed to read capture header");
+        return false;
+    }
+
+    dev->swapped = false;
+    uint32_t m = get32(dev, magic);
+    if (m == PCAPNG_SHB) {
+        dev->ng = true;
+        rewind(dev->in);
+        return true;
+    }
+    if (m != PCAP_MAGIC_USEC && m != PCAP_MAGIC_NSEC) {
+        dev->swapped = true;
+        m = get32(dev, magic);
+    }
+    if (m != PCAP_MAGIC_USEC && m != PCAP_MAGIC_NSEC) {
+        snprintf(error, error_len, "not a pcap or pcapng file");
+        return false;
+    }
+    dev->nsec = m == PCAP_MAGIC_NSEC;
+
+    uint8_t hdr[20];
+    if (fread(hdr, 1, sizeof(hdr), dev->in) != sizeof(hdr)) {
+        snprintf(error, error_len, "failed to read pcap header");
+        return false;
+    }
+    // the upper bits of the link type field hold the FCS length
+    dev->linktype = get32(dev, hdr + 16) & 0x0fffffff;
+    return true;
+}
+
+static bool open_output(netif_handle dev, const char *path, char *error, size_t error_len) {
+    dev->out = fopen(path, "wb");
+    if (dev->out == NULL) {
+        snprintf(error, error_len, "failed to open %s: %s", path, strerror(errno));
+        return false;
+    }
+    uint32_t magic = PCAP_MAGIC_USEC;
+    uint16_t version[2] = { 2, 4 };
+    uint32_t rest[4] = { 0, 0, 0xffff, LINKTYPE_RAW };
+    if (fwrite(&magic, sizeof(magic), 1, dev->out) != 1 ||
+        fwrite(version, sizeof(version), 1, dev->out) != 1 ||
+        fwrite(rest, sizeof(rest), 1, dev->out) != 1) {
+        snprintf(error, error_len, "failed to write pcap header to %s", path);
+        return false;
+    }
+    return true;
+}
+
+netif_driver pcap_netif_open(const char *in_path, const char *out_path, double speed, char *error, size_t error_len) {
+    struct netif_handle_s *dev = calloc(1, sizeof(struct netif_handle_s));
+    netif_driver driver = calloc(1, sizeof(netif_driver_t));
+    if (dev == NULL || driver == NULL) {
+        snprintf(error, error_len, "failed to allocate pcap driver");
+        goto fail;
+    }
+    driver->handle = dev;
+    dev->speed = speed;
+
+    dev->in = fopen(in_path, "rb");
+    if (dev->in == NULL) {
+        snprintf(error, error_len, "failed to open %s: %s", in_path, strerror(errno));
+        goto fail;
+    }
+    if (!open_input(dev, error, error_len)) {
+        goto fail;
+    }
+    if (out_path != NULL && !open_output(dev, out_path, error, error_len)) {
+        goto fail;
+    }
+    dev->tx_scratch = malloc(TX_SCRATCH_SIZE);
+    if (dev->tx_scratch == NULL) {
+        snprintf(error, error_len, "failed to allocate pcap driver");
+        goto fail;
+    }
+
+    driver->read         = pcap_read;
+    driver->read_batch   = pcap_read_batch;
+    driver->write        = pcap_write;
+    driver->writev       = pcap_writev;
+    driver->write_batch  = pcap_write_batch;
+    driver->close        = pcap_close;
+    driver->add_route    = pcap_add_route;
+    driver->delete_route = pcap_delete_route;
+    driver->get_name     = pcap_get_name;
+
+    load_next(dev);
+    return driver;
+
+fail:
+    if (driver) {
+        driver->handle = dev;
+        pcap_netif_close(driver);
+    } else {
+        free(dev);
+    }
+    return NULL;
+}
+
+void pcap_netif_close(netif_driver driver) {
+    if (driver == NULL) {
+        return;
+    }
+    struct netif_handle_s *dev = driver->handle;
+    if (dev) {
+        if (dev->in) fclose(dev->in);
+        if (dev->out) fclose(dev->out);
+        free(dev->ifs);
+        free(dev->rec);
+        free(dev->tx_scratch);
+        free(dev);
+    }
+    free(driver);
+}
+
+bool pcap_netif_eof(netif_driver driver) {
+    return !driver->handle->have_next;
+}
+
+uint64_t pcap_netif_next_due(netif_driver driver) {
+    netif_handle dev = driver->handle;
+    if (!dev->have_next || next_is_due(dev)) {
+        return 0;
+    }
+    uint64_t offset = (uint64_t) ((double) (dev->next_ts - dev->first_ts) / dev->speed);
+    uint64_t elapsed = now_ns() - dev->start_ns;
+    return offset > elapsed ? offset - elapsed : 0;
+}
+
+void pcap_netif_get_stats(netif_driver driver, struct pcap_netif_stats_s *stats) {
+    *stats = driver->handle->stats;
+}
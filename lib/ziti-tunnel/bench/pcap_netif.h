@@ -0,0 +1,53 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+/**
+ * netif driver that replays the ip packets from a pcap or pcapng capture, and optionally
+ * writes the packets that the tunneler emits to a pcap file (LINKTYPE_RAW).
+ *
+ * supported link types: raw ip, ipv4, ipv6, ethernet (with vlan tags), linux cooked (v1 and v2) and bsd loopback.
+ * frames that do not carry an ip packet, or were truncated by the capture's snaplen, are skipped.
+ */
+
+#ifndef ZITI_TUNNELER_SDK_PCAP_NETIF_H
+#define ZITI_TUNNELER_SDK_PCAP_NETIF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ziti/netif_driver.h"
+
+struct pcap_netif_stats_s {
+    uint64_t packets;    // ip packets read by the tunneler
+    uint64_t bytes;
+    uint64_t skipped;    // frames that were not ip, or were truncated
+    uint64_t written;    // packets written by the tunneler
+    uint64_t written_bytes;
+};
+
+/**
+ * open `in_path` for replay. `out_path` is optional.
+ * `speed` scales the capture's timing: 1.0 replays in real time, 2.0 twice as fast, and 0 as fast as possible.
+ */
+extern netif_driver pcap_netif_open(const char *in_path, const char *out_path, double speed, char *error, size_t error_len);
+extern void pcap_netif_close(netif_driver driver);
+
+/** true after the last packet has been read */
+extern bool pcap_netif_eof(netif_driver driver);
+/** nanoseconds until the next packet is due, 0 if a packet can be read now */
+extern uint64_t pcap_netif_next_due(netif_driver driver);
+extern void pcap_netif_get_stats(netif_driver driver, struct pcap_netif_stats_s *stats);
+
+#endif //ZITI_TUNNELER_SDK_PCAP_NETIF_H
@@ -0,0 +1,920 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+/**
+ * packet-processing micro-benchmark. the tunneler is driven with synthetic packets through an in-memory
+ * netif driver, and the ziti_sdk_* callbacks are stubbed so that dials complete and writes are acked
+ * without a network. the stubs defer completions until the current batch of packets has been processed,
+ * which is what the ziti sdk does when it runs on the same loop.
+ *
+ * scenarios:
+ *   syn - a SYN flood from unique clients. latency is measured from netif read to ziti_dial.
+ *   tcp - established connections streaming data. latency is measured from netif read to ziti_write.
+ *   udp - datagram bursts over a set of flows. latency is measured from netif read to ziti_write.
+ *
+ * captured traffic can be replayed instead (-f) through a pcap netif driver. the replay reports the time spent
+ * in each netif_shim_input() call, since captured packets can't be matched to the writes they cause.
+ */
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ziti/ziti_tunnel.h"
+#include "lwip/memp.h"
+#include "lwip/stats.h"
+#include "lwip/tcp.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/timeouts.h"
+#include "netif_shim.h"
+#include "mock_netif.h"
+#include "pcap_netif.h"
+
+#define BENCH_SERVICE_CIDR "100.64.0.0/10"
+#define BENCH_SERVICE_IP   0x64400001u  // 100.64.0.1
+#define BENCH_TCP_PORT     443
+#define BENCH_UDP_PORT     5000
+#define FLOW_PORT_BASE     1024
+#define FLOW_PORTS         60000
+#define MAX_PAYLOAD        9000
+#define NO_TAG             UINT64_MAX
+#define STALL_TIMEOUT_NS   (5 * 1000000000ull)
+#define MAX_INTERCEPTS     16
+#define MAX_REPLAY_SLEEP_NS 10000000ull
+
+#define TH_FIN 0x01
+#define TH_SYN 0x02
+#define TH_RST 0x04
+#define TH_PSH 0x08
+#define TH_ACK 0x10
+
+#if BENCH_WRAP_MALLOC
+/* the bench is linked with --wrap so that allocations made by the tunneler, lwip and libuv are counted */
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t n, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    alloc_count++;
+    alloc_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+enum scenario_e {
+    SCN_SYN,
+    SCN_TCP,
+    SCN_UDP,
+    SCN_REPLAY,
+};
+
+static const char *scenario_names[] = { "syn", "tcp", "udp", "replay" };
+
+struct bench_opts_s {
+    int scenarios;       // bitmask of (1 << scenario_e)
+    size_t packets;
+    size_t flows;
+    size_t payload;
+    size_t burst;
+    int read_max_packets;
+    int read_max_usec;
+    const char *replay_in;
+    const char *replay_out;
+    double replay_speed;
+    const char *intercepts[MAX_INTERCEPTS];
+    int num_intercepts;
+};
+
+struct flow_s {
+    io_ctx_t *io;
+    uint32_t ip;
+    uint16_t port;
+    uint32_t snd_nxt;    // next sequence number sent by the client
+    uint32_t snd_una;    // highest sequence number acked by the tunneler
+    uint32_t rcv_nxt;    // next sequence number expected from the tunneler
+    uint32_t wnd;        // window advertised by the tunneler
+    uint64_t delivered;  // bytes written to ziti
+    bool established;
+    bool reset;
+};
+
+struct bench_s {
+    struct bench_opts_s opts;
+    netif_driver driver;
+    tunneler_context tnlr;
+    enum scenario_e scenario;
+    int client_net;
+
+    struct flow_s *flows;
+    size_t nflows;
+
+    uint64_t *rx_ns;     // netif read time, indexed by tag
+    size_t ntags;
+    uint64_t *lat;       // latency samples in nanoseconds
+    size_t nlat;
+    size_t lat_cap;
+    uint64_t input_calls;
+
+    struct flow_s **dials; // dials that complete after the current batch is processed
+    size_t ndials;
+    size_t dials_cap;
+    struct write_ctx_s **acks;
+    size_t nacks;
+    size_t acks_cap;
+
+    struct flow_s **replay_flows; // replayed connections are allocated as they are dialed
+    size_t nreplay_flows;
+    size_t replay_flows_cap;
+
+    uint8_t *pkt;
+    uint64_t synacks;
+    uint64_t resets;
+};
+
+static struct bench_s B;
+
+static void wr16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static void wr32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static uint16_t rd16(const uint8_t *p) {
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint32_t rd32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, size_t len) {
+    for (; len > 1; p += 2, len -= 2) {
+        sum += rd16(p);
+    }
+    if (len) {
+        sum += (uint32_t) p[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t) ~sum;
+}
+
+/** write an ipv4 header followed by the checksum of an `l4_len` byte transport segment that is already in place */
+static size_t build_ipv4(uint8_t *pkt, uint8_t proto, uint32_t src, uint32_t dst, size_t l4_len) {
+    static uint16_t ip_id;
+    memset(pkt, 0, 20);
+    pkt[0] = 0x45;
+    wr16(pkt + 2, (uint16_t) (20 + l4_len));
+    wr16(pkt + 4, ip_id++);
+    wr16(pkt + 6, 0x4000); // DF
+    pkt[8] = 64;
+    pkt[9] = proto;
+    wr32(pkt + 12, src);
+    wr32(pkt + 16, dst);
+    wr16(pkt + 10, csum_fold(csum_add(0, pkt, 20)));
+
+    uint8_t pseudo[12];
+    memcpy(pseudo, pkt + 12, 8);
+    pseudo[8] = 0;
+    pseudo[9] = proto;
+    wr16(pseudo + 10, (uint16_t) l4_len);
+    uint8_t *l4 = pkt + 20;
+    int csum_off = proto == 6 ? 16 : 6;
+    uint16_t csum = csum_fold(csum_add(csum_add(0, pseudo, sizeof(pseudo)), l4, l4_len));
+    if (proto == 17 && csum == 0) csum = 0xffff;
+    wr16(l4 + csum_off, csum);
+    return 20 + l4_len;
+}
+
+static uint32_t client_ip(size_t idx) {
+    return 0x0a000000u | (uint32_t) B.client_net << 16 | (uint32_t) (idx / FLOW_PORTS + 1);
+}
+
+static uint16_t client_port(size_t idx) {
+    return (uint16_t) (FLOW_PORT_BASE + idx % FLOW_PORTS);
+}
+
+static struct flow_s *flow_lookup(uint32_t ip, uint16_t port) {
+    if ((ip >> 16) != (0x0a00u | B.client_net) || (ip & 0xffff) == 0 || port < FLOW_PORT_BASE) {
+        return NULL;
+    }
+    size_t idx = ((ip & 0xffff) - 1) * FLOW_PORTS + (port - FLOW_PORT_BASE);
+    return idx < B.nflows ? &B.flows[idx] : NULL;
+}
+
+static struct flow_s *flow_from_client(const char *client) {
+    unsigned a, b, c, d, port;
+    if (client == NULL || sscanf(client, "%*[a-z]:%u.%u.%u.%u:%u", &a, &b, &c, &d, &port) != 5) {
+        return NULL;
+    }
+    return flow_lookup(a << 24 | b << 16 | c << 8 | d, (uint16_t) port);
+}
+
+static void *grow(void *arr, size_t *cap, size_t elem) {
+    size_t c = *cap ? *cap * 2 : 1024;
+    void *n = realloc(arr, c * elem);
+    if (n == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    *cap = c;
+    return n;
+}
+
+static void add_sample(uint64_t ns) {
+    if (B.nlat == B.lat_cap) {
+        B.lat = grow(B.lat, &B.lat_cap, sizeof(B.lat[0]));
+    }
+    B.lat[B.nlat++] = ns;
+}
+
+static void add_latency(uint64_t tag) {
+    if (tag < B.ntags && B.rx_ns[tag] != 0) {
+        add_sample(uv_hrtime() - B.rx_ns[tag]);
+        B.rx_ns[tag] = 0;
+    }
+}
+
+static void fill_payload(uint8_t *p, size_t len, uint64_t tag) {
+    memset(p, 0x5a, len);
+    if (len >= sizeof(tag)) {
+        memcpy(p, &tag, sizeof(tag));
+    }
+}
+
+static void send_tcp(struct flow_s *f, uint8_t flags, size_t payload, uint64_t tag) {
+    uint8_t *th = B.pkt + 20;
+    size_t thl = (flags & TH_SYN) ? 24 : 20;
+    memset(th, 0, thl);
+    wr16(th, f->port);
+    wr16(th + 2, BENCH_TCP_PORT);
+    wr32(th + 4, f->snd_nxt);
+    wr32(th + 8, (flags & TH_ACK) ? f->rcv_nxt : 0);
+    th[12] = (uint8_t) ((thl / 4) << 4);
+    th[13] = flags;
+    wr16(th + 14, 0xffff);
+    if (flags & TH_SYN) {
+        th[20] = 2; // MSS
+        th[21] = 4;
+        wr16(th + 22, 1460);
+    }
+    fill_payload(th + thl, payload, tag);
+    size_t len = build_ipv4(B.pkt, 6, f->ip, BENCH_SERVICE_IP, thl + payload);
+
+    f->snd_nxt += (uint32_t) payload + ((flags & (TH_SYN | TH_FIN)) ? 1 : 0);
+    mock_netif_push(B.driver->handle, B.pkt, len, tag);
+}
+
+static void send_udp(struct flow_s *f, size_t payload, uint64_t tag) {
+    uint8_t *uh = B.pkt + 20;
+    wr16(uh, f->port);
+    wr16(uh + 2, BENCH_UDP_PORT);
+    wr16(uh + 4, (uint16_t) (8 + payload));
+    wr16(uh + 6, 0);
+    fill_payload(uh + 8, payload, tag);
+    size_t len = build_ipv4(B.pkt, 17, f->ip, BENCH_SERVICE_IP, 8 + payload);
+    mock_netif_push(B.driver->handle, B.pkt, len, tag);
+}
+
+/** plays the client side of intercepted tcp connections */
+static void on_tunnel_tx(const uint8_t *pkt, size_t len, void *ctx) {
+    if (len < 40 || (pkt[0] >> 4) != 4 || pkt[9] != 6) {
+        return;
+    }
+    const uint8_t *th = pkt + (pkt[0] & 0xf) * 4;
+    struct flow_s *f = flow_lookup(rd32(pkt + 16), rd16(th + 2));
+    if (f == NULL) {
+        return;
+    }
+
+    uint8_t flags = th[13];
+    uint32_t seq = rd32(th + 4);
+    uint32_t ack = rd32(th + 8);
+    if (flags & TH_RST) {
+        f->reset = true;
+        B.resets++;
+        return;
+    }
+    if ((flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+        B.synacks++;
+        f->rcv_nxt = seq + 1;
+        f->snd_una = ack;
+        f->wnd = rd16(th + 14);
+        if (B.scenario == SCN_TCP && !f->established) {
+            f->established = true;
+            send_tcp(f, TH_ACK, 0, NO_TAG);
+        }
+        return;
+    }
+    if (flags & TH_ACK) {
+        if ((int32_t) (ack - f->snd_una) > 0) {
+            f->snd_una = ack;
+        }
+        f->wnd = rd16(th + 14);
+    }
+}
+
+static void on_mock_rx(uint64_t tag, void *ctx) {
+    if (tag < B.ntags) {
+        B.rx_ns[tag] = uv_hrtime();
+    }
+}
+
+static void *bench_dial(const void *app_intercept_ctx, io_ctx_t *io) {
+    struct flow_s *f;
+    if (B.scenario == SCN_REPLAY) {
+        f = calloc(1, sizeof(struct flow_s));
+        if (B.nreplay_flows == B.replay_flows_cap) {
+            B.replay_flows = grow(B.replay_flows, &B.replay_flows_cap, sizeof(B.replay_flows[0]));
+        }
+        B.replay_flows[B.nreplay_flows++] = f;
+    } else {
+        f = flow_from_client(get_client_address(io->tnlr_io));
+    }
+    if (f == NULL) {
+        return NULL;
+    }
+    f->io = io;
+    io->ziti_io = f;
+    if (B.scenario == SCN_SYN) {
+        add_latency((uint64_t) (f - B.flows));
+    }
+    if (B.ndials == B.dials_cap) {
+        B.dials = grow(B.dials, &B.dials_cap, sizeof(B.dials[0]));
+    }
+    B.dials[B.ndials++] = f;
+    return f;
+}
+
+static ssize_t bench_write(const void *ziti_io_ctx, void *write_ctx, const void *data, size_t len) {
+    struct flow_s *f = (struct flow_s *) ziti_io_ctx;
+    const uint8_t *d = data;
+    if (B.scenario == SCN_TCP) {
+        // segments carry their tag in the first bytes, and lwip may hand over several segments at once
+        uint64_t start = f->delivered;
+        uint64_t first = (start + B.opts.payload - 1) / B.opts.payload * B.opts.payload;
+        for (uint64_t off = first; off + sizeof(uint64_t) <= start + len; off += B.opts.payload) {
+            uint64_t tag;
+            memcpy(&tag, d + (off - start), sizeof(tag));
+            add_latency(tag);
+        }
+    } else if (B.scenario == SCN_UDP && len >= sizeof(uint64_t)) {
+        uint64_t tag;
+        memcpy(&tag, d, sizeof(tag));
+        add_latency(tag);
+    }
+    f->delivered += len;
+
+    if (B.nacks == B.acks_cap) {
+        B.acks = grow(B.acks, &B.acks_cap, sizeof(B.acks[0]));
+    }
+    B.acks[B.nacks++] = write_ctx;
+    return (ssize_t) len;
+}
+
+static int bench_close(void *ziti_io_ctx) {
+    struct flow_s *f = ziti_io_ctx;
+    if (f != NULL && f->io != NULL) {
+        io_ctx_t *io = f->io;
+        f->io = NULL;
+        ziti_tunneler_close(io->tnlr_io);
+        free(io);
+    }
+    return 0;
+}
+
+static int bench_close_write(void *ziti_io_ctx) {
+    return 0;
+}
+
+static host_ctx_t *bench_host(void *ziti_ctx, uv_loop_t *loop, const char *service_name, cfg_type_e cfg_type, const void *cfg) {
+    return NULL;
+}
+
+static void run_deferred(void) {
+    for (size_t i = 0; i < B.ndials; i++) {
+        struct flow_s *f = B.dials[i];
+        if (f->io != NULL) {
+            ziti_tunneler_dial_completed(f->io, true);
+        }
+    }
+    B.ndials = 0;
+
+    for (size_t i = 0; i < B.nacks; i++) {
+        ziti_tunneler_ack(B.acks[i]);
+    }
+    B.nacks = 0;
+}
+
+/** process queued packets and deferred completions until there is nothing left to do */
+static void pump(void) {
+    do {
+        while (mock_netif_pending(B.driver->handle) > 0) {
+            netif_shim_input(netif_default);
+            B.input_calls++;
+            run_deferred();
+        }
+        run_deferred();
+        sys_check_timeouts();
+    } while (mock_netif_pending(B.driver->handle) > 0);
+}
+
+static void flows_init(size_t n) {
+    B.flows = calloc(n, sizeof(struct flow_s));
+    B.nflows = n;
+    for (size_t i = 0; i < n; i++) {
+        B.flows[i].ip = client_ip(i);
+        B.flows[i].port = client_port(i);
+        B.flows[i].snd_nxt = 1000 + (uint32_t) i;
+    }
+}
+
+static void flows_cleanup(void) {
+    run_deferred();
+    while (tcp_active_pcbs != NULL) {
+        tcp_abort(tcp_active_pcbs);
+    }
+    while (tcp_tw_pcbs != NULL) {
+        tcp_abort(tcp_tw_pcbs);
+    }
+    for (size_t i = 0; i < B.nflows; i++) {
+        bench_close(&B.flows[i]);
+    }
+    for (size_t i = 0; i < B.nreplay_flows; i++) {
+        bench_close(B.replay_flows[i]);
+        free(B.replay_flows[i]);
+    }
+    if (B.scenario != SCN_REPLAY) {
+        pump();
+    }
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+
+    free(B.flows);
+    B.flows = NULL;
+    B.nflows = 0;
+    free(B.replay_flows);
+    B.replay_flows = NULL;
+    B.nreplay_flows = 0;
+    B.replay_flows_cap = 0;
+}
+
+static const struct {
+    memp_t id;
+    const char *name;
+} bench_pools[] = {
+        { MEMP_TCP_PCB, "TCP_PCB" },
+        { MEMP_TCP_SEG, "TCP_SEG" },
+        { MEMP_UDP_PCB, "UDP_PCB" },
+        { MEMP_PBUF, "PBUF" },
+        { MEMP_PBUF_POOL, "PBUF_POOL" },
+};
+
+static void reset_lwip_stats(void) {
+    for (size_t i = 0; i < sizeof(bench_pools) / sizeof(bench_pools[0]); i++) {
+        struct stats_mem *s = memp_pools[bench_pools[i].id]->stats;
+        s->max = s->used;
+        s->err = 0;
+    }
+    lwip_stats.mem.max = lwip_stats.mem.used;
+    lwip_stats.mem.err = 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double q) {
+    if (B.nlat == 0) return 0;
+    size_t i = (size_t) (q * (double) B.nlat);
+    if (i >= B.nlat) i = B.nlat - 1;
+    return (double) B.lat[i] / 1000.0;
+}
+
+struct snapshot_s {
+    uint64_t ns;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t input_calls;
+    uint64_t tx_packets;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+};
+
+static void snapshot(struct snapshot_s *s) {
+    if (B.scenario == SCN_REPLAY) {
+        struct pcap_netif_stats_s stats;
+        pcap_netif_get_stats(B.driver, &stats);
+        s->rx_packets = stats.packets;
+        s->rx_bytes = stats.bytes;
+        s->tx_packets = stats.written;
+    } else {
+        netif_handle dev = B.driver->handle;
+        s->rx_packets = dev->rx_packets;
+        s->rx_bytes = dev->rx_bytes;
+        s->tx_packets = dev->tx_packets;
+    }
+    s->input_calls = B.input_calls;
+#if BENCH_WRAP_MALLOC
+    s->allocs = alloc_count;
+    s->alloc_bytes = alloc_bytes;
+#endif
+    s->ns = uv_hrtime();
+}
+
+static void report(const struct snapshot_s *start, const struct snapshot_s *end, const char *extra) {
+    uint64_t ns = end->ns - start->ns;
+    uint64_t pkts = end->rx_packets - start->rx_packets;
+    uint64_t bytes = end->rx_bytes - start->rx_bytes;
+    uint64_t calls = end->input_calls - start->input_calls;
+    double secs = (double) ns / 1e9;
+
+    qsort(B.lat, B.nlat, sizeof(B.lat[0]), cmp_u64);
+
+    printf("%s: %" PRIu64 " packets in %.1f ms, %.1f kpps, %.1f Mbit/s, %.1f packets/input, %" PRIu64 " packets written%s\n",
+           scenario_names[B.scenario], pkts, (double) ns / 1e6, secs > 0 ? (double) pkts / secs / 1e3 : 0,
+           secs > 0 ? (double) bytes * 8 / secs / 1e6 : 0, calls ? (double) pkts / (double) calls : 0,
+           end->tx_packets - start->tx_packets, extra);
+    printf("  %s (us): samples=%zu p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+           B.scenario == SCN_REPLAY ? "input call" : "latency", B.nlat, percentile_us(0.5), percentile_us(0.9), percentile_us(0.99), percentile_us(0.999),
+           B.nlat ? (double) B.lat[B.nlat - 1] / 1000.0 : 0);
+#if BENCH_WRAP_MALLOC
+    uint64_t allocs = end->allocs - start->allocs;
+    printf("  allocations: %" PRIu64 " (%.2f/packet), %" PRIu64 " bytes (%.1f/packet)\n",
+           allocs, pkts ? (double) allocs / (double) pkts : 0, end->alloc_bytes - start->alloc_bytes,
+           pkts ? (double) (end->alloc_bytes - start->alloc_bytes) / (double) pkts : 0);
+#endif
+    printf("  lwip pools:");
+    for (size_t i = 0; i < sizeof(bench_pools) / sizeof(bench_pools[0]); i++) {
+        struct stats_mem *s = memp_pools[bench_pools[i].id]->stats;
+        printf(" %s[max=%d/%d err=%d]", bench_pools[i].name, (int) s->max, (int) s->avail, (int) s->err);
+    }
+    printf(" heap[max=%d err=%d]\n", (int) lwip_stats.mem.max, (int) lwip_stats.mem.err);
+}
+
+static void scenario_begin(enum scenario_e s, size_t flows, size_t tags) {
+    B.scenario = s;
+    B.client_net++;
+    flows_init(flows);
+    B.ntags = tags;
+    B.rx_ns = calloc(tags, sizeof(uint64_t));
+    B.lat = calloc(tags, sizeof(uint64_t));
+    B.lat_cap = tags;
+    B.nlat = 0;
+    B.synacks = 0;
+    B.resets = 0;
+    reset_lwip_stats();
+}
+
+static void scenario_end(void) {
+    flows_cleanup();
+    free(B.rx_ns);
+    free(B.lat);
+    B.rx_ns = NULL;
+    B.lat = NULL;
+    B.lat_cap = 0;
+    B.nlat = 0;
+    B.ntags = 0;
+}
+
+static void run_syn_flood(void) {
+    size_t n = B.opts.packets;
+    scenario_begin(SCN_SYN, n, n);
+
+    struct snapshot_s start, end;
+    snapshot(&start);
+    for (size_t i = 0; i < n; i++) {
+        send_tcp(&B.flows[i], TH_SYN, 0, i);
+        if ((i + 1) % B.opts.burst == 0) pump();
+    }
+    pump();
+    snapshot(&end);
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), ", %zu dials, %" PRIu64 " SYN-ACKs, %" PRIu64 " resets", B.nlat, B.synacks, B.resets);
+    report(&start, &end, extra);
+    scenario_end();
+}
+
+static void run_tcp_stream(void) {
+    size_t conns = B.opts.flows ? B.opts.flows : 32;
+    size_t n = B.opts.packets;
+    size_t payload = B.opts.payload;
+    scenario_begin(SCN_TCP, conns, n);
+
+    for (size_t i = 0; i < conns; i++) {
+        send_tcp(&B.flows[i], TH_SYN, 0, NO_TAG);
+    }
+    pump();
+    size_t established = 0;
+    for (size_t i = 0; i < conns; i++) {
+        if (B.flows[i].established) established++;
+    }
+    if (established == 0) {
+        fprintf(stderr, "tcp: no connections were established\n");
+        scenario_end();
+        return;
+    }
+
+    struct snapshot_s start, end;
+    snapshot(&start);
+    size_t sent = 0;
+    uint64_t last_progress = start.ns;
+    size_t last_nlat = 0;
+    while (B.nlat < sent || sent < n) {
+        size_t queued = 0;
+        for (size_t i = 0; i < conns && sent < n; i++) {
+            struct flow_s *f = &B.flows[i];
+            // keep the window full, but queue no more than a burst per connection between pumps
+            for (size_t k = 0; k < B.opts.burst / conns + 1 && sent < n; k++) {
+                if (!f->established || f->reset || (f->snd_nxt - f->snd_una) + payload > f->wnd) break;
+                send_tcp(f, TH_ACK | TH_PSH, payload, sent++);
+                queued++;
+            }
+        }
+        pump();
+
+        uint64_t now = uv_hrtime();
+        if (queued > 0 || B.nlat != last_nlat) {
+            last_progress = now;
+            last_nlat = B.nlat;
+        } else if (now - last_progress > STALL_TIMEOUT_NS) {
+            fprintf(stderr, "tcp: stalled after %zu of %zu segments were delivered\n", B.nlat, n);
+            break;
+        }
+    }
+    snapshot(&end);
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), ", %zu/%zu connections", established, conns);
+    report(&start, &end, extra);
+    scenario_end();
+}
+
+static void run_udp_burst(void) {
+    size_t flows = B.opts.flows ? B.opts.flows : 8;
+    size_t n = B.opts.packets;
+    scenario_begin(SCN_UDP, flows, n);
+
+    struct snapshot_s start, end;
+    snapshot(&start);
+    for (size_t i = 0; i < n; i++) {
+        send_udp(&B.flows[i % flows], B.opts.payload, i);
+        if ((i + 1) % B.opts.burst == 0) pump();
+    }
+    pump();
+    snapshot(&end);
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), ", %zu delivered", B.nlat);
+    report(&start, &end, extra);
+    scenario_end();
+}
+
+static void replay_sleep(uint64_t ns) {
+    if (ns > MAX_REPLAY_SLEEP_NS) ns = MAX_REPLAY_SLEEP_NS;
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = (long) ns };
+    nanosleep(&ts, NULL);
+}
+
+static void run_replay(void) {
+    B.scenario = SCN_REPLAY;
+    reset_lwip_stats();
+
+    struct snapshot_s start, end;
+    snapshot(&start);
+    while (!pcap_netif_eof(B.driver)) {
+        uint64_t due = pcap_netif_next_due(B.driver);
+        if (due > 0) {
+            replay_sleep(due);
+        } else {
+            uint64_t t = uv_hrtime();
+            netif_shim_input(netif_default);
+            add_sample(uv_hrtime() - t);
+            B.input_calls++;
+        }
+        run_deferred();
+        sys_check_timeouts();
+    }
+    run_deferred();
+    snapshot(&end);
+
+    struct pcap_netif_stats_s stats;
+    pcap_netif_get_stats(B.driver, &stats);
+    char extra[128];
+    snprintf(extra, sizeof(extra), ", %zu connections dialed, %" PRIu64 " frames skipped", B.nreplay_flows, stats.skipped);
+    report(&start, &end, extra);
+    flows_cleanup();
+    free(B.lat);
+    B.lat = NULL;
+    B.lat_cap = 0;
+    B.nlat = 0;
+}
+
+static void bench_logger(int level, const char *module, const char *file, unsigned int line, const char *func, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "[%d] %s:%u %s(): ", level, file, line, func);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s syn|tcp|udp|all] [-n packets] [-c flows] [-p payload] [-b burst] [-r packets[:usec]] [-v level]\n"
+            "       %s -f capture [-w output] [-S speed] [-i address]... [-r packets[:usec]] [-v level]\n"
+            "\t-s\tscenario to run (default all)\n"
+            "\t-n\tnumber of packets per scenario (default 100000)\n"
+            "\t-c\tconcurrent flows for tcp and udp (default 32 and 8)\n"
+            "\t-p\tpayload bytes per packet (default 1400)\n"
+            "\t-b\tpackets queued before the tunneler processes them (default 256)\n"
+            "\t-f\treplay the ip packets in a pcap or pcapng file instead of running scenarios\n"
+            "\t-w\twrite the packets emitted by the tunneler to a pcap file\n"
+            "\t-S\treplay speed relative to the capture's timing. 0 replays as fast as possible (default 0)\n"
+            "\t-i\tintercepted address or cidr, may be repeated (default %s, or everything when replaying)\n"
+            "\t-r\tnetif read budget per readable event\n"
+            "\t-v\ttunneler log level\n", prog, prog, BENCH_SERVICE_CIDR);
+}
+
+int main(int argc, char *argv[]) {
+    B.opts.scenarios = (1 << SCN_SYN) | (1 << SCN_TCP) | (1 << SCN_UDP);
+    B.opts.packets = 100000;
+    B.opts.payload = 1400;
+    B.opts.burst = 256;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:n:c:p:b:r:f:w:S:i:v:h")) != -1) {
+        switch (c) {
+            case 's':
+                if (strcmp(optarg, "all") == 0) break;
+                B.opts.scenarios = 0;
+                for (int i = SCN_SYN; i <= SCN_UDP; i++) {
+                    if (strcmp(optarg, scenario_names[i]) == 0) B.opts.scenarios = 1 << i;
+                }
+                if (B.opts.scenarios == 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'n':
+                B.opts.packets = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                B.opts.flows = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                B.opts.payload = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                B.opts.burst = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                if (sscanf(optarg, "%d:%d", &B.opts.read_max_packets, &B.opts.read_max_usec) < 1) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'f':
+                B.opts.replay_in = optarg;
+                break;
+            case 'w':
+                B.opts.replay_out = optarg;
+                break;
+            case 'S':
+                B.opts.replay_speed = strtod(optarg, NULL);
+                break;
+            case 'i':
+                if (B.opts.num_intercepts == MAX_INTERCEPTS) {
+                    fprintf(stderr, "no more than %d intercepted addresses are supported\n", MAX_INTERCEPTS);
+                    return 1;
+                }
+                B.opts.intercepts[B.opts.num_intercepts++] = optarg;
+                break;
+            case 'v':
+                ziti_tunnel_set_logger(bench_logger);
+                ziti_tunnel_set_log_level((int) strtol(optarg, NULL, 10));
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (B.opts.packets == 0 || B.opts.burst == 0 ||
+        B.opts.payload < sizeof(uint64_t) || B.opts.payload > MAX_PAYLOAD) {
+        fprintf(stderr, "packets and burst must be positive, and payload must be %zu-%d bytes\n", sizeof(uint64_t), MAX_PAYLOAD);
+        return 1;
+    }
+
+    if (B.opts.replay_in != NULL) {
+        char err[256];
+        B.driver = pcap_netif_open(B.opts.replay_in, B.opts.replay_out, B.opts.replay_speed, err, sizeof(err));
+        if (B.driver == NULL) {
+            fprintf(stderr, "%s\n", err);
+            return 1;
+        }
+        if (B.opts.num_intercepts == 0) {
+            B.opts.intercepts[B.opts.num_intercepts++] = "0.0.0.0/0";
+            B.opts.intercepts[B.opts.num_intercepts++] = "::/0";
+        }
+    } else {
+        B.pkt = malloc(20 + 24 + MAX_PAYLOAD);
+        B.driver = mock_netif_open(on_mock_rx, on_tunnel_tx, &B);
+        if (B.pkt == NULL || B.driver == NULL) {
+            fprintf(stderr, "failed to allocate mock netif\n");
+            return 1;
+        }
+        if (B.opts.num_intercepts == 0) {
+            B.opts.intercepts[B.opts.num_intercepts++] = BENCH_SERVICE_CIDR;
+        }
+    }
+
+    tunneler_sdk_options opts = {
+            .netif_driver = B.driver,
+            .ziti_dial = bench_dial,
+            .ziti_close = bench_close,
+            .ziti_close_write = bench_close_write,
+            .ziti_write = bench_write,
+            .ziti_host = bench_host,
+            .netif_read_max_packets = B.opts.read_max_packets,
+            .netif_read_max_usec = B.opts.read_max_usec,
+    };
+    B.tnlr = ziti_tunneler_init(&opts, uv_default_loop());
+
+    intercept_ctx_t *intercept = intercept_ctx_new(B.tnlr, "bench", &B);
+    intercept_ctx_add_protocol(intercept, "tcp");
+    intercept_ctx_add_protocol(intercept, "udp");
+    for (int i = 0; i < B.opts.num_intercepts; i++) {
+        ziti_address za;
+        if (!ziti_address_from_string(&za, B.opts.intercepts[i])) {
+            fprintf(stderr, "invalid intercept address: %s\n", B.opts.intercepts[i]);
+            return 1;
+        }
+        intercept_ctx_add_address(intercept, &za);
+    }
+    intercept_ctx_add_port_range(intercept, 1, 65535);
+    ziti_tunneler_intercept(B.tnlr, intercept);
+
+    if (B.opts.replay_in != NULL) {
+        run_replay();
+    } else {
+        if (B.opts.scenarios & (1 << SCN_SYN)) run_syn_flood();
+        if (B.opts.scenarios & (1 << SCN_TCP)) run_tcp_stream();
+        if (B.opts.scenarios & (1 << SCN_UDP)) run_udp_burst();
+    }
+
+    ziti_tunneler_shutdown(B.tnlr);
+    if (B.opts.replay_in != NULL) {
+        pcap_netif_close(B.driver);
+    } else {
+        mock_netif_close(B.driver);
+    }
+    free(B.pkt);
+    free(B.dials);
+    free(B.acks);
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+/**
+ * hash index of intercepted connections by (local ip, local port, remote ip, remote port), kept next to
+ * lwip's pcb lists so that the receive hooks can find the pcb of a segment without walking every pcb.
+ *
+ * the table is chained, and doubles its bucket count when it holds more flows than buckets.
+ * new flows are linked at the head of their chain, so the newest of several flows with the same
+ * tuple (e.g. a connection that replaced one in TIME_WAIT) is found first.
+ */
+
+#include <stdlib.h>
+#include "ziti_tunnel_priv.h"
+
+#define TNL_FLOW_TABLE_MIN_SIZE 64
+
+static uint32_t flow_hash(const ip_addr_t *local_ip, u16_t local_port, const ip_addr_t *remote_ip, u16_t remote_port) {
+    uint32_t h = ((uint32_t) local_port << 16) | remote_port;
+    const ip_addr_t *ips[] = { local_ip, remote_ip };
+    for (int i = 0; i < 2; i++) {
+        if (IP_IS_V6(ips[i])) {
+            for (int w = 0; w < 4; w++) {
+                h = (h ^ ip_2_ip6(ips[i])->addr[w]) * 0x85ebca6bU;
+            }
+        } else {
+            h = (h ^ ip_2_ip4(ips[i])->addr) * 0x85ebca6bU;
+        }
+    }
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static void flow_table_resize(struct tnl_flow_table_s *table, size_t size) {
+    struct tnl_flow_s **buckets = calloc(size, sizeof(struct tnl_flow_s *));
+    if (buckets == NULL) {
+        // keep the current buckets. the chains get longer, but lookups still work
+        TNL_LOG(WARN, "failed to grow flow table to %zu buckets", size);
+        return;
+    }
+    for (size_t b = 0; b < table->size; b++) {
+        struct tnl_flow_s *flow = table->buckets[b];
+        while (flow != NULL) {
+            struct tnl_flow_s *next = flow->next;
+            size_t idx = flow->hash & (size - 1);
+            flow->next = buckets[idx];
+            buckets[idx] = flow;
+            flow = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
+}
+
+struct tnl_flow_s *tnl_flow_insert(struct tnl_flow_table_s *table, const ip_addr_t *local_ip, u16_t local_port,
+                                   const ip_addr_t *remote_ip, u16_t remote_port, void *pcb) {
+    if (table->count >= table->size) {
+        flow_table_resize(table, table->size ? table->size * 2 : TNL_FLOW_TABLE_MIN_SIZE);
+        if (table->size == 0) {
+            return NULL;
+        }
+    }
+
+    struct tnl_flow_s *flow = calloc(1, sizeof(struct tnl_flow_s));
+    if (flow == NULL) {
+        return NULL;
+    }
+    ip_addr_copy(flow->local_ip, *local_ip);
+    ip_addr_copy(flow->remote_ip, *remote_ip);
+    flow->local_port = local_port;
+    flow->remote_port = remote_port;
+    flow->pcb = pcb;
+    flow->hash = flow_hash(local_ip, local_port, remote_ip, remote_port);
+
+    size_t idx = flow->hash & (table->size - 1);
+    flow->next = table->buckets[idx];
+    table->buckets[idx] = flow;
+    table->count++;
+    return flow;
+}
+
+void tnl_flow_remove(struct tnl_flow_table_s *table, struct tnl_flow_s *flow) {
+    if (flow == NULL || table->size == 0) {
+        return;
+    }
+    for (struct tnl_flow_s **link = &table->buckets[flow->hash & (table->size - 1)]; *link != NULL; link = &(*link)->next) {
+        if (*link == flow) {
+            *link = flow->next;
+            table->count--;
+            free(flow);
+            return;
+        }
+    }
+    TNL_LOG(WARN, "flow for pcb[%p] is not in the flow table", flow->pcb);
+}
+
+struct tnl_flow_s *tnl_flow_find(const struct tnl_flow_table_s *table, const ip_addr_t *local_ip, u16_t local_port,
+                                 const ip_addr_t *remote_ip, u16_t remote_port) {
+    if (table->count == 0) {
+        return NULL;
+    }
+    uint32_t hash = flow_hash(local_ip, local_port, remote_ip, remote_port);
+    for (struct tnl_flow_s *flow = table->buckets[hash & (table->size - 1)]; flow != NULL; flow = flow->next) {
+        if (flow->hash == hash &&
+            flow->local_port == local_port &&
+            flow->remote_port == remote_port &&
+            ip_addr_cmp(&flow->local_ip, local_ip) &&
+            ip_addr_cmp(&flow->remote_ip, remote_ip)) {
+            return flow;
+        }
+    }
+    return NULL;
+}
@@ -29,7 +29,22 @@ typedef void (*packet_cb)(const char *buf, ssize_t len, void *netif);
 typedef int (*netif_close_cb)(netif_handle dev);
 typedef ssize_t (*netif_read_cb)(netif_handle dev, void *buf, size_t buf_len);
 typedef ssize_t (*netif_write_cb)(netif_handle dev, const void *buf, size_t len);
+/**
+ * read up to `nbufs` packets, one packet per buffer. on return `bufs[i].len` holds the size of the i-th packet,
+ * which is larger than the buffer if the packet was truncated.
+ * a driver that sets `max_packet_size` may instead return a packet that is larger than its buffer in memory of its
+ * own, by pointing `bufs[i].base` there. that memory only has to stay valid until the next read.
+ * returns the number of packets read (0 if none are ready), or a negative error code.
+ */
+typedef int (*netif_read_batch_cb)(netif_handle dev, uv_buf_t *bufs, int nbufs);
+/** write a single packet that is split across `nbufs` buffers. returns the number of bytes written, or a negative error code. */
+typedef ssize_t (*netif_writev_cb)(netif_handle dev, const uv_buf_t *bufs, int nbufs);
+/** write `nbufs` packets, one packet per buffer. returns the number of packets written, or a negative error code. */
+typedef int (*netif_write_batch_cb)(netif_handle dev, const uv_buf_t *bufs, int nbufs);
 typedef int (*uv_poll_req_fn)(netif_handle dev, uv_loop_t *loop, uv_poll_t *tun_poll_req);
+/** number of independently readable queues. each queue is polled and read through its own handle */
+typedef int (*queue_count_fn)(netif_handle dev);
+typedef netif_handle (*queue_handle_fn)(netif_handle dev, int queue);
 typedef int (*setup_packet_cb)(netif_handle dev, uv_loop_t *loop, packet_cb cb, void *netif);
 typedef int (*add_route_cb)(netif_handle dev, const char *dest);
 typedef int (*delete_route_cb)(netif_handle dev, const char *dest);
@@ -42,14 +57,20 @@ typedef struct netif_driver_s {
     netif_handle handle;
     netif_read_cb read;
     netif_write_cb write;
+    netif_writev_cb writev;           // optional. used to write packets that span multiple pbufs without flattening them
+    netif_read_batch_cb read_batch;   // optional. used instead of `read` when set
+    netif_write_batch_cb write_batch; // optional. used to flush packets that are emitted while input is processed
     netif_close_cb close;
     uv_poll_req_fn uv_poll_init;
+    queue_count_fn queue_count;       // optional. a driver without queues is read through `handle`
+    queue_handle_fn get_queue;
     setup_packet_cb setup;
     add_route_cb add_route;
     delete_route_cb delete_route;
     exclude_route_fn exclude_rt;
     commit_routes_fn commit_routes;
     name_fn get_name;
+    int max_packet_size;              // optional. largest packet read_batch can return in its own memory (e.g. offloaded super-segments)
 } netif_driver_t;
 typedef netif_driver_t *netif_driver;
 
@@ -70,6 +70,12 @@ typedef enum {
     HOST_CFG_V1       // host.v1
 } cfg_type_e;
 
+/** datagrams that are dropped when the send queue of an intercepted udp connection is full */
+typedef enum {
+    UDP_DROP_TAIL, // the arriving datagram
+    UDP_DROP_HEAD  // the oldest queued datagrams
+} udp_drop_policy_e;
+
 typedef struct protocol_s {
     char *protocol;
     STAILQ_ENTRY(protocol_s) entries;
@@ -99,6 +105,13 @@ typedef STAILQ_HEAD(port_range_list_s, port_range_s) port_range_list_t;
 typedef void * (*ziti_sdk_dial_cb)(const void *app_intercept_ctx, io_ctx_t *io);
 typedef int (*ziti_sdk_close_cb)(void *ziti_io_ctx);
 typedef ssize_t (*ziti_sdk_write_cb)(const void *ziti_io_ctx, void *write_ctx, const void *data, size_t len);
+/**
+ * like ziti_sdk_write_cb, for data that is not contiguous. ziti_tunneler_ack is called once, after every buffer is
+ * written. a negative return means nothing was written and write_ctx is left with the caller. a positive return is
+ * the number of bytes queued before a later buffer failed: the buffers must stay valid until write_ctx is acked,
+ * and the caller is expected to close the connection
+ */
+typedef ssize_t (*ziti_sdk_writev_cb)(const void *ziti_io_ctx, void *write_ctx, const uv_buf_t *bufs, int nbufs);
 typedef host_ctx_t * (*ziti_sdk_host_cb)(void *ziti_ctx, uv_loop_t *loop, const char *service_name, cfg_type_e cfg_type, const void *cfg);
 
 /** data needed to intercept packets and dial the associated ziti service */
@@ -119,6 +132,7 @@ struct io_ctx_s {
     void *                ziti_io; // context specific to ziti SDK being used by the app.
     const void *          ziti_ctx;
     ziti_sdk_write_cb     write_fn;
+    ziti_sdk_writev_cb    writev_fn; // NULL if data must be coalesced before write_fn
     ziti_sdk_close_cb     close_write_fn;
     ziti_sdk_close_cb     close_fn;
 };
@@ -139,6 +153,16 @@ typedef struct tunneler_sdk_options_s {
     ziti_sdk_close_cb   ziti_close_write;
     ziti_sdk_write_cb   ziti_write;
     ziti_sdk_host_cb    ziti_host;
+    ziti_sdk_writev_cb  ziti_writev;            // optional. used for client data that lwip received in multiple segments
+    int                 netif_read_max_packets; // max packets read from the netif per readable event (default 128)
+    int                 netif_read_max_usec;    // max time spent reading from the netif per readable event (default 2000)
+    int                 max_tcp_connections;    // tcp connections, including connections in TIME_WAIT (default MEMP_NUM_TCP_PCB)
+    int                 max_udp_connections;    // udp connections (default MEMP_NUM_UDP_PCB)
+    int                 max_pool_pbufs;         // pbufs holding packets that are copied from the netif (default PBUF_POOL_SIZE)
+    int                 max_tcp_segments;       // tcp segments queued by writes to clients, summed over all connections (default MEMP_NUM_TCP_SEG)
+    int                 max_udp_service_connections; // udp connections per intercepted service (default no limit besides max_udp_connections)
+    int                 udp_queue_bytes;        // datagrams held per udp connection while ziti applies backpressure (default 64KiB)
+    udp_drop_policy_e   udp_drop_policy;        // what is dropped when a udp connection's queue is full (default UDP_DROP_TAIL)
 } tunneler_sdk_options;
 
 extern port_range_t *parse_port_range(uint16_t low, uint16_t high);
@@ -177,6 +201,12 @@ extern host_ctx_t * ziti_tunneler_host(tunneler_context tnlr_ctx, const void *zi
 
 extern void ziti_tunneler_stop_intercepting(tunneler_context tnlr_ctx, void *zi_ctx);
 
+/** group intercept changes so the lookup structures are rebuilt once, on commit, instead of per change.
+ * batches nest. begin and commit must be called on the loop thread without returning to the loop in between,
+ * so packets see either none or all of the changes. */
+extern void ziti_tunneler_begin_intercept_batch(tunneler_context tnlr_ctx);
+extern void ziti_tunneler_commit_intercept_batch(tunneler_context tnlr_ctx);
+
 extern intercept_ctx_t * ziti_tunnel_find_intercept(tunneler_context tnlr_ctx, void *zi_ctx);
 
 extern void ziti_tunneler_set_idle_timeout(struct io_ctx_s *io_context, unsigned int timeout);
@@ -188,6 +218,9 @@ extern ssize_t ziti_tunneler_write(tunneler_io_context tnlr_io_ctx, const void *
 struct write_ctx_s;
 extern void ziti_tunneler_ack(struct write_ctx_s *write_ctx);
 
+/** called by tunneler application when a connection that refused a write with ERR_WOULDBLOCK can take data again */
+extern void ziti_tunneler_resume_writes(struct io_ctx_s *io_context);
+
 extern int ziti_tunneler_close(tunneler_io_context tnlr_io_ctx);
 
 extern int ziti_tunneler_close_write(tunneler_io_context tnlr_io_ctx);
@@ -207,7 +240,9 @@ extern void ziti_tunnel_async_send(tunneler_context tctx, ziti_tunnel_async_fn f
 XX(name, model_string, none, Name, __VA_ARGS__) \
 XX(max, model_number, none, Max, __VA_ARGS__) \
 XX(used, model_number, none, Used, __VA_ARGS__) \
-XX(avail, model_number, none, Avail, __VA_ARGS__)
+XX(avail, model_number, none, Avail, __VA_ARGS__) \
+XX(limit, model_number, none, Limit, __VA_ARGS__) \
+XX(exhausted, model_number, none, Exhausted, __VA_ARGS__)
 
 #define TNL_IP_CONN(XX, ...) \
 XX(protocol, model_string, none, Protocol, __VA_ARGS__) \
@@ -216,14 +251,65 @@ XX(local_port, model_number, none, LocalPort, __VA_ARGS__) \
 XX(remote_ip, model_string, none, RemoteIP, __VA_ARGS__) \
 XX(remote_port, model_number, none, RemotePort, __VA_ARGS__) \
 XX(state, model_string, none, State, __VA_ARGS__) \
-XX(service, model_string, none, Service, __VA_ARGS__)
+XX(service, model_string, none, Service, __VA_ARGS__) \
+XX(blocked_ms, model_number, none, BlockedMillis, __VA_ARGS__) \
+XX(dropped, model_number, none, Dropped, __VA_ARGS__)
+
+#define TNL_NETIF_STATS(XX, ...) \
+XX(read_events, model_number, none, ReadEvents, __VA_ARGS__) \
+XX(packets_read, model_number, none, PacketsRead, __VA_ARGS__) \
+XX(budget_packets, model_number, none, BudgetPackets, __VA_ARGS__) \
+XX(budget_max_packets, model_number, none, BudgetMaxPackets, __VA_ARGS__) \
+XX(budget_usec, model_number, none, BudgetMicros, __VA_ARGS__) \
+XX(count_budget_exhausted, model_number, none, CountBudgetExhausted, __VA_ARGS__) \
+XX(time_budget_exhausted, model_number, none, TimeBudgetExhausted, __VA_ARGS__)
+
+/** latency of one stage of the intercept data path, in microseconds */
+#define TNL_LATENCY_STAGE(XX, ...) \
+XX(stage, model_string, none, Stage, __VA_ARGS__) \
+XX(count, model_number, none, Count, __VA_ARGS__) \
+XX(mean_usec, model_number, none, MeanMicros, __VA_ARGS__) \
+XX(p50_usec, model_number, none, P50Micros, __VA_ARGS__) \
+XX(p90_usec, model_number, none, P90Micros, __VA_ARGS__) \
+XX(p99_usec, model_number, none, P99Micros, __VA_ARGS__) \
+XX(p999_usec, model_number, none, P999Micros, __VA_ARGS__) \
+XX(max_usec, model_number, none, MaxMicros, __VA_ARGS__)
+
+#define TNL_SERVICE_LATENCY(XX, ...) \
+XX(service, model_string, none, Service, __VA_ARGS__) \
+XX(stages, tunnel_latency_stage, array, Stages, __VA_ARGS__)
+
+#define TNL_INTERCEPT_CACHE_STATS(XX, ...) \
+XX(size, model_number, none, Size, __VA_ARGS__) \
+XX(hits, model_number, none, Hits, __VA_ARGS__) \
+XX(misses, model_number, none, Misses, __VA_ARGS__) \
+XX(evictions, model_number, none, Evictions, __VA_ARGS__) \
+XX(uncacheable, model_number, none, Uncacheable, __VA_ARGS__) \
+XX(flushes, model_number, none, Flushes, __VA_ARGS__) \
+XX(invalidations, model_number, none, Invalidations, __VA_ARGS__)
+
+#define TNL_UDP_SERVICE_STATS(XX, ...) \
+XX(service, model_string, none, Service, __VA_ARGS__) \
+XX(flows, model_number, none, Flows, __VA_ARGS__) \
+XX(limit, model_number, none, Limit, __VA_ARGS__) \
+XX(reclaimed, model_number, none, Reclaimed, __VA_ARGS__) \
+XX(refused, model_number, none, Refused, __VA_ARGS__)
 
 #define TNL_IP_STATS(XX, ...) \
 XX(pools, tunnel_ip_mem_pool, array, Pools, __VA_ARGS__) \
-XX(connections, tunnel_ip_conn, array, Connections, __VA_ARGS__)
+XX(connections, tunnel_ip_conn, array, Connections, __VA_ARGS__) \
+XX(netif, tunnel_netif_stats, ptr, Netif, __VA_ARGS__) \
+XX(latency, tunnel_service_latency, array, Latency, __VA_ARGS__) \
+XX(intercept_cache, tunnel_intercept_cache_stats, ptr, InterceptCache, __VA_ARGS__) \
+XX(udp_services, tunnel_udp_service_stats, array, UdpServices, __VA_ARGS__)
 
 DECLARE_MODEL(tunnel_ip_mem_pool, TNL_IP_MEM_POOL)
 DECLARE_MODEL(tunnel_ip_conn, TNL_IP_CONN)
+DECLARE_MODEL(tunnel_netif_stats, TNL_NETIF_STATS)
+DECLARE_MODEL(tunnel_latency_stage, TNL_LATENCY_STAGE)
+DECLARE_MODEL(tunnel_service_latency, TNL_SERVICE_LATENCY)
+DECLARE_MODEL(tunnel_intercept_cache_stats, TNL_INTERCEPT_CACHE_STATS)
+DECLARE_MODEL(tunnel_udp_service_stats, TNL_UDP_SERVICE_STATS)
 DECLARE_MODEL(tunnel_ip_stats, TNL_IP_STATS)
 
 extern void ziti_tunnel_get_ip_stats(tunnel_ip_stats *stats);
@@ -145,90 +145,278 @@ const port_range_t *port_match(int port, const port_range_list_t *port_ranges) {
     return best_pr;
 }
 
-struct addr_match {
-    const ziti_address *addr;
-    int addr_score;
-    const port_range_t *pr;
-    int pr_score;
-    intercept_ctx_t *intercept;
+/**
+ * intercept lookups are cached by (protocol, destination ip, destination port) in a fixed size,
+ * set associative table. each key hashes to a set of TNL_INTERCEPT_CACHE_WAYS slots, and when the
+ * set is full the CLOCK hand of the set evicts the first entry that has not been hit since the hand
+ * last passed it. entries are stamped with the cache generation, so bumping the generation
+ * invalidates every entry without touching the table.
+ */
+#ifndef TNL_INTERCEPT_CACHE_SETS
+#define TNL_INTERCEPT_CACHE_SETS 512
+#endif
+#define TNL_INTERCEPT_CACHE_WAYS 8
+/** intercept changes in a batch that are invalidated entry by entry, before the whole cache is flushed */
+#define TNL_INTERCEPT_BATCH_TARGETED 32
+
+struct intercept_cache_entry_s {
+    ip_addr_t dst;
+    uint16_t port;
+    uint8_t proto;
+    uint8_t referenced;
+    uint32_t generation; // 0 if the slot was never used
+    intercept_ctx_t *intercept; // NULL for cached misses
 };
 
-/** return the intercept context with the smallest address range for a packet based on its destination ip:port */
-intercept_ctx_t * lookup_intercept_by_address(tunneler_context tnlr_ctx, const char *protocol,
-                                              ip_addr_t *src_addr, ip_addr_t *dst_addr, uint16_t dst_port) {
-    if (tnlr_ctx == NULL) {
-        TNL_LOG(DEBUG, "null tnlr_ctx");
-        return NULL;
-    }
+struct intercept_cache_s {
+    uint32_t generation;
+    uint8_t hand[TNL_INTERCEPT_CACHE_SETS];
+    struct intercept_cache_entry_s entries[TNL_INTERCEPT_CACHE_SETS * TNL_INTERCEPT_CACHE_WAYS];
+};
 
-    char key[3+1+IPADDR_STRLEN_MAX+1+6+1]; // [proto]:[ip]:[port]
-    snprintf(key, sizeof(key), "%s:%s:%d", protocol, ipaddr_ntoa(dst_addr), dst_port);
-    intercept_ctx_t *intercept = model_map_get(&tnlr_ctx->intercepts_cache, key);
-    ziti_address src_za;
-    ziti_address_from_ip_addr(&src_za, src_addr);
-    if (intercept != NULL) {
-        if (address_match(&src_za, &intercept->allowed_source_addresses) != NULL) {
-            return intercept;
+static struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t uncacheable;
+    uint64_t flushes;
+    uint64_t invalidations;
+} cache_stats;
+
+static uint8_t cache_proto(const char *protocol) {
+    if (strcmp(protocol, "tcp") == 0) return 1;
+    if (strcmp(protocol, "udp") == 0) return 2;
+    return 0;
+}
+
+static uint32_t cache_hash(uint8_t proto, const ip_addr_t *dst, uint16_t port) {
+    uint32_t h = ((uint32_t) proto << 16) | port;
+    if (IP_IS_V6(dst)) {
+        for (int i = 0; i < 4; i++) {
+            h = (h ^ ip_2_ip6(dst)->addr[i]) * 0x85ebca6bU;
         }
+    } else {
+        h = (h ^ ip_2_ip4(dst)->addr) * 0x85ebca6bU;
     }
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
 
-    ziti_address za;
-    ziti_address_from_ip_addr(&za, dst_addr);
-    struct addr_match curr, best = { 0 };
+static struct intercept_cache_entry_s *cache_set(struct intercept_cache_s *cache, uint8_t proto,
+                                                 const ip_addr_t *dst, uint16_t port, size_t *set) {
+    *set = cache_hash(proto, dst, port) % TNL_INTERCEPT_CACHE_SETS;
+    return &cache->entries[*set * TNL_INTERCEPT_CACHE_WAYS];
+}
 
-    LIST_FOREACH(intercept, &tnlr_ctx->intercepts, entries) {
-        if (!protocol_match(protocol, &intercept->protocols)) continue;
+static inline bool cache_entry_is(const struct intercept_cache_entry_s *e, uint32_t generation,
+                                  uint8_t proto, const ip_addr_t *dst, uint16_t port) {
+    return e->generation == generation && e->proto == proto && e->port == port && ip_addr_cmp(&e->dst, dst);
+}
 
-        // enforce the source address whitelist if it isn't empty
-        bool has_allowed_source_addresses = STAILQ_FIRST(&intercept->allowed_source_addresses) != NULL;
-        if (has_allowed_source_addresses && address_match(&src_za, &intercept->allowed_source_addresses) == NULL) {
-            continue;
+bool intercept_cache_get(tunneler_context tnlr_ctx, const char *protocol, const ip_addr_t *dst_addr,
+                         uint16_t dst_port, intercept_ctx_t **intercept) {
+    struct intercept_cache_s *cache = tnlr_ctx->intercepts_cache;
+    uint8_t proto = cache_proto(protocol);
+    if (cache == NULL || proto == 0) {
+        return false;
+    }
+    size_t set;
+    struct intercept_cache_entry_s *ways = cache_set(cache, proto, dst_addr, dst_port, &set);
+    for (int w = 0; w < TNL_INTERCEPT_CACHE_WAYS; w++) {
+        if (cache_entry_is(&ways[w], cache->generation, proto, dst_addr, dst_port)) {
+            ways[w].referenced = 1;
+            *intercept = ways[w].intercept;
+            return true;
         }
+    }
+    return false;
+}
 
-        curr.intercept = intercept;
-        // try IP or hostname match
-        curr.addr = address_match(&za, &intercept->addresses);
-        curr.addr_score = -1;
-        if (curr.addr) {
-            if (za.type == ziti_address_cidr) {
-                curr.addr_score = (int) (za.addr.cidr.bits - curr.addr->addr.cidr.bits);
-            } else {
-                curr.addr_score = 0;
-            }
-        } else if (intercept->match_addr) {
-            // check for wildcard domain match
-            curr.addr = intercept->match_addr(dst_addr, intercept->app_intercept_ctx);
-            if (curr.addr) {
-                curr.addr_score = 1; // leave room for a matching plain ziti_address_hostname to win
-            }
+static void intercept_cache_put(tunneler_context tnlr_ctx, const char *protocol, const ip_addr_t *dst_addr,
+                                uint16_t dst_port, intercept_ctx_t *intercept) {
+    uint8_t proto = cache_proto(protocol);
+    if (proto == 0) {
+        return;
+    }
+    struct intercept_cache_s *cache = tnlr_ctx->intercepts_cache;
+    if (cache == NULL) {
+        cache = tnlr_ctx->intercepts_cache = calloc(1, sizeof(struct intercept_cache_s));
+        if (cache == NULL) {
+            return;
         }
-        if (curr.addr_score < 0) continue;
-
-        curr.pr = port_match(dst_port, &intercept->port_ranges);
-        curr.pr_score = (curr.pr != NULL) ? curr.pr->high - curr.pr->low : -1;
-        if (curr.pr_score < 0) continue;
+        cache->generation = 1;
+    }
 
-        if (best.intercept == NULL) {
-            // first match
-            best = curr;
-            continue;
+    size_t set;
+    struct intercept_cache_entry_s *ways = cache_set(cache, proto, dst_addr, dst_port, &set);
+    struct intercept_cache_entry_s *slot = NULL;
+    for (int w = 0; w < TNL_INTERCEPT_CACHE_WAYS; w++) {
+        if (ways[w].generation != cache->generation) {
+            slot = &ways[w];
+            break;
         }
+    }
+    while (slot == NULL) {
+        struct intercept_cache_entry_s *e = &ways[cache->hand[set]];
+        cache->hand[set] = (cache->hand[set] + 1) % TNL_INTERCEPT_CACHE_WAYS;
+        if (e->referenced) {
+            e->referenced = 0;
+        } else {
+            slot = e;
+            cache_stats.evictions++;
+        }
+    }
 
-        if (curr.addr_score > best.addr_score) {
-            // current address score is inferior to best match so far
-            continue;
+    ip_addr_copy(slot->dst, *dst_addr);
+    slot->port = dst_port;
+    slot->proto = proto;
+    slot->referenced = 0; // not yet hit, so a scan of new keys is evicted before the hot entries
+    slot->generation = cache->generation;
+    slot->intercept = intercept;
+}
+
+static bool ports_contain(const port_range_list_t *port_ranges, int port) {
+    const port_range_t *pr;
+    STAILQ_FOREACH(pr, port_ranges, entries) {
+        if (port >= pr->low && port <= pr->high) {
+            return true;
         }
+    }
+    return false;
+}
+
+/** invalidate the cached lookups that `intercept` is a candidate for */
+static void intercept_cache_invalidate(tunneler_context tnlr_ctx, const intercept_ctx_t *intercept) {
+    struct intercept_cache_s *cache = tnlr_ctx->intercepts_cache;
+    if (cache == NULL) {
+        return;
+    }
+    unsigned protos = 0;
+    protocol_t *proto;
+    STAILQ_FOREACH(proto, &intercept->protocols, entries) {
+        protos |= 1u << cache_proto(proto->protocol);
+    }
 
-        if (curr.pr_score > best.pr_score) {
-            // current port matches, but matching range is larger than best matching range.
+    for (size_t i = 0; i < TNL_INTERCEPT_CACHE_SETS * TNL_INTERCEPT_CACHE_WAYS; i++) {
+        struct intercept_cache_entry_s *e = &cache->entries[i];
+        if (e->generation != cache->generation || (protos & (1u << e->proto)) == 0 ||
+            !ports_contain(&intercept->port_ranges, e->port)) {
             continue;
         }
+        // a match_addr callback may accept any address
+        if (intercept->match_addr == NULL) {
+            ziti_address za;
+            ziti_address_from_ip_addr(&za, &e->dst);
+            if (address_match(&za, &intercept->addresses) == NULL) {
+                continue;
+            }
+        }
+        e->generation = 0;
+        cache_stats.invalidations++;
+    }
+}
+
+void intercept_cache_flush(tunneler_context tnlr_ctx) {
+    struct intercept_cache_s *cache = tnlr_ctx->intercepts_cache;
+    if (cache == NULL) {
+        return;
+    }
+    if (++cache->generation == 0) {
+        memset(cache->entries, 0, sizeof(cache->entries));
+        cache->generation = 1;
+    }
+    cache_stats.flushes++;
+}
+
+void intercept_cache_get_stats(tunnel_intercept_cache_stats *stats) {
+    stats->size = TNL_INTERCEPT_CACHE_SETS * TNL_INTERCEPT_CACHE_WAYS;
+    stats->hits = (model_number) cache_stats.hits;
+    stats->misses = (model_number) cache_stats.misses;
+    stats->evictions = (model_number) cache_stats.evictions;
+    stats->uncacheable = (model_number) cache_stats.uncacheable;
+    stats->flushes = (model_number) cache_stats.flushes;
+    stats->invalidations = (model_number) cache_stats.invalidations;
+}
+
+void invalidate_intercept_lookups(tunneler_context tnlr_ctx) {
+    if (tnlr_ctx == NULL) {
+        return;
+    }
+    intercept_classifier_invalidate(tnlr_ctx);
+    intercept_cache_flush(tnlr_ctx);
+}
+
+/**
+ * account for an intercept change in the cache. a large batch flushes the cache once instead of
+ * invalidating the entries of each intercept, which would cost more than it saves.
+ */
+static void intercept_cache_changed(tunneler_context tnlr_ctx, const intercept_ctx_t *intercept) {
+    if (tnlr_ctx->intercept_batch == 0) {
+        intercept_cache_invalidate(tnlr_ctx, intercept);
+        return;
+    }
+    tnlr_ctx->intercept_batch_changes++;
+    if (tnlr_ctx->intercept_batch_changes <= TNL_INTERCEPT_BATCH_TARGETED) {
+        intercept_cache_invalidate(tnlr_ctx, intercept);
+    } else if (tnlr_ctx->intercept_batch_changes == TNL_INTERCEPT_BATCH_TARGETED + 1) {
+        intercept_cache_flush(tnlr_ctx);
+    }
+}
+
+void intercept_lookups_add(tunneler_context tnlr_ctx, intercept_ctx_t *intercept) {
+    if (tnlr_ctx->intercept_batch > 0) {
+        intercept_classifier_invalidate(tnlr_ctx); // compiled on commit
+    } else {
+        intercept_classifier_add(tnlr_ctx, intercept);
+    }
+    intercept_cache_changed(tnlr_ctx, intercept);
+}
+
+void intercept_lookups_remove(tunneler_context tnlr_ctx, intercept_ctx_t *intercept) {
+    if (tnlr_ctx->intercept_batch > 0) {
+        intercept_classifier_invalidate(tnlr_ctx);
+    } else {
+        intercept_classifier_remove(tnlr_ctx, intercept);
+    }
+    intercept_cache_changed(tnlr_ctx, intercept);
+}
 
-        best = curr;
+void intercept_lookups_commit(tunneler_context tnlr_ctx) {
+    if (tnlr_ctx->intercept_batch_changes > 0 && tnlr_ctx->classifier == NULL) {
+        intercept_classifier_compile(tnlr_ctx);
     }
+    tnlr_ctx->intercept_batch_changes = 0;
+}
 
-    model_map_set(&tnlr_ctx->intercepts_cache, key, best.intercept);
-    return best.intercept;
+/** return the intercept context with the smallest address range for a packet based on its destination ip:port */
+intercept_ctx_t * lookup_intercept_by_address(tunneler_context tnlr_ctx, const char *protocol,
+                                              ip_addr_t *src_addr, ip_addr_t *dst_addr, uint16_t dst_port) {
+    if (tnlr_ctx == NULL) {
+        TNL_LOG(DEBUG, "null tnlr_ctx");
+        return NULL;
+    }
+
+    intercept_ctx_t *intercept;
+    if (intercept_cache_get(tnlr_ctx, protocol, dst_addr, dst_port, &intercept)) {
+        cache_stats.hits++;
+        return intercept;
+    }
+    cache_stats.misses++;
+
+    ziti_address src_za;
+    ziti_address_from_ip_addr(&src_za, src_addr);
+    bool src_dependent = false;
+    intercept = intercept_classifier_lookup(tnlr_ctx, protocol, &src_za, dst_addr, dst_port, &src_dependent);
+
+    // a result that was decided by a source address whitelist does not hold for other clients
+    if (src_dependent) {
+        cache_stats.uncacheable++;
+    } else {
+        intercept_cache_put(tnlr_ctx, protocol, dst_addr, dst_port, intercept);
+    }
+    return intercept;
 }
 
 void free_intercept(intercept_ctx_t *intercept) {
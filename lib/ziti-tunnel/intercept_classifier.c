@@ -0,0 +1,646 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+/**
+ * compiled form of tnlr_ctx->intercepts, used to find the intercept for a packet without visiting
+ * every intercept.
+ *
+ * for each protocol there is a binary trie per address family that holds the intercepted cidrs, so
+ * walking the destination address from the root visits every prefix that contains it. intercepts
+ * that have a match_addr callback (wildcard domains) have their port ranges in an interval tree,
+ * so the callback is only consulted for intercepts that accept the destination port.
+ *
+ * hostnames are not indexed: the application assigns an ip to each intercepted hostname, and
+ * intercepts it by that ip.
+ *
+ * the candidates are then scored exactly as the linear scan did: in intercept list order, the
+ * smallest address range wins and ties go to the smallest port range. ziti_tunneler_intercept puts
+ * new intercepts at the head of the list, so list order is kept as a descending insertion sequence
+ * and an intercept can be added or removed without renumbering the others.
+ */
+
+#include <string.h>
+
+#include "ziti_tunnel_priv.h"
+
+struct cls_ref_s {
+    uint32_t intercept; // index into cls->intercepts
+    int32_t next;       // next ref on the same node, -1 at the end
+};
+
+struct cls_node_s {
+    uint32_t child[2];  // 0 if there is no child. the root is node 0, so it is never a child
+    int32_t refs;       // intercepts that have this exact prefix, -1 if none
+};
+
+struct cls_trie_s {
+    struct cls_node_s *nodes;
+    size_t len;
+    size_t cap;
+    struct cls_ref_s *refs;
+    size_t refs_len;
+    size_t refs_cap;
+    int32_t free_refs;  // refs released by removed intercepts, -1 if none
+};
+
+struct cls_port_entry_s {
+    int low;
+    int high;
+    uint32_t intercept;
+};
+
+/** static interval tree: entries sorted by low, the implicit tree is rooted at the middle of each range */
+struct cls_ports_s {
+    struct cls_port_entry_s *entries;
+    int *max_high;      // highest port in the subtree rooted at the same index
+    size_t len;
+    size_t cap;
+};
+
+struct cls_protocol_s {
+    char *name;
+    struct cls_trie_s v4;
+    struct cls_trie_s v6;
+    struct cls_ports_s match_addr_ports;
+};
+
+struct cls_candidate_s {
+    uint32_t intercept;
+    int addr_score;
+    uint64_t order;
+};
+
+struct intercept_classifier_s {
+    intercept_ctx_t **intercepts; // NULL for free slots
+    uint64_t *order;              // position in tnlr_ctx->intercepts: higher is nearer to the head
+    size_t len;
+    size_t cap;
+    size_t count;
+    uint64_t next_order;
+    uint32_t *free_slots;
+    size_t free_len;
+    size_t removed;               // intercepts removed since the classifier was compiled
+    struct cls_protocol_s *protocols;
+    size_t protocols_len;
+
+    // lookup scratch space, sized like intercepts
+    uint32_t stamp;
+    uint32_t *seen;
+    uint32_t *slot;
+    struct cls_candidate_s *candidates;
+};
+
+static int grow(void **arr, size_t *cap, size_t len, size_t elem_size) {
+    if (len < *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap ? *cap * 2 : 16;
+    void *a = realloc(*arr, new_cap * elem_size);
+    if (a == NULL) {
+        return -1;
+    }
+    *arr = a;
+    *cap = new_cap;
+    return 0;
+}
+
+static inline int prefix_bit(const uint8_t *addr, int i) {
+    return (addr[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static int trie_new_node(struct cls_trie_s *t) {
+    if (grow((void **) &t->nodes, &t->cap, t->len, sizeof(struct cls_node_s)) != 0) {
+        return -1;
+    }
+    struct cls_node_s *n = &t->nodes[t->len];
+    n->child[0] = n->child[1] = 0;
+    n->refs = -1;
+    return (int) t->len++;
+}
+
+static int trie_insert(struct cls_trie_s *t, const uint8_t *prefix, int bits, uint32_t intercept) {
+    if (t->len == 0 && trie_new_node(t) < 0) {
+        return -1;
+    }
+    uint32_t node = 0;
+    for (int i = 0; i < bits; i++) {
+        int b = prefix_bit(prefix, i);
+        if (t->nodes[node].child[b] == 0) {
+            int child = trie_new_node(t);
+            if (child < 0) {
+                return -1;
+            }
+            t->nodes[node].child[b] = (uint32_t) child;
+        }
+        node = t->nodes[node].child[b];
+    }
+
+    int32_t r;
+    if (t->free_refs >= 0) {
+        r = t->free_refs;
+        t->free_refs = t->refs[r].next;
+    } else {
+        if (grow((void **) &t->refs, &t->refs_cap, t->refs_len, sizeof(struct cls_ref_s)) != 0) {
+            return -1;
+        }
+        r = (int32_t) t->refs_len++;
+    }
+    t->refs[r].intercept = intercept;
+    t->refs[r].next = t->nodes[node].refs;
+    t->nodes[node].refs = r;
+    return 0;
+}
+
+/** release the refs of `intercept` on the node for `prefix`. nodes are not pruned */
+static void trie_remove(struct cls_trie_s *t, const uint8_t *prefix, int bits, uint32_t intercept) {
+    if (t->len == 0) {
+        return;
+    }
+    uint32_t node = 0;
+    for (int i = 0; i < bits; i++) {
+        node = t->nodes[node].child[prefix_bit(prefix, i)];
+        if (node == 0) {
+            return;
+        }
+    }
+    int32_t *link = &t->nodes[node].refs;
+    while (*link >= 0) {
+        int32_t r = *link;
+        if (t->refs[r].intercept == intercept) {
+            *link = t->refs[r].next;
+            t->refs[r].next = t->free_refs;
+            t->free_refs = r;
+        } else {
+            link = &t->refs[r].next;
+        }
+    }
+}
+
+static int ports_add(struct cls_ports_s *ix, int low, int high, uint32_t intercept) {
+    if (grow((void **) &ix->entries, &ix->cap, ix->len, sizeof(struct cls_port_entry_s)) != 0) {
+        return -1;
+    }
+    ix->entries[ix->len].low = low;
+    ix->entries[ix->len].high = high;
+    ix->entries[ix->len].intercept = intercept;
+    ix->len++;
+    return 0;
+}
+
+static int cmp_port_entry(const void *a, const void *b) {
+    const struct cls_port_entry_s *pa = a, *pb = b;
+    return pa->low - pb->low;
+}
+
+static int ports_build_max(struct cls_ports_s *ix, size_t lo, size_t hi) {
+    if (lo >= hi) {
+        return -1;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    int max = ix->entries[mid].high;
+    int l = ports_build_max(ix, lo, mid);
+    int r = ports_build_max(ix, mid + 1, hi);
+    if (l > max) max = l;
+    if (r > max) max = r;
+    ix->max_high[mid] = max;
+    return max;
+}
+
+static int ports_build(struct cls_ports_s *ix) {
+    if (ix->len == 0) {
+        return 0;
+    }
+    qsort(ix->entries, ix->len, sizeof(struct cls_port_entry_s), cmp_port_entry);
+    int *max_high = realloc(ix->max_high, ix->cap * sizeof(int));
+    if (max_high == NULL) {
+        return -1;
+    }
+    ix->max_high = max_high;
+    ports_build_max(ix, 0, ix->len);
+    return 0;
+}
+
+static void ports_remove(struct cls_ports_s *ix, uint32_t intercept) {
+    size_t n = 0;
+    for (size_t i = 0; i < ix->len; i++) {
+        if (ix->entries[i].intercept != intercept) {
+            ix->entries[n++] = ix->entries[i];
+        }
+    }
+    if (n != ix->len) {
+        ix->len = n;
+        ports_build_max(ix, 0, ix->len);
+    }
+}
+
+static struct cls_protocol_s *find_protocol(struct intercept_classifier_s *cls, const char *name) {
+    for (size_t i = 0; i < cls->protocols_len; i++) {
+        if (strcmp(cls->protocols[i].name, name) == 0) {
+            return &cls->protocols[i];
+        }
+    }
+    return NULL;
+}
+
+static struct cls_protocol_s *add_protocol(struct intercept_classifier_s *cls, const char *name) {
+    struct cls_protocol_s *p = find_protocol(cls, name);
+    if (p != NULL) {
+        return p;
+    }
+    p = realloc(cls->protocols, (cls->protocols_len + 1) * sizeof(struct cls_protocol_s));
+    if (p == NULL) {
+        return NULL;
+    }
+    cls->protocols = p;
+    p = &cls->protocols[cls->protocols_len++];
+    memset(p, 0, sizeof(*p));
+    p->name = strdup(name);
+    p->v4.free_refs = -1;
+    p->v6.free_refs = -1;
+    return p;
+}
+
+static void classifier_free(struct intercept_classifier_s *cls) {
+    if (cls == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < cls->protocols_len; i++) {
+        struct cls_protocol_s *p = &cls->protocols[i];
+        free(p->name);
+        free(p->v4.nodes);
+        free(p->v4.refs);
+        free(p->v6.nodes);
+        free(p->v6.refs);
+        free(p->match_addr_ports.entries);
+        free(p->match_addr_ports.max_high);
+    }
+    free(cls->protocols);
+    free(cls->intercepts);
+    free(cls->order);
+    free(cls->free_slots);
+    free(cls->seen);
+    free(cls->slot);
+    free(cls->candidates);
+    free(cls);
+}
+
+/** the trie that holds `za`, or NULL if it is not a cidr. `bits` is the prefix length */
+static struct cls_trie_s *address_trie(struct cls_protocol_s *p, const ziti_address *za, int *bits) {
+    if (za->type != ziti_address_cidr) {
+        return NULL;
+    }
+    int max_bits;
+    struct cls_trie_s *t;
+    if (za->addr.cidr.af == AF_INET) {
+        t = &p->v4;
+        max_bits = 32;
+    } else if (za->addr.cidr.af == AF_INET6) {
+        t = &p->v6;
+        max_bits = 128;
+    } else {
+        return NULL;
+    }
+    *bits = (int) za->addr.cidr.bits < max_bits ? (int) za->addr.cidr.bits : max_bits;
+    return t;
+}
+
+static int compile_intercept(struct intercept_classifier_s *cls, uint32_t idx) {
+    intercept_ctx_t *intercept = cls->intercepts[idx];
+    protocol_t *proto;
+    STAILQ_FOREACH(proto, &intercept->protocols, entries) {
+        struct cls_protocol_s *p = add_protocol(cls, proto->protocol);
+        if (p == NULL) {
+            return -1;
+        }
+
+        address_t *a;
+        STAILQ_FOREACH(a, &intercept->addresses, entries) {
+            int bits;
+            struct cls_trie_s *t = address_trie(p, &a->za, &bits);
+            if (t != NULL && trie_insert(t, (const uint8_t *) &a->za.addr.cidr.ip, bits, idx) != 0) {
+                return -1;
+            }
+        }
+
+        if (intercept->match_addr) {
+            port_range_t *pr;
+            STAILQ_FOREACH(pr, &intercept->port_ranges, entries) {
+                if (ports_add(&p->match_addr_ports, pr->low, pr->high, idx) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/** make room for `cap` intercept slots */
+static int reserve_slots(struct intercept_classifier_s *cls, size_t cap) {
+    if (cap <= cls->cap) {
+        return 0;
+    }
+    intercept_ctx_t **intercepts = realloc(cls->intercepts, cap * sizeof(intercept_ctx_t *));
+    if (intercepts == NULL) return -1;
+    cls->intercepts = intercepts;
+    uint64_t *order = realloc(cls->order, cap * sizeof(uint64_t));
+    if (order == NULL) return -1;
+    cls->order = order;
+    uint32_t *free_slots = realloc(cls->free_slots, cap * sizeof(uint32_t));
+    if (free_slots == NULL) return -1;
+    cls->free_slots = free_slots;
+    uint32_t *seen = realloc(cls->seen, cap * sizeof(uint32_t));
+    if (seen == NULL) return -1;
+    memset(seen + cls->cap, 0, (cap - cls->cap) * sizeof(uint32_t));
+    cls->seen = seen;
+    uint32_t *slot = realloc(cls->slot, cap * sizeof(uint32_t));
+    if (slot == NULL) return -1;
+    cls->slot = slot;
+    struct cls_candidate_s *candidates = realloc(cls->candidates, cap * sizeof(struct cls_candidate_s));
+    if (candidates == NULL) return -1;
+    cls->candidates = candidates;
+    cls->cap = cap;
+    return 0;
+}
+
+static struct intercept_classifier_s *classifier_compile(tunneler_context tnlr_ctx) {
+    struct intercept_classifier_s *cls = calloc(1, sizeof(struct intercept_classifier_s));
+    if (cls == NULL) {
+        return NULL;
+    }
+
+    intercept_ctx_t *intercept;
+    LIST_FOREACH(intercept, &tnlr_ctx->intercepts, entries) {
+        cls->count++;
+    }
+    if (reserve_slots(cls, cls->count ? cls->count : 16) != 0) {
+        classifier_free(cls);
+        return NULL;
+    }
+
+    uint32_t idx = 0;
+    LIST_FOREACH(intercept, &tnlr_ctx->intercepts, entries) {
+        cls->intercepts[idx] = intercept;
+        cls->order[idx] = cls->count - idx;
+        if (compile_intercept(cls, idx) != 0) {
+            classifier_free(cls);
+            return NULL;
+        }
+        idx++;
+    }
+    cls->len = cls->count;
+    cls->next_order = cls->count + 1;
+    for (size_t i = 0; i < cls->protocols_len; i++) {
+        if (ports_build(&cls->protocols[i].match_addr_ports) != 0) {
+            classifier_free(cls);
+            return NULL;
+        }
+    }
+
+    TNL_LOG(DEBUG, "compiled %zu intercepts for %zu protocols", cls->count, cls->protocols_len);
+    return cls;
+}
+
+void intercept_classifier_invalidate(tunneler_context tnlr_ctx) {
+    if (tnlr_ctx == NULL) {
+        return;
+    }
+    classifier_free(tnlr_ctx->classifier);
+    tnlr_ctx->classifier = NULL;
+}
+
+int intercept_classifier_compile(tunneler_context tnlr_ctx) {
+    struct intercept_classifier_s *cls = classifier_compile(tnlr_ctx);
+    if (cls == NULL) {
+        TNL_LOG(ERR, "failed to compile intercepts");
+        return -1;
+    }
+    classifier_free(tnlr_ctx->classifier);
+    tnlr_ctx->classifier = cls;
+    return 0;
+}
+
+void intercept_classifier_add(tunneler_context tnlr_ctx, intercept_ctx_t *intercept) {
+    struct intercept_classifier_s *cls = tnlr_ctx->classifier;
+    if (cls == NULL) {
+        return; // compiled with the intercept by the next lookup
+    }
+
+    uint32_t idx;
+    if (cls->free_len > 0) {
+        idx = cls->free_slots[--cls->free_len];
+    } else {
+        if (reserve_slots(cls, cls->len < cls->cap ? cls->cap : cls->cap * 2) != 0) {
+            intercept_classifier_invalidate(tnlr_ctx);
+            return;
+        }
+        idx = (uint32_t) cls->len++;
+    }
+    cls->intercepts[idx] = intercept;
+    cls->order[idx] = cls->next_order++;
+    cls->count++;
+
+    if (compile_intercept(cls, idx) != 0) {
+        intercept_classifier_invalidate(tnlr_ctx);
+        return;
+    }
+    if (intercept->match_addr) {
+        protocol_t *proto;
+        STAILQ_FOREACH(proto, &intercept->protocols, entries) {
+            if (ports_build(&find_protocol(cls, proto->protocol)->match_addr_ports) != 0) {
+                intercept_classifier_invalidate(tnlr_ctx);
+                return;
+            }
+        }
+    }
+}
+
+void intercept_classifier_remove(tunneler_context tnlr_ctx, intercept_ctx_t *intercept) {
+    struct intercept_classifier_s *cls = tnlr_ctx->classifier;
+    if (cls == NULL) {
+        return;
+    }
+
+    uint32_t idx;
+    for (idx = 0; idx < cls->len; idx++) {
+        if (cls->intercepts[idx] == intercept) break;
+    }
+    if (idx == cls->len) {
+        return;
+    }
+
+    // trie nodes are not reclaimed, so start over once as many intercepts were removed as are left
+    if (++cls->removed > cls->count) {
+        intercept_classifier_invalidate(tnlr_ctx);
+        return;
+    }
+
+    protocol_t *proto;
+    STAILQ_FOREACH(proto, &intercept->protocols, entries) {
+        struct cls_protocol_s *p = find_protocol(cls, proto->protocol);
+        if (p == NULL) {
+            continue;
+        }
+        address_t *a;
+        STAILQ_FOREACH(a, &intercept->addresses, entries) {
+            int bits;
+            struct cls_trie_s *t = address_trie(p, &a->za, &bits);
+            if (t != NULL) {
+                trie_remove(t, (const uint8_t *) &a->za.addr.cidr.ip, bits, idx);
+            }
+        }
+        if (intercept->match_addr) {
+            ports_remove(&p->match_addr_ports, idx);
+        }
+    }
+
+    cls->intercepts[idx] = NULL;
+    cls->free_slots[cls->free_len++] = idx;
+    cls->count--;
+}
+
+/** add an address match for an intercept, keeping only its best (smallest) score */
+static void add_candidate(struct intercept_classifier_s *cls, size_t *n, uint32_t intercept, int addr_score) {
+    if (cls->seen[intercept] != cls->stamp) {
+        cls->seen[intercept] = cls->stamp;
+        cls->slot[intercept] = (uint32_t) *n;
+        cls->candidates[*n].intercept = intercept;
+        cls->candidates[*n].addr_score = addr_score;
+        cls->candidates[*n].order = cls->order[intercept];
+        (*n)++;
+    } else if (addr_score < cls->candidates[cls->slot[intercept]].addr_score) {
+        cls->candidates[cls->slot[intercept]].addr_score = addr_score;
+    }
+}
+
+static void trie_match(struct intercept_classifier_s *cls, const struct cls_trie_s *t,
+                       const uint8_t *addr, int max_bits, size_t *n) {
+    if (t->len == 0) {
+        return;
+    }
+    uint32_t node = 0;
+    for (int depth = 0; ; depth++) {
+        for (int32_t r = t->nodes[node].refs; r >= 0; r = t->refs[r].next) {
+            add_candidate(cls, n, t->refs[r].intercept, max_bits - depth);
+        }
+        if (depth == max_bits) {
+            break;
+        }
+        node = t->nodes[node].child[prefix_bit(addr, depth)];
+        if (node == 0) {
+            break;
+        }
+    }
+}
+
+/** consult the match_addr callback of the intercepts that accept `port` and did not match by address */
+static void ports_match_addr(struct intercept_classifier_s *cls, const struct cls_ports_s *ix, size_t lo, size_t hi,
+                             int port, ip_addr_t *dst_addr, size_t *n) {
+    if (lo >= hi) {
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    if (ix->max_high[mid] < port) {
+        return;
+    }
+    ports_match_addr(cls, ix, lo, mid, port, dst_addr, n);
+    const struct cls_port_entry_s *e = &ix->entries[mid];
+    if (e->low > port) {
+        return;
+    }
+    if (e->high >= port && cls->seen[e->intercept] != cls->stamp) {
+        cls->seen[e->intercept] = cls->stamp;
+        intercept_ctx_t *intercept = cls->intercepts[e->intercept];
+        if (intercept->match_addr(dst_addr, intercept->app_intercept_ctx) != NULL) {
+            // leave room for a matching plain ziti_address_hostname to win
+            cls->candidates[*n].intercept = e->intercept;
+            cls->candidates[*n].addr_score = 1;
+            cls->candidates[*n].order = cls->order[e->intercept];
+            (*n)++;
+        }
+    }
+    ports_match_addr(cls, ix, mid + 1, hi, port, dst_addr, n);
+}
+
+/** sorts candidates into intercept list order */
+static int cmp_candidate(const void *a, const void *b) {
+    uint64_t oa = ((const struct cls_candidate_s *) a)->order;
+    uint64_t ob = ((const struct cls_candidate_s *) b)->order;
+    return (oa < ob) - (oa > ob);
+}
+
+intercept_ctx_t *intercept_classifier_lookup(tunneler_context tnlr_ctx, const char *protocol,
+                                             const ziti_address *src_za, ip_addr_t *dst_addr, uint16_t dst_port,
+                                             bool *src_dependent) {
+    if (tnlr_ctx->classifier == NULL && intercept_classifier_compile(tnlr_ctx) != 0) {
+        return NULL;
+    }
+    struct intercept_classifier_s *cls = tnlr_ctx->classifier;
+
+    struct cls_protocol_s *p = find_protocol(cls, protocol);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    if (++cls->stamp == 0) {
+        memset(cls->seen, 0, cls->cap * sizeof(uint32_t));
+        cls->stamp = 1;
+    }
+
+    size_t n = 0;
+    if (dst_addr->type == IPADDR_TYPE_V4) {
+        trie_match(cls, &p->v4, (const uint8_t *) &ip_2_ip4(dst_addr)->addr, 32, &n);
+    } else if (dst_addr->type == IPADDR_TYPE_V6) {
+        trie_match(cls, &p->v6, (const uint8_t *) ip_2_ip6(dst_addr)->addr, 128, &n);
+    } else {
+        TNL_LOG(ERR, "unknown address type %d", dst_addr->type);
+        return NULL;
+    }
+    ports_match_addr(cls, &p->match_addr_ports, 0, p->match_addr_ports.len, dst_port, dst_addr, &n);
+
+    // score in intercept list order so ties are broken as they always have been
+    qsort(cls->candidates, n, sizeof(struct cls_candidate_s), cmp_candidate);
+
+    intercept_ctx_t *best = NULL;
+    int best_addr_score = -1, best_pr_score = -1;
+    for (size_t i = 0; i < n; i++) {
+        intercept_ctx_t *intercept = cls->intercepts[cls->candidates[i].intercept];
+
+        const port_range_t *pr = port_match(dst_port, &intercept->port_ranges);
+        if (pr == NULL) {
+            continue;
+        }
+
+        // enforce the source address whitelist if it isn't empty
+        if (!STAILQ_EMPTY(&intercept->allowed_source_addresses)) {
+            *src_dependent = true;
+            if (address_match(src_za, &intercept->allowed_source_addresses) == NULL) {
+                continue;
+            }
+        }
+        int addr_score = cls->candidates[i].addr_score;
+        int pr_score = pr->high - pr->low;
+
+        if (best != NULL && (addr_score > best_addr_score || pr_score > best_pr_score)) {
+            // inferior to the best match so far
+            continue;
+        }
+        best = intercept;
+        best_addr_score = addr_score;
+        best_pr_score = pr_score;
+    }
+
+    return best;
+}
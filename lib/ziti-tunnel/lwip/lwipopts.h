@@ -3,10 +3,6 @@
 
 #define NO_SYS 1
 
-#ifndef MEM_SIZE
-#define MEM_SIZE              524288      /* the size of the heap memory (1600) */
-#endif
-
 #if SCAREY_DEBUGGING_LWIP
 #define MEMP_OVERFLOW_CHECK   2           /* reserves bytes before and after each memp element in every pool and fills it with a prominent default value */
 #define MEMP_SANITY_CHECK     1           /* run a sanity check after each mem_free() to make sure that the linked list of heap elements is not corrupted */
@@ -15,22 +11,29 @@
 #define LWIP_DEBUG
 #define PBUF_DEBUG LWIP_DBG_ON
 #endif
+#define LWIP_SUPPORT_CUSTOM_PBUF 1        /* netif_shim reads packets directly into custom pbufs */
 //#define MEMP_NUM_PBUF       64          /* number of memp struct pbufs (used for PBUF_ROM and PBUF_REF) */
 
+#define MEM_LIBC_MALLOC       1           /* use the system allocator instead of the fixed MEM_SIZE heap. MEM_SIZE has no effect */
+#define MEMP_MEM_MALLOC       1           /* allocate pool elements on demand. the MEMP_NUM_* and PBUF_POOL_SIZE values below are only enforced
+                                             for the pools that the tunneler limits at runtime (tcp/udp pcbs, pool pbufs and tcp segments
+                                             queued by the tunneler, see tunneler_sdk_options). other pools are not bounded */
+
 #ifndef MEMP_NUM_UDP_PCB
-#define MEMP_NUM_UDP_PCB      16          /* simultaneously active UDP "connections" (4) */
+#define MEMP_NUM_UDP_PCB      16          /* default limit of simultaneously active UDP "connections" (4) */
 #endif
 #ifndef MEMP_NUM_TCP_PCB
-#define MEMP_NUM_TCP_PCB      64          /* simultaneously active TCP connections (5) */
+#define MEMP_NUM_TCP_PCB      64          /* default limit of simultaneously active TCP connections (5) */
 #endif
 #ifndef MEMP_NUM_TCP_SEG
-#define MEMP_NUM_TCP_SEG      1024        /* simultaneously queued TCP segments (16) */
+#define MEMP_NUM_TCP_SEG      1024        /* default limit of TCP segments queued by writes to clients (16) */
 #endif
 #ifndef PBUF_POOL_SIZE
-#define PBUF_POOL_SIZE        512         /* number of buffers in the pbuf pool (16) */
+#define PBUF_POOL_SIZE        512         /* default limit of buffers in the pbuf pool (16) */
 #endif
 
-#define TCP_WND               0xffff      /* size of a TCP window. when using TCP_RCV_SCALE, TCP_WND is the total size with scaling applied (4 * TCP_MSS) */
+#define TCP_WND               (4*1024*1024) /* largest TCP receive window. when using TCP_RCV_SCALE, TCP_WND is the total size with scaling applied (4 * TCP_MSS).
+                                             the window offered to each client is sized by tunnel_tcp.c, starting well below this */
 #ifdef TCP_MSS
 #undef TCP_MSS  /* cleanup warnings */
 #endif
@@ -40,11 +43,12 @@
 // TCP_SNDQUEUELEN_OVERFLOW = 0xffffu - 3
 #define TCP_SNDLOWAT          (0xffff-(4*TCP_MSS)-1) /* TCP writable space (bytes). must be less than TCP_SND_BUF. the amount of space which must be available in the TCP snd_buf for select to return writable (combined with TCP_SNDQUEUELOWAT) LWIP_MIN(LWIP_MAX(((TCP_SND_BUF)/2), (2 * TCP_MSS) + 1), (TCP_SND_BUF) - 1) */
 #define LWIP_WND_SCALE        1           /* set to 1 to enable window scaling */
-#define TCP_RCV_SCALE         14          /* desired scaling factor - shift count in the range of [0..14] */
+#define TCP_RCV_SCALE         7           /* desired scaling factor - shift count in the range of [0..14]. 0xffff << 7 covers TCP_WND */
 
 #define LWIP_SINGLE_NETIF 1               /* avoid some lwip "routing" logic */
 
 #define LWIP_TCP_KEEPALIVE 1
+#define LWIP_TCP_PCB_NUM_EXT_ARGS 3      /* the tunneler's flow table, output batching and write buffers are notified when lwip frees a tcp pcb */
 #define TCP_KEEPIDLE_DEFAULT 30000       /* 30 seconds of idle before starting to send KEEPALIVE packets */
 #define TCP_KEEPINTVL_DEFAULT 10000      /* 10 seconds interval between KEEPALIVE packets */
 #define TCP_KEEPCNT_DEFAULT 3            /* number of missed KEEPALIVE ACKs to consider the client dead */
@@ -1,12 +1,14 @@
-//#include <sys/uio.h>
-
 #define LWIP_DONT_PROVIDE_BYTEORDER_FUNCTIONS 1
 
+#include <stdlib.h>
+#include <string.h>
 #include "uv.h"
 #include "lwip/err.h"
 #include "lwip/pbuf.h"
 #include "lwip/ip_addr.h"
 #include "lwip/netif.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/tcp.h"
 #include "ziti/netif_driver.h"
 #include "netif_shim.h"
 #include "../ziti_tunnel_priv.h"
@@ -17,22 +19,151 @@
 /* max ipv4 MTU */
 #define BUFFER_SIZE 64 * 1024
 
-static char shim_buffer[BUFFER_SIZE];
+/* default read budget per input event. the packet budget adapts between SHIM_MIN_READS and the configured max */
+#define SHIM_MAX_READS 128
+#define SHIM_MAX_READ_USEC 2000
+#define SHIM_MIN_READS 8
+/* max packets passed to the driver in a single read_batch/write_batch call */
+#define SHIM_BATCH_SIZE 32
+/* initial size of receive buffers. grows when the driver reports a truncated packet */
+#define SHIM_RX_BUF_SIZE 2048
+#define SHIM_RX_BUF_MAX 0xffff
+/* max number of receive buffers that can be held by lwip at any time */
+#define SHIM_RX_POOL_SIZE 512
+/* mtu of the tun device, unless the netif has one */
+#define SHIM_DEFAULT_MTU 1500
+
+/* max pbufs in a chain that is passed to writev. longer chains are flattened */
+#define SHIM_MAX_SEGMENTS 16
+
+/* packets emitted by lwip while netif_shim_input() is running are queued here and flushed with write_batch */
+static struct {
+    bool active;
+    int count;
+    struct pbuf *pbufs[SHIM_BATCH_SIZE];
+} tx_batch;
+
+static void shim_write_buf(netif_driver dev, void *buf, size_t len) {
+    if (dev->write != NULL) {
+        dev->write(dev->handle, buf, len);
+    } else {
+        uv_buf_t b = uv_buf_init(buf, len);
+        dev->write_batch(dev->handle, &b, 1);
+    }
+}
+
+static void shim_write(netif_driver dev, struct pbuf *p) {
+    if (p->next == NULL) {
+        shim_write_buf(dev, p->payload, p->len);
+        return;
+    }
+
+    if (dev->writev != NULL && pbuf_clen(p) <= SHIM_MAX_SEGMENTS) {
+        uv_buf_t bufs[SHIM_MAX_SEGMENTS];
+        int n = 0;
+        for (struct pbuf *q = p; q != NULL; q = q->next) {
+            if (q->len > 0) {
+                bufs[n++] = uv_buf_init(q->payload, q->len);
+            }
+        }
+        dev->writev(dev->handle, bufs, n);
+        return;
+    }
+
+    // driver cannot gather, so flatten the chain
+    struct pbuf *flat = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+    if (flat == NULL) {
+        TNL_LOG(ERR, "failed to allocate pbuf for %d byte packet", p->tot_len);
+        return;
+    }
+    shim_write_buf(dev, flat->payload, flat->len);
+    pbuf_free(flat);
+}
+
+/* write `count` single-pbuf packets from the batch, starting at `first` */
+static void shim_write_run(netif_driver dev, int first, int count) {
+    uv_buf_t bufs[SHIM_BATCH_SIZE];
+    for (int i = 0; i < count; i++) {
+        bufs[i] = uv_buf_init(tx_batch.pbufs[first + i]->payload, tx_batch.pbufs[first + i]->len);
+    }
+
+    int written = 0;
+    while (written < count) {
+        int rc = dev->write_batch(dev->handle, bufs + written, count - written);
+        if (rc <= 0) {
+            TNL_LOG(WARN, "write_batch failed after %d/%d packets: %d", written, count, rc);
+            break;
+        }
+        written += rc;
+    }
+}
+
+static void shim_flush(netif_driver dev) {
+    if (tx_batch.count == 0) {
+        return;
+    }
+
+    // chains (tcp segments that reference data held by the tcp layer) are written individually, in order
+    int run = 0;
+    for (int i = 0; i < tx_batch.count; i++) {
+        if (tx_batch.pbufs[i]->next != NULL) {
+            shim_write_run(dev, run, i - run);
+            shim_write(dev, tx_batch.pbufs[i]);
+            run = i + 1;
+        }
+    }
+    shim_write_run(dev, run, tx_batch.count - run);
+    TNL_LOG(TRACE, "flushed %d packets", tx_batch.count);
+
+    for (int i = 0; i < tx_batch.count; i++) {
+        pbuf_free(tx_batch.pbufs[i]);
+        tx_batch.pbufs[i] = NULL;
+    }
+    tx_batch.count = 0;
+}
+
+/* true if every pbuf in the chain stays valid after netif output returns */
+static bool shim_can_hold(struct pbuf *p) {
+    for (struct pbuf *q = p; q != NULL; q = q->next) {
+        if (PBUF_NEEDS_COPY(q)) {
+            return false;
+        }
+    }
+    return p->next == NULL || pbuf_clen(p) <= SHIM_MAX_SEGMENTS;
+}
+
 /**
  * This function is called by the TCP/IP stack when an IP packet should be sent.
  */
 static err_t netif_shim_output(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr) {
     netif_driver dev = netif->state;
 
-    u16_t copied = pbuf_copy_partial(p, shim_buffer, p->tot_len, 0);
-    if (copied != p->tot_len) {
-        TNL_LOG(ERR, "pbuf_copy_partial() failed %d/%d", copied, p->tot_len);
-        return ERR_BUF; // ?
+    if (ip_ver(p->payload) == 4)
+        TNL_LOG(TRACE, "writing packet " PACKET_FMT " len=%d", PACKET_FMT_ARGS(p->payload), p->tot_len);
+
+    if (!tx_batch.active || dev->write_batch == NULL) {
+        shim_write(dev, p);
+        return ERR_OK;
     }
 
-    if (ip_ver(shim_buffer) == 4)
-        TNL_LOG(TRACE, "writing packet " PACKET_FMT " len=%d", PACKET_FMT_ARGS(shim_buffer), copied);
-    dev->write(dev->handle, shim_buffer, p->tot_len);
+    // lwip may reuse the pbuf after we return, so hold a reference to it or copy it if it's not safe to hold.
+    // PBUF_ROM data of tcp segments is kept by the tcp layer until the output flush that follows the batch
+    struct pbuf *q;
+    if (shim_can_hold(p)) {
+        pbuf_ref(p);
+        q = p;
+    } else {
+        q = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+        if (q == NULL) {
+            shim_write(dev, p);
+            return ERR_OK;
+        }
+    }
+
+    tx_batch.pbufs[tx_batch.count++] = q;
+    if (tx_batch.count == SHIM_BATCH_SIZE) {
+        shim_flush(dev);
+    }
     return ERR_OK;
 }
 
@@ -43,6 +174,242 @@ static err_t netif_shim_output_ip6(struct netif *netif, struct pbuf *p, const ip
     return netif_shim_output(netif, p, NULL);
 }
 
+static struct {
+    int max_packets;
+    uint64_t max_nsec;
+    int packets;
+
+    uint64_t events;
+    uint64_t packets_read;
+    uint64_t count_exhausted;
+    uint64_t time_exhausted;
+} rx_budget = {
+    .max_packets = SHIM_MAX_READS,
+    .max_nsec = SHIM_MAX_READ_USEC * 1000,
+    .packets = SHIM_MAX_READS,
+};
+
+void netif_shim_set_read_budget(int max_packets, int max_usec) {
+    if (max_packets > 0) {
+        rx_budget.max_packets = LWIP_MAX(max_packets, SHIM_MIN_READS);
+        rx_budget.packets = rx_budget.max_packets;
+    }
+    if (max_usec > 0) {
+        rx_budget.max_nsec = (uint64_t) max_usec * 1000;
+    }
+    TNL_LOG(DEBUG, "netif read budget: %d packets, %d usec", rx_budget.max_packets, (int)(rx_budget.max_nsec / 1000));
+}
+
+void netif_shim_get_stats(tunnel_netif_stats *stats) {
+    stats->read_events = (int64_t) rx_budget.events;
+    stats->packets_read = (int64_t) rx_budget.packets_read;
+    stats->budget_packets = rx_budget.packets;
+    stats->budget_max_packets = rx_budget.max_packets;
+    stats->budget_usec = (int64_t) (rx_budget.max_nsec / 1000);
+    stats->count_budget_exhausted = (int64_t) rx_budget.count_exhausted;
+    stats->time_budget_exhausted = (int64_t) rx_budget.time_exhausted;
+}
+
+/* custom pbufs that batch-capable drivers read into, so packets reach lwip without being copied */
+struct rx_pbuf_s {
+    struct pbuf_custom pc;
+    struct rx_pbuf_s *next;
+    u16_t size;
+    char data[];
+};
+
+/**
+ * packets are always read into regular buffers. a driver that can return larger packets (offloaded super-segments)
+ * hands them back in its own memory, and they are copied to large buffers. no more than a batch of large buffers
+ * is kept for reuse.
+ */
+static struct {
+    u16_t buf_size;
+    u16_t large_size; // size of the buffers that hold packets the driver returned in its own memory, or 0
+    int allocated;
+    int in_use; // handed to the driver or held by lwip
+    struct rx_pbuf_s *free_list;
+    struct rx_pbuf_s *large_free_list;
+    int large_free;
+} rx_pool = { .buf_size = SHIM_RX_BUF_SIZE };
+
+/* fallback buffer for drivers without read_batch, and for reads when the rx pool is exhausted */
+static char *rx_scratch;
+
+static void rx_pbuf_put(struct rx_pbuf_s *rx) {
+    rx_pool.in_use--;
+    if (rx->size == rx_pool.buf_size) {
+        rx->next = rx_pool.free_list;
+        rx_pool.free_list = rx;
+    } else if (rx->size == rx_pool.large_size && rx_pool.large_free < SHIM_BATCH_SIZE) {
+        rx->next = rx_pool.large_free_list;
+        rx_pool.large_free_list = rx;
+        rx_pool.large_free++;
+    } else {
+        rx_pool.allocated--;
+        free(rx);
+    }
+}
+
+static void rx_pbuf_free(struct pbuf *p) {
+    rx_pbuf_put((struct rx_pbuf_s *) p);
+}
+
+/* get a buffer of `size` bytes, which is either the regular or the large buffer size */
+static struct rx_pbuf_s *rx_pbuf_get(u16_t size) {
+    bool large = size != rx_pool.buf_size;
+    struct rx_pbuf_s *rx = large ? rx_pool.large_free_list : rx_pool.free_list;
+    if (rx != NULL) {
+        if (large) {
+            rx_pool.large_free_list = rx->next;
+            rx_pool.large_free--;
+        } else {
+            rx_pool.free_list = rx->next;
+        }
+        rx_pool.in_use++;
+        return rx;
+    }
+
+    if (rx_pool.allocated >= SHIM_RX_POOL_SIZE) {
+        // make room by releasing an idle buffer of the other size
+        struct rx_pbuf_s *idle = large ? rx_pool.free_list : rx_pool.large_free_list;
+        if (idle == NULL) {
+            return NULL;
+        }
+        if (large) {
+            rx_pool.free_list = idle->next;
+        } else {
+            rx_pool.large_free_list = idle->next;
+            rx_pool.large_free--;
+        }
+        rx_pool.allocated--;
+        free(idle);
+    }
+    rx = malloc(sizeof(struct rx_pbuf_s) + size);
+    if (rx != NULL) {
+        rx->size = size;
+        rx->pc.custom_free_function = rx_pbuf_free;
+        rx_pool.allocated++;
+        rx_pool.in_use++;
+    }
+    return rx;
+}
+
+int netif_shim_rx_capacity(void) {
+    return SHIM_RX_POOL_SIZE;
+}
+
+int netif_shim_rx_headroom(void) {
+    return SHIM_RX_POOL_SIZE - rx_pool.in_use;
+}
+
+int netif_shim_rx_payload(void) {
+    u16_t mtu = netif_default != NULL && netif_default->mtu != 0 ? netif_default->mtu : SHIM_DEFAULT_MTU;
+    return mtu - IP_HLEN - TCP_HLEN;
+}
+
+/* make future receive buffers big enough for a packet of `len` bytes. buffers that are in use are released when lwip frees them */
+static void rx_pool_grow(size_t len) {
+    u32_t size = rx_pool.buf_size;
+    while (size < len) {
+        size *= 2;
+    }
+    rx_pool.buf_size = (u16_t) LWIP_MIN(size, SHIM_RX_BUF_MAX);
+    TNL_LOG(INFO, "increased receive buffer size to %d", rx_pool.buf_size);
+
+    while (rx_pool.free_list != NULL) {
+        struct rx_pbuf_s *rx = rx_pool.free_list;
+        rx_pool.free_list = rx->next;
+        rx_pool.allocated--;
+        free(rx);
+    }
+}
+
+static void shim_input_pbuf(struct netif *netif, struct pbuf *p) {
+    err_t err = netif->input(p, netif);
+    if (err != ERR_OK) {
+        TNL_LOG(ERR, "============================> tunif_input: netif input error %s", lwip_strerr(err));
+        pbuf_free(p);
+    }
+}
+
+static int shim_read_batch(netif_driver dev, netif_handle queue, struct netif *netif, uint64_t deadline) {
+    struct rx_pbuf_s *rx[SHIM_BATCH_SIZE];
+    uv_buf_t bufs[SHIM_BATCH_SIZE];
+
+    int count = 0;
+    while (count < rx_budget.packets && uv_hrtime() < deadline) {
+        int want = LWIP_MIN(SHIM_BATCH_SIZE, rx_budget.packets - count);
+        int avail = 0;
+        while (avail < want && (rx[avail] = rx_pbuf_get(rx_pool.buf_size)) != NULL) {
+            bufs[avail] = uv_buf_init(rx[avail]->data, rx[avail]->size);
+            avail++;
+        }
+        if (avail == 0) {
+            // rx pool exhausted. keep draining the device so lwip can still get pool pbufs (or drop)
+            TNL_LOG(TRACE, "rx pbufs exhausted");
+            bufs[0] = uv_buf_init(rx_scratch, SHIM_RX_BUF_MAX);
+        }
+
+        int n = dev->read_batch(queue, bufs, avail > 0 ? avail : 1);
+        bool spilled = false;
+        for (int i = 0; i < LWIP_MAX(n, 0); i++) {
+            size_t len = bufs[i].len;
+            // the driver returned the packet in its own memory
+            bool moved = avail > 0 && bufs[i].base != rx[i]->data;
+            spilled |= moved;
+            size_t cap = avail == 0 ? SHIM_RX_BUF_MAX : moved ? LWIP_MAX(rx_pool.large_size, rx[i]->size) : rx[i]->size;
+            if (len > cap) {
+                TNL_LOG(WARN, "dropping truncated packet len=%zu buf_size=%zu", len, cap);
+                if (!moved && cap < SHIM_RX_BUF_MAX && len > rx_pool.buf_size) {
+                    rx_pool_grow(len);
+                }
+                if (avail > 0) rx_pbuf_put(rx[i]);
+                continue;
+            }
+
+            if (ip_ver(bufs[i].base) == 4)
+                TNL_LOG(TRACE, "received packet " PACKET_FMT " len=%zu", PACKET_FMT_ARGS(bufs[i].base), len);
+
+            if (avail == 0) {
+                on_packet(bufs[i].base, (ssize_t) len, netif);
+                continue;
+            }
+
+            if (moved) {
+                if (len > rx[i]->size) {
+                    struct rx_pbuf_s *large = rx_pbuf_get(rx_pool.large_size);
+                    rx_pbuf_put(rx[i]);
+                    if (large == NULL) {
+                        on_packet(bufs[i].base, (ssize_t) len, netif);
+                        continue;
+                    }
+                    rx[i] = large;
+                }
+                memcpy(rx[i]->data, bufs[i].base, len);
+            }
+
+            struct pbuf *p = pbuf_alloced_custom(PBUF_RAW, (u16_t) len, PBUF_REF, &rx[i]->pc, rx[i]->data, rx[i]->size);
+            shim_input_pbuf(netif, p);
+        }
+
+        // return buffers that were not filled
+        for (int i = LWIP_MAX(n, 0); i < avail; i++) {
+            rx_pbuf_put(rx[i]);
+        }
+
+        if (n <= 0) {
+            break;
+        }
+        count += n;
+        // a short batch means the device is drained, unless the driver stopped after returning a packet in its own memory
+        if (n < LWIP_MAX(avail, 1) && !spilled) {
+            break;
+        }
+    }
+    return count;
+}
+
 /**
  * This function should be called when a packet is ready to be read
  * from the interface. It uses the function low_level_input() that
@@ -51,21 +418,49 @@ static err_t netif_shim_output_ip6(struct netif *netif, struct pbuf *p, const ip
  */
 void netif_shim_input(struct netif *netif) {
     netif_driver dev = netif->state;
-    char buf[BUFFER_SIZE];
+    netif_shim_input_queue(netif, dev->handle);
+}
 
+void netif_shim_input_queue(struct netif *netif, netif_handle queue) {
+    netif_driver dev = netif->state;
     int count = 0;
-    while (count < 128) {
-        ssize_t nr = dev->read(dev->handle, buf, sizeof(buf));
-        if ((nr <= 0) || (nr > 0xffff)) {
-            break;
-        }
-        count++;
 
-        if (ip_ver(buf) == 4)
-            TNL_LOG(TRACE, "received packet " PACKET_FMT " len=%zd", PACKET_FMT_ARGS(buf), nr);
+    uint64_t start = uv_hrtime();
+    uint64_t deadline = start + rx_budget.max_nsec;
 
-        on_packet(buf, nr, netif);
+    tx_batch.active = true;
+    if (dev->read_batch != NULL) {
+        count = shim_read_batch(dev, queue, netif, deadline);
+    } else {
+        char *buf = rx_scratch;
+        while (count < rx_budget.packets && uv_hrtime() < deadline) {
+            ssize_t nr = dev->read(queue, buf, BUFFER_SIZE);
+            if ((nr <= 0) || (nr > 0xffff)) {
+                break;
+            }
+            count++;
+
+            if (ip_ver(buf) == 4)
+                TNL_LOG(TRACE, "received packet " PACKET_FMT " len=%zd", PACKET_FMT_ARGS(buf), nr);
+
+            on_packet(buf, nr, netif);
+        }
+    }
+    tx_batch.active = false;
+    shim_flush(dev);
+
+    // leave remaining packets for the next poll event so other loop callbacks can run. shrink the packet budget
+    // if reading took too long, and grow it back when the packet budget runs out first.
+    rx_budget.events++;
+    rx_budget.packets_read += count;
+    if (uv_hrtime() >= deadline) {
+        rx_budget.time_exhausted++;
+        rx_budget.packets = LWIP_MAX(rx_budget.packets / 2, SHIM_MIN_READS);
+    } else if (count >= rx_budget.packets) {
+        rx_budget.count_exhausted++;
+        rx_budget.packets = LWIP_MIN(rx_budget.packets + rx_budget.packets / 4 + 1, rx_budget.max_packets);
     }
+
     TNL_LOG(TRACE, "done after reading %d packets", count);
 }
 
@@ -74,7 +469,7 @@ void on_packet(const char *buf, ssize_t nr, void *ctx) {
     struct netif *netif = ctx;
     struct pbuf *p;
     /* We allocate a pbuf chain of pbufs from the pool. */
-    p = pbuf_alloc(PBUF_RAW, (u16_t) nr, PBUF_POOL);
+    p = tunneler_pool_available(MEMP_PBUF_POOL) ? pbuf_alloc(PBUF_RAW, (u16_t) nr, PBUF_POOL) : NULL;
 
     if (p != NULL) {
         if (!log_pbuf_errors) {
@@ -97,11 +492,7 @@ void on_packet(const char *buf, ssize_t nr, void *ctx) {
         return;
     }
 
-    err_t err = netif->input(p, netif);
-    if (err != ERR_OK) {
-        TNL_LOG(ERR, "============================> tunif_input: netif input error %s", lwip_strerr(err));
-        pbuf_free(p);
-    }
+    shim_input_pbuf(netif, p);
 }
 
 /**
@@ -115,5 +506,16 @@ err_t netif_shim_init(struct netif *netif) {
     netif->output = netif_shim_output;
     netif->output_ip6 = netif_shim_output_ip6;
 
+    netif_driver dev = netif->state;
+    if (dev != NULL && dev->max_packet_size > rx_pool.buf_size) {
+        rx_pool.large_size = (u16_t) LWIP_MIN(dev->max_packet_size, SHIM_RX_BUF_MAX);
+        TNL_LOG(INFO, "accepting packets of up to %d bytes", rx_pool.large_size);
+    }
+
+    if (rx_scratch == NULL && (rx_scratch = malloc(BUFFER_SIZE)) == NULL) {
+        TNL_LOG(ERR, "failed to allocate receive buffer");
+        return ERR_MEM;
+    }
+
     return ERR_OK;
 }
\ No newline at end of file
@@ -30,10 +30,10 @@ TEST_CASE("address_match", "[address]") {
     LIST_INIT(&tctx.intercepts);
 
     intercept_ctx_t *intercept_s1 = intercept_ctx_new(&tctx, "s1", nullptr);
-    LIST_INSERT_HEAD(&tctx.intercepts, intercept_s1, entries);
     intercept_ctx_add_address(intercept_s1, ZA_INIT_STR(&za, "192.168.0.88"));
     intercept_ctx_add_protocol(intercept_s1, "tcp");
     intercept_ctx_add_port_range(intercept_s1, 80, 80);
+    ziti_tunneler_intercept(&tctx, intercept_s1);
 
     IP_ADDR4(&ip, 127, 0, 0, 1);
     REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &ip, &ip, 80) == nullptr);
@@ -42,10 +42,10 @@ TEST_CASE("address_match", "[address]") {
     REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &ip, &ip, 80) == intercept_s1);
 
     intercept_ctx_t *intercept_s2 = intercept_ctx_new(&tctx, "s2", nullptr);
-    LIST_INSERT_HEAD(&tctx.intercepts, intercept_s2, entries);
     intercept_ctx_add_address(intercept_s2, ZA_INIT_STR(&za, "192.168.0.0/24"));
     intercept_ctx_add_protocol(intercept_s2, "tcp");
     intercept_ctx_add_port_range(intercept_s2, 80, 80);
+    ziti_tunneler_intercept(&tctx, intercept_s2);
 
     // s2 should be overlooked even though it matches and precedes s1 in the intercept list
     REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &ip, &ip, 80) == intercept_s1);
@@ -55,20 +55,20 @@ TEST_CASE("address_match", "[address]") {
     REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &ip, &ip, 80) == intercept_s2);
 
     intercept_ctx_t *intercept_s3 = intercept_ctx_new(&tctx, "s3", nullptr);
-    LIST_INSERT_HEAD(&tctx.intercepts, intercept_s3, entries);
     intercept_ctx_add_address(intercept_s3, ZA_INIT_STR(&za, "192.168.0.0/16"));
     intercept_ctx_add_protocol(intercept_s3, "tcp");
     intercept_ctx_add_port_range(intercept_s3, 80, 85);
+    ziti_tunneler_intercept(&tctx, intercept_s3);
 
     // s2 should still win due to smaller cidr range
     IP_ADDR4(&ip, 192, 168, 0, 10);
     REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &ip, &ip, 80) == intercept_s2);
 
     intercept_ctx_t *intercept_s4 = intercept_ctx_new(&tctx, "s4", nullptr);
-    LIST_INSERT_HEAD(&tctx.intercepts, intercept_s4, entries);
     intercept_ctx_add_address(intercept_s4, ZA_INIT_STR(&za, "192.168.0.0/16"));
     intercept_ctx_add_protocol(intercept_s4, "tcp");
     intercept_ctx_add_port_range(intercept_s4, 80, 90);
+    ziti_tunneler_intercept(&tctx, intercept_s4);
 
     // s2 should be overlooked despite CIDR match with smaller prefix due to port mismatch
     // s3 should win over s4 due to smaller port range
@@ -91,15 +91,109 @@ TEST_CASE("address_match", "[address]") {
     // s4 has a larger port range than s3, but no source ip whitelist
     REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &src_denied, &ip, 83) == intercept_s4);
 
-    // verify the intercept cache is populated
-    REQUIRE(model_map_get(&tctx.intercepts_cache, "tcp:127.0.0.1:80") == nullptr);
-    REQUIRE(model_map_get(&tctx.intercepts_cache, "tcp:192.168.0.88:80") == intercept_s1);
-    REQUIRE(model_map_get(&tctx.intercepts_cache, "tcp:192.168.0.10:80") == intercept_s2);
-    REQUIRE(model_map_get(&tctx.intercepts_cache, "tcp:192.168.0.10:81") == intercept_s3);
+    // verify the intercept cache is populated. results that depend on the source whitelist are not cached
+    intercept_ctx_t *cached;
+    IP_ADDR4(&ip, 192, 168, 0, 10);
+    REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &ip, &ip, 80) == intercept_s2);
+    REQUIRE_FALSE(intercept_cache_get(&tctx, "tcp", &ip, 80, &cached)); // s3 whitelist was consulted
+    REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &ip, &ip, 90) == intercept_s4);
+    REQUIRE(intercept_cache_get(&tctx, "tcp", &ip, 90, &cached));
+    REQUIRE(cached == intercept_s4);
+    IP_ADDR4(&ip, 127, 0, 0, 1);
+    REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &ip, &ip, 80) == nullptr);
+    REQUIRE(intercept_cache_get(&tctx, "tcp", &ip, 80, &cached));
+    REQUIRE(cached == nullptr);
+
+    // changing an intercept invalidates cached lookups
+    intercept_ctx_add_port_range(intercept_s1, 83, 83);
+    REQUIRE_FALSE(intercept_cache_get(&tctx, "tcp", &ip, 80, &cached));
+    IP_ADDR4(&ip, 192, 168, 0, 88);
+    REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &src_denied, &ip, 83) == intercept_s1);
 
     // todo hostname and wildcard dns matching
 }
 
+static const ziti_address *match_any_addr(ip_addr_t *addr, void *ctx) {
+    static ziti_address any;
+    return &any;
+}
+
+TEST_CASE("address_match_ipv6", "[address]") {
+    struct tunneler_ctx_s tctx = { };
+    ziti_address za;
+    ip_addr_t ip;
+    intercept_ctx_t *cached;
+    int zi_s1, zi_s2, zi_s3, zi_s4;
+    LIST_INIT(&tctx.intercepts);
+
+    intercept_ctx_t *intercept_s1 = intercept_ctx_new(&tctx, "s1", &zi_s1);
+    intercept_ctx_add_address(intercept_s1, ZA_INIT_STR(&za, "fd00:1::/32"));
+    intercept_ctx_add_protocol(intercept_s1, "udp");
+    intercept_ctx_add_port_range(intercept_s1, 53, 53);
+    ziti_tunneler_intercept(&tctx, intercept_s1);
+
+    intercept_ctx_t *intercept_s2 = intercept_ctx_new(&tctx, "s2", &zi_s2);
+    intercept_ctx_add_address(intercept_s2, ZA_INIT_STR(&za, "fd00:1:2::/48"));
+    intercept_ctx_add_address(intercept_s2, ZA_INIT_STR(&za, "10.0.0.0/8"));
+    intercept_ctx_add_protocol(intercept_s2, "udp");
+    intercept_ctx_add_port_range(intercept_s2, 1, 1024);
+    ziti_tunneler_intercept(&tctx, intercept_s2);
+
+    // longest prefix wins even though its port range is larger
+    ipaddr_aton("fd00:1:2::5", &ip);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 53) == intercept_s2);
+    ipaddr_aton("fd00:1:3::5", &ip);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 53) == intercept_s1);
+    REQUIRE(lookup_intercept_by_address(&tctx, "tcp", &ip, &ip, 53) == nullptr);
+    // ipv4 prefixes do not match ipv6 addresses
+    ipaddr_aton("::a00:5", &ip);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 53) == nullptr);
+
+    // a wildcard domain match scores as a near exact address match, but only applies to its own ports
+    intercept_ctx_t *intercept_s3 = intercept_ctx_new(&tctx, "s3", &zi_s3);
+    intercept_ctx_set_match_addr(intercept_s3, match_any_addr);
+    intercept_ctx_add_protocol(intercept_s3, "udp");
+    intercept_ctx_add_port_range(intercept_s3, 53, 53);
+    ziti_tunneler_intercept(&tctx, intercept_s3);
+
+    ipaddr_aton("fd00:1:2::6", &ip);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 53) == intercept_s3);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 100) == intercept_s2);
+    ipaddr_aton("fd00:9::1", &ip);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 54) == nullptr);
+
+    // removing an intercept only invalidates the cached lookups that it was a candidate for
+    ipaddr_aton("fd00:1:2::5", &ip);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 100) == intercept_s2);
+    ipaddr_aton("fd00:1:3::5", &ip);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 100) == nullptr);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 53) == intercept_s3);
+    ziti_tunneler_stop_intercepting(&tctx, &zi_s3);
+    REQUIRE_FALSE(intercept_cache_get(&tctx, "udp", &ip, 53, &cached));
+    REQUIRE(intercept_cache_get(&tctx, "udp", &ip, 100, &cached));
+    REQUIRE(cached == nullptr);
+    ipaddr_aton("fd00:1:2::6", &ip);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 53) == intercept_s2);
+
+    // changes in a batch are applied on commit
+    ziti_tunneler_begin_intercept_batch(&tctx);
+    ziti_tunneler_stop_intercepting(&tctx, &zi_s2);
+    intercept_ctx_t *intercept_s4 = intercept_ctx_new(&tctx, "s4", &zi_s4);
+    intercept_ctx_add_address(intercept_s4, ZA_INIT_STR(&za, "fd00:1:2::/64"));
+    intercept_ctx_add_protocol(intercept_s4, "udp");
+    intercept_ctx_add_port_range(intercept_s4, 100, 100);
+    ziti_tunneler_intercept(&tctx, intercept_s4);
+    ziti_tunneler_commit_intercept_batch(&tctx);
+
+    ipaddr_aton("fd00:1:2::5", &ip);
+    REQUIRE_FALSE(intercept_cache_get(&tctx, "udp", &ip, 100, &cached));
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 100) == intercept_s4);
+    REQUIRE(lookup_intercept_by_address(&tctx, "udp", &ip, &ip, 53) == intercept_s1);
+    ipaddr_aton("fd00:1:3::5", &ip);
+    REQUIRE(intercept_cache_get(&tctx, "udp", &ip, 100, &cached));
+    REQUIRE(cached == nullptr);
+}
+
 TEST_CASE("address_conversion", "[address]") {
     const char *ip6_str = "2768:8631:c02:ffc9::1308";
     ip_addr_t ip6;
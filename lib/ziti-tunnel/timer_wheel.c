@@ -0,0 +1,138 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+/**
+ * hashed timing wheel for connection idle timeouts, driven by a single loop timer.
+ *
+ * a timer is linked into the slot of its deadline when it is scheduled. pushing the deadline out
+ * only stores the new deadline: when the wheel reaches the slot, timers that are not due yet are
+ * moved to the slot of their current deadline instead of expiring. deadlines beyond one turn of the
+ * wheel are handled the same way, by coming around again.
+ */
+
+#include "ziti_tunnel_priv.h"
+
+#define TNL_WHEEL_TICK_MS 250
+#define TNL_WHEEL_SLOTS 256 // one turn is 64 seconds
+
+static struct {
+    uv_timer_t timer;
+    bool initialized;
+    struct tnl_timer_s *slots[TNL_WHEEL_SLOTS];
+    uint64_t tick;  // the next tick to process
+    size_t count;
+} wheel;
+
+static uint64_t tick_of(uint64_t ms) {
+    return ms / TNL_WHEEL_TICK_MS;
+}
+
+static void link_timer(struct tnl_timer_s **head, struct tnl_timer_s *t) {
+    t->next = *head;
+    if (t->next) t->next->prev = &t->next;
+    t->prev = head;
+    *head = t;
+}
+
+static void unlink_timer(struct tnl_timer_s *t) {
+    *t->prev = t->next;
+    if (t->next) t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/** link `t` into the slot of its deadline, or of `min_tick` if the deadline is earlier */
+static void link_by_deadline(struct tnl_timer_s *t, uint64_t min_tick) {
+    uint64_t tick = tick_of(t->deadline);
+    if (tick < min_tick) tick = min_tick;
+    link_timer(&wheel.slots[tick % TNL_WHEEL_SLOTS], t);
+}
+
+static void on_wheel_tick(uv_timer_t *timer) {
+    uint64_t now = uv_now(timer->loop);
+    uint64_t now_tick = tick_of(now);
+    // catch up on ticks that were missed while the loop was busy, at most one turn
+    if (now_tick > wheel.tick + TNL_WHEEL_SLOTS) {
+        wheel.tick = now_tick - TNL_WHEEL_SLOTS;
+    }
+
+    while (wheel.tick <= now_tick && wheel.count > 0) {
+        struct tnl_timer_s **slot = &wheel.slots[wheel.tick % TNL_WHEEL_SLOTS];
+        wheel.tick++; // timers that are linked from here on go to later slots
+        // detach the slot, so timers that are moved back into it are not visited again this tick.
+        // expiry callbacks may cancel any timer, including ones on the detached list
+        struct tnl_timer_s *due = *slot;
+        *slot = NULL;
+        if (due) due->prev = &due;
+        while (due != NULL) {
+            struct tnl_timer_s *t = due;
+            unlink_timer(t);
+            if (t->deadline > now) {
+                link_by_deadline(t, wheel.tick);
+                continue;
+            }
+            wheel.count--;
+            t->cb(t);
+        }
+    }
+    if (wheel.tick <= now_tick) {
+        wheel.tick = now_tick + 1;
+    }
+
+    if (wheel.count == 0) {
+        uv_timer_stop(timer);
+    }
+}
+
+void tnl_timer_schedule(uv_loop_t *loop, struct tnl_timer_s *t, uint32_t timeout_ms, tnl_timer_cb cb, void *data) {
+    uint64_t deadline = uv_now(loop) + timeout_ms;
+    t->cb = cb;
+    t->data = data;
+    if (t->prev != NULL) {
+        if (deadline >= t->deadline) {
+            t->deadline = deadline; // found in its current slot, and moved when that comes around
+            return;
+        }
+        // earlier than the slot it is in
+        unlink_timer(t);
+        t->deadline = deadline;
+        link_by_deadline(t, wheel.tick);
+        return;
+    }
+    t->deadline = deadline;
+
+    if (!wheel.initialized) {
+        uv_timer_init(loop, &wheel.timer);
+        uv_unref((uv_handle_t *) &wheel.timer);
+        wheel.initialized = true;
+    }
+    if (wheel.count++ == 0) {
+        wheel.tick = tick_of(uv_now(loop));
+        uv_timer_start(&wheel.timer, on_wheel_tick, TNL_WHEEL_TICK_MS, TNL_WHEEL_TICK_MS);
+    }
+    // deadlines in the past land on the next slot that is processed
+    link_by_deadline(t, wheel.tick);
+}
+
+void tnl_timer_cancel(struct tnl_timer_s *t) {
+    if (t->prev == NULL) {
+        return;
+    }
+    unlink_timer(t);
+    if (--wheel.count == 0 && wheel.initialized) {
+        uv_timer_stop(&wheel.timer);
+    }
+}
@@ -0,0 +1,162 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+/**
+ * per-service latency histograms for the stages of the intercept data path.
+ *
+ * values are recorded in microseconds into log-linear buckets: every power of two is split into
+ * TNL_HIST_SUB_BUCKETS linear buckets, so recording is a couple of shifts and an increment, and
+ * percentiles are accurate to within 1/TNL_HIST_SUB_BUCKETS of the value.
+ */
+
+#include "ziti_tunnel_priv.h"
+
+static const char *stage_names[] = {
+        [tnl_stage_dial] = "dial",
+        [tnl_stage_handshake] = "handshake",
+        [tnl_stage_ziti_write] = "ziti_write",
+        [tnl_stage_client_ack] = "client_ack",
+};
+
+static model_map service_latency;
+
+static int msb64(uint64_t v) {
+    int msb = 0;
+    for (int shift = 32; shift > 0; shift >>= 1) {
+        if (v >> shift) {
+            v >>= shift;
+            msb += shift;
+        }
+    }
+    return msb;
+}
+
+static int bucket_index(uint64_t usec) {
+    if (usec < TNL_HIST_SUB_BUCKETS) {
+        return (int) usec;
+    }
+    int msb = msb64(usec);
+    int shift = msb - TNL_HIST_SUB_BUCKET_BITS;
+    int idx = (shift + 1) * TNL_HIST_SUB_BUCKETS + (int) ((usec >> shift) & (TNL_HIST_SUB_BUCKETS - 1));
+    return idx < TNL_HIST_BUCKETS ? idx : TNL_HIST_BUCKETS - 1;
+}
+
+/** the largest value that is recorded in bucket `idx` */
+static uint64_t bucket_upper(int idx) {
+    if (idx < TNL_HIST_SUB_BUCKETS) {
+        return (uint64_t) idx;
+    }
+    int shift = idx / TNL_HIST_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t) (idx % TNL_HIST_SUB_BUCKETS) + TNL_HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t percentile(const struct tnl_histogram_s *h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (q * (double) h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < TNL_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t v = bucket_upper(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+struct tnl_service_latency_s *tnl_latency_for_service(const char *service_name) {
+    if (service_name == NULL) {
+        return NULL;
+    }
+    struct tnl_service_latency_s *l = model_map_get(&service_latency, service_name);
+    if (l == NULL) {
+        l = calloc(1, sizeof(struct tnl_service_latency_s));
+        if (l == NULL) {
+            return NULL;
+        }
+        l->refs = 1; // held by the map
+        model_map_set(&service_latency, service_name, l);
+    }
+    return tnl_latency_acquire(l);
+}
+
+struct tnl_service_latency_s *tnl_latency_acquire(struct tnl_service_latency_s *latency) {
+    if (latency != NULL) {
+        latency->refs++;
+    }
+    return latency;
+}
+
+void tnl_latency_release(struct tnl_service_latency_s *latency) {
+    if (latency != NULL && --latency->refs == 0) {
+        free(latency);
+    }
+}
+
+void tnl_latency_remove_service(const char *service_name) {
+    if (service_name == NULL) {
+        return;
+    }
+    tnl_latency_release(model_map_remove(&service_latency, service_name));
+}
+
+void tnl_latency_record(struct tnl_service_latency_s *latency, tnl_latency_stage stage, uint64_t start_ns) {
+    if (latency == NULL || start_ns == 0) {
+        return;
+    }
+    uint64_t now = uv_hrtime();
+    uint64_t usec = now > start_ns ? (now - start_ns) / 1000 : 0;
+    struct tnl_histogram_s *h = &latency->stages[stage];
+    h->count++;
+    h->sum += usec;
+    if (usec > h->max) h->max = usec;
+    h->buckets[bucket_index(usec)]++;
+}
+
+void tnl_latency_get_stats(tunnel_service_latency_array *stats) {
+    if (*stats) {
+        free_tunnel_service_latency_array(stats);
+    }
+    size_t n = model_map_size(&service_latency);
+    *stats = calloc(n + 1, sizeof(tunnel_service_latency *));
+
+    int i = 0;
+    const char *service;
+    struct tnl_service_latency_s *l;
+    MODEL_MAP_FOREACH(service, l, &service_latency) {
+        tunnel_service_latency *s = calloc(1, sizeof(tunnel_service_latency));
+        s->service = strdup(service);
+        s->stages = calloc(tnl_stage_count + 1, sizeof(tunnel_latency_stage *));
+        for (int st = 0; st < tnl_stage_count; st++) {
+            const struct tnl_histogram_s *h = &l->stages[st];
+            tunnel_latency_stage *stage = calloc(1, sizeof(tunnel_latency_stage));
+            stage->stage = strdup(stage_names[st]);
+            stage->count = (model_number) h->count;
+            stage->mean_usec = h->count ? (model_number) (h->sum / h->count) : 0;
+            stage->p50_usec = (model_number) percentile(h, 0.5);
+            stage->p90_usec = (model_number) percentile(h, 0.9);
+            stage->p99_usec = (model_number) percentile(h, 0.99);
+            stage->p999_usec = (model_number) percentile(h, 0.999);
+            stage->max_usec = (model_number) h->max;
+            s->stages[st] = stage;
+        }
+        (*stats)[i++] = s;
+    }
+}
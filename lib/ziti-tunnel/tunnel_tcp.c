@@ -16,6 +16,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include "tunnel_tcp.h"
 #include "lwip_cloned_fns.h"
 #include "ziti_tunnel_priv.h"
@@ -60,13 +61,302 @@ static const char* tcp_state_str(int st) {
     return tcp_labels[st];
 }
 
-/** called by lwip when a client sends a SYN segment to an intercepted address.
- * this only exists to appease lwip */
+/** intercepted connections, indexed by 4-tuple. entries are removed when lwip frees the pcb */
+static struct tnl_flow_table_s tcp_flows;
+static u8_t tcp_flow_arg_id;
+
+static void on_tcp_pcb_destroyed(u8_t id, void *data) {
+    tnl_flow_remove(&tcp_flows, data);
+}
+
+static const struct tcp_ext_arg_callbacks tcp_flow_callbacks = {
+        .destroy = on_tcp_pcb_destroyed,
+};
+
+/**
+ * data from ziti is held in one buffer per write until the client acks all of it. lwip's segments reference
+ * the buffer (tcp_write without TCP_WRITE_FLAG_COPY) instead of copying it into pbufs of their own. ziti-sdk-c
+ * reclaims its own buffer when on_data returns, so the data is copied into the write buffer once.
+ * buffers are released from the tcp_sent callback once the client has acked every segment that references
+ * them, or when lwip frees the pcb.
+ * the netif shim may still hold a batched segment that references a released buffer, so released buffers are
+ * freed by the next output flush, which runs after the shim has written its batch.
+ */
+struct tcp_tx_buf_s {
+    STAILQ_ENTRY(tcp_tx_buf_s) entries;
+    u32_t end; // sequence number that follows the last byte of the buffer
+    char data[];
+};
+STAILQ_HEAD(tcp_tx_queue_s, tcp_tx_buf_s);
+
+static struct tcp_tx_queue_s tx_released = STAILQ_HEAD_INITIALIZER(tx_released);
+static u8_t tcp_tx_arg_id;
+
+static void on_tcp_tx_destroyed(u8_t id, void *data) {
+    struct tcp_tx_queue_s *txq = data;
+    if (txq != NULL) {
+        STAILQ_CONCAT(&tx_released, txq);
+        free(txq);
+    }
+}
+
+static const struct tcp_ext_arg_callbacks tcp_tx_callbacks = {
+        .destroy = on_tcp_tx_destroyed,
+};
+
+/**
+ * release the write buffers of `pcb` that no queued segment references. lwip keeps a partially acked segment
+ * whole, and a segment can span two buffers, so a buffer is released once the oldest queued segment starts
+ * after it rather than when lastack passes its end.
+ */
+static void tx_release_acked(struct tcp_pcb *pcb) {
+    struct tcp_tx_queue_s *txq = tcp_ext_arg_get(pcb, tcp_tx_arg_id);
+    if (txq == NULL) {
+        return;
+    }
+    // a fast retransmit moves a segment from unacked to unsent, so either queue can hold the oldest segment
+    u32_t held = pcb->snd_lbb;
+    if (pcb->unacked != NULL && (s32_t) (lwip_ntohl(pcb->unacked->tcphdr->seqno) - held) < 0) {
+        held = lwip_ntohl(pcb->unacked->tcphdr->seqno);
+    }
+    if (pcb->unsent != NULL && (s32_t) (lwip_ntohl(pcb->unsent->tcphdr->seqno) - held) < 0) {
+        held = lwip_ntohl(pcb->unsent->tcphdr->seqno);
+    }
+    while (!STAILQ_EMPTY(txq)) {
+        struct tcp_tx_buf_s *tx = STAILQ_FIRST(txq);
+        if ((s32_t) (held - tx->end) < 0) {
+            break;
+        }
+        STAILQ_REMOVE_HEAD(txq, entries);
+        STAILQ_INSERT_TAIL(&tx_released, tx, entries);
+    }
+}
+
+static void tx_free_released(void) {
+    while (!STAILQ_EMPTY(&tx_released)) {
+        struct tcp_tx_buf_s *tx = STAILQ_FIRST(&tx_released);
+        STAILQ_REMOVE_HEAD(&tx_released, entries);
+        free(tx);
+    }
+}
+
+/**
+ * pcbs with queued data or window credit are flushed once per loop iteration (tunneler_tcp_flush_output)
+ * instead of after every write or ack, so consecutive writes from ziti are sent as full segments, and the
+ * window updates of several acked writes go out in one ACK. a dirty pcb's ext arg is its index + 1 in
+ * dirty_pcbs, so the entry can be removed when lwip frees the pcb.
+ * the idle handle is active while any pcb is dirty. it keeps the loop from blocking in poll, so output that
+ * is queued from timer or idle callbacks is flushed without waiting for the next i/o event.
+ */
+static struct tcp_pcb **dirty_pcbs;
+static size_t dirty_count;
+static size_t dirty_size;
+static u8_t tcp_dirty_arg_id;
+static uv_idle_t *output_idle;
+
+static void on_output_idle(uv_idle_t *idle) {
+    // nothing to do. the flush happens in the check phase, which follows the (now non-blocking) poll
+}
+
+void tunneler_tcp_set_output_idle(uv_idle_t *idle) {
+    output_idle = idle;
+}
+
+static void on_tcp_dirty_destroyed(u8_t id, void *data) {
+    if (data == NULL) {
+        return;
+    }
+    size_t idx = (uintptr_t) data - 1;
+    struct tcp_pcb *last = dirty_pcbs[--dirty_count];
+    if (idx < dirty_count) {
+        dirty_pcbs[idx] = last;
+        tcp_ext_arg_set(last, tcp_dirty_arg_id, (void *) (uintptr_t) (idx + 1));
+    }
+}
+
+static const struct tcp_ext_arg_callbacks tcp_dirty_callbacks = {
+        .destroy = on_tcp_dirty_destroyed,
+};
+
+/** schedule tcp_output for `pcb`. returns false (and the caller should output now) if the pcb cannot be tracked */
+static bool mark_dirty(struct tcp_pcb *pcb) {
+    if (tcp_ext_arg_get(pcb, tcp_dirty_arg_id) != NULL) {
+        return true;
+    }
+    if (dirty_count == dirty_size) {
+        size_t size = dirty_size ? dirty_size * 2 : 64;
+        struct tcp_pcb **pcbs = realloc(dirty_pcbs, size * sizeof(struct tcp_pcb *));
+        if (pcbs == NULL) {
+            return false;
+        }
+        dirty_pcbs = pcbs;
+        dirty_size = size;
+    }
+    dirty_pcbs[dirty_count++] = pcb;
+    tcp_ext_arg_set(pcb, tcp_dirty_arg_id, (void *) (uintptr_t) dirty_count);
+    if (dirty_count == 1 && output_idle != NULL) {
+        uv_idle_start(output_idle, on_output_idle);
+    }
+    return true;
+}
+
+/** give `credit` bytes back to the client's receive window */
+static void tcp_recved_all(struct tcp_pcb *pcb, u32_t credit) {
+    while (credit > 0) {
+        u16_t n = (u16_t) LWIP_MIN(credit, 0xffff);
+        tcp_recved(pcb, n);
+        credit -= n;
+    }
+}
+
+void tunneler_tcp_flush_output(void) {
+    tx_free_released();
+    while (dirty_count > 0) {
+        struct tcp_pcb *pcb = dirty_pcbs[--dirty_count];
+        tcp_ext_arg_set(pcb, tcp_dirty_arg_id, NULL);
+        if (pcb->state == CLOSED || pcb->state == TIME_WAIT) {
+            continue;
+        }
+        struct io_ctx_s *io = pcb->callback_arg;
+        if (io != NULL && io->tnlr_io != NULL && io->tnlr_io->rwnd.credit > 0) {
+            tcp_recved_all(pcb, io->tnlr_io->rwnd.credit);
+            io->tnlr_io->rwnd.credit = 0;
+        }
+        if (tcp_output(pcb) != ERR_OK) {
+            LOG_STATE(ERR, "failed to tcp_output", pcb);
+        }
+    }
+    if (output_idle != NULL) {
+        uv_idle_stop(output_idle);
+    }
+}
+
+/**
+ * the receive window offered to a client follows ziti's ability to drain the connection. data from the
+ * client is credited back to the window (tcp_recved) when ziti acks the write, so the bytes pending in ziti
+ * never exceed the window. while the client keeps the window full and ziti writes complete without queueing
+ * delay, every acked byte is credited twice and the window doubles per round trip (up to TCP_WND). when
+ * ziti queues (write latency rises TNL_RWND_QUEUE_DELAY_NS above its recent minimum, or ziti_write blocks),
+ * the window is cut to half, but not below the drained rate times the minimum latency, by withholding credit.
+ *
+ * client segments are held in the shim's receive buffers, which every flow shares, until ziti acks them. so
+ * windows grow beyond TNL_RWND_INITIAL only while their summed growth stays under half of what the receive
+ * buffers can hold. when fewer than 1/TNL_RWND_RX_RESERVE of the buffers are free, windows are cut as if
+ * ziti were queueing, so a stalled connection cannot starve the others.
+ */
+#define TNL_RWND_INITIAL (64 * 1024)
+#define TNL_RWND_MIN (2 * TCP_MSS)
+#define TNL_RWND_QUEUE_DELAY_NS (25 * 1000 * 1000ULL)
+#define TNL_RWND_SAMPLE_NS (10 * 1000 * 1000ULL)              // drain rate sample interval, and least time between cuts
+#define TNL_RWND_MIN_DELAY_NS (10 * 1000 * 1000 * 1000ULL)    // how long a minimum write latency is trusted
+#define TNL_RWND_RX_RESERVE 4
+
+/** window growth beyond TNL_RWND_INITIAL, summed over all connections */
+static uint64_t rwnd_grown;
+
+static void rwnd_resize(struct tnl_rwnd_s *r, u32_t size) {
+    rwnd_grown -= r->size > TNL_RWND_INITIAL ? r->size - TNL_RWND_INITIAL : 0;
+    rwnd_grown += size > TNL_RWND_INITIAL ? size - TNL_RWND_INITIAL : 0;
+    r->size = size;
+}
+
+static bool rx_pressure(void) {
+    return netif_shim_rx_headroom() < netif_shim_rx_capacity() / TNL_RWND_RX_RESERVE;
+}
+
+/**
+ * how much more the windows of all connections together may grow. each buffer carries at most an mtu-sized
+ * segment (less than TCP_MSS), so the budget is half of the buffers at that payload
+ */
+static u32_t rwnd_growth_allowed(void) {
+    uint64_t budget = (uint64_t) netif_shim_rx_capacity() / 2 * netif_shim_rx_payload();
+    return rwnd_grown < budget ? (u32_t) (budget - rwnd_grown) : 0;
+}
+
+void tunneler_tcp_free_window(tunneler_io_context tnlr_io) {
+    rwnd_resize(&tnlr_io->rwnd, 0);
+}
+
+/** returns the bytes to credit to the client's window for a write of `acked` bytes that ziti just acked */
+static u32_t rwnd_credit(tunneler_io_context tnlr_io, struct tcp_pcb *pcb, u32_t acked, uint64_t start_ns) {
+    struct tnl_rwnd_s *r = &tnlr_io->rwnd;
+    uint64_t now = uv_hrtime();
+    uint64_t delay = now > start_ns ? now - start_ns : 0;
+    if (r->min_delay_since == 0 || delay < r->min_delay_ns || now - r->min_delay_since > TNL_RWND_MIN_DELAY_NS) {
+        r->min_delay_ns = delay;
+        r->min_delay_since = now;
+    }
+
+    if (r->sample_ns == 0) {
+        r->sample_ns = start_ns;
+    }
+    r->sample_bytes += acked;
+    if (now - r->sample_ns >= TNL_RWND_SAMPLE_NS) {
+        uint64_t rate = r->sample_bytes * 1000000000ULL / (now - r->sample_ns);
+        r->rate = r->rate ? (3 * r->rate + rate) / 4 : rate;
+        r->sample_ns = now;
+        r->sample_bytes = 0;
+    }
+
+    u32_t max = TCP_WND_MAX(pcb);
+    bool queueing = r->blocked || delay > r->min_delay_ns + TNL_RWND_QUEUE_DELAY_NS || rx_pressure();
+    r->blocked = false;
+    if (queueing && r->size > TNL_RWND_MIN && now - r->shrink_ns >= TNL_RWND_SAMPLE_NS) {
+        uint64_t bdp = r->rate * (r->min_delay_ns / 1000) / 1000000;
+        u32_t size = (u32_t) LWIP_MIN(LWIP_MAX(r->size / 2, bdp), r->size);
+        size = LWIP_MAX(size, TNL_RWND_MIN);
+        r->debt += r->size - size;
+        rwnd_resize(r, size);
+        r->shrink_ns = now;
+        TNL_LOG(TRACE, "window cut to %u: client=%s rate=%" PRIu64 " delay=%" PRIu64 "us", size, tnlr_io->client, r->rate, delay / 1000);
+    } else if (!queueing && r->size < max && pcb->rcv_wnd < r->size / 2) {
+        // the client is using the window, so more of it would be used too
+        u32_t grow = LWIP_MIN(LWIP_MIN(acked, max - r->size), rwnd_growth_allowed());
+        if (grow > 0) {
+            u32_t repaid = LWIP_MIN(grow, r->debt);
+            r->debt -= repaid;
+            rwnd_resize(r, r->size + grow);
+            return acked + grow - repaid;
+        }
+    }
+
+    u32_t withheld = LWIP_MIN(acked, r->debt);
+    r->debt -= withheld;
+    return acked - withheld;
+}
+
+/** called by lwip when the client acks our SYN/ACK */
 static err_t on_accept(void *arg, struct tcp_pcb *pcb, err_t err) {
     TNL_LOG(DEBUG, "on_accept: %d", err);
+    struct io_ctx_s *io = arg;
+    if (io != NULL && io->tnlr_io != NULL) {
+        tnl_latency_record(io->tnlr_io->latency, tnl_stage_handshake, io->tnlr_io->synack_ns);
+    }
     return ERR_OK;
 }
 
+/**
+ * free the pcb that has been in TIME_WAIT the longest. the connection limit counts TIME_WAIT pcbs, and lwip
+ * only recycles them (tcp_kill_timewait) when a pcb allocation fails, which never happens with malloc'd pools.
+ * returns false if no pcb is in TIME_WAIT.
+ */
+static bool kill_oldest_timewait(void) {
+    struct tcp_pcb *oldest = NULL;
+    u32_t oldest_age = 0;
+    for (struct tcp_pcb *pcb = tcp_tw_pcbs; pcb != NULL; pcb = pcb->next) {
+        if (oldest == NULL || (u32_t) (tcp_ticks - pcb->tmr) >= oldest_age) {
+            oldest = pcb;
+            oldest_age = tcp_ticks - pcb->tmr;
+        }
+    }
+    if (oldest == NULL) {
+        return false;
+    }
+    LOG_STATE(DEBUG, "recycling TIME_WAIT pcb", oldest);
+    tcp_abort(oldest);
+    return true;
+}
+
 /** create a tcp connection to be managed by lwip */
 static struct tcp_pcb *new_tcp_pcb(ip_addr_t src, ip_addr_t dest, struct tcp_hdr *tcphdr, struct pbuf *p) {
     /** associate all injected PCBs with the same phony listener to appease some LWIP checks */
@@ -76,7 +366,12 @@ static struct tcp_pcb *new_tcp_pcb(ip_addr_t src, ip_addr_t dest, struct tcp_hdr
             TNL_LOG(ERR, "failed to allocate listener");
             return NULL;
         }
+        // memp pools are plain malloc, so ext_args would otherwise hold garbage callbacks
+        memset(phony_listener, 0, sizeof(*phony_listener));
         phony_listener->accept = on_accept;
+        tcp_flow_arg_id = tcp_ext_arg_alloc_id();
+        tcp_dirty_arg_id = tcp_ext_arg_alloc_id();
+        tcp_tx_arg_id = tcp_ext_arg_alloc_id();
     }
     struct tcp_pcb *npcb = tcp_new();
     if (npcb == NULL) {
@@ -107,6 +402,8 @@ static struct tcp_pcb *new_tcp_pcb(ip_addr_t src, ip_addr_t dest, struct tcp_hdr
     /* Parse any options in the SYN. */
     tunneler_tcp_input(p);
     tunneler_tcp_parseopt(npcb);
+    // the window starts small, and grows as ziti drains the connection
+    npcb->rcv_wnd = npcb->rcv_ann_wnd = LWIP_MIN(TNL_RWND_INITIAL, TCP_WND_MAX(npcb));
     npcb->snd_wnd = lwip_ntohs(tcphdr->wnd);
     npcb->snd_wnd_max = npcb->snd_wnd;
 
@@ -117,48 +414,66 @@ static struct tcp_pcb *new_tcp_pcb(ip_addr_t src, ip_addr_t dest, struct tcp_hdr
 
     MIB2_STATS_INC(mib2.tcppassiveopens);
 
-#if LWIP_TCP_PCB_NUM_EXT_ARGS
-    if (tcp_ext_arg_invoke_callbacks_passive_open(pcb, npcb) != ERR_OK) {
+    if (tcp_ext_arg_invoke_callbacks_passive_open(phony_listener, npcb) != ERR_OK) {
       tcp_abandon(npcb, 0);
       return NULL;
     }
-#endif
+
+    struct tnl_flow_s *flow = tnl_flow_insert(&tcp_flows, &npcb->local_ip, npcb->local_port,
+                                              &npcb->remote_ip, npcb->remote_port, npcb);
+    if (flow == NULL) {
+        TNL_LOG(ERR, "failed to allocate flow table entry");
+        tcp_abandon(npcb, 0);
+        return NULL;
+    }
+    tcp_ext_arg_set_callbacks(npcb, tcp_flow_arg_id, &tcp_flow_callbacks);
+    tcp_ext_arg_set(npcb, tcp_flow_arg_id, flow);
+    tcp_ext_arg_set_callbacks(npcb, tcp_dirty_arg_id, &tcp_dirty_callbacks);
+    tcp_ext_arg_set_callbacks(npcb, tcp_tx_arg_id, &tcp_tx_callbacks);
     return npcb;
 }
 
 /**
- * called by lwip when a client writes to an intercepted connection.
- * pbuf will be null if client has closed the connection.
+ * hand one chain of client data to ziti. returns ERR_OK if ziti took the data, ERR_WOULDBLOCK or ERR_MEM if
+ * it could not (`p` is left with the caller), or ERR_ABRT if the connection was aborted (`p` is released).
  */
-static err_t on_tcp_client_data(void *io_ctx, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
-    if (io_ctx == NULL) {
-        TNL_LOG(INFO, "conn was closed err=%d", err);
-        if (p != NULL) {
-            pbuf_free(p);
+static err_t write_client_data(struct io_ctx_s *io, struct tcp_pcb *pcb, struct pbuf *p) {
+    // segments are forwarded without coalescing if the app can write them as a vector
+    uv_buf_t bufs[TNL_WRITEV_MAX];
+    int nbufs = 0;
+    if (io->writev_fn != NULL && p->next != NULL && pbuf_clen(p) <= TNL_WRITEV_MAX) {
+        for (struct pbuf *q = p; q != NULL; q = q->next) {
+            if (q->len > 0) {
+                bufs[nbufs++] = uv_buf_init(q->payload, q->len);
+            }
         }
-        return ERR_CONN;
     }
-    LOG_STATE(VERBOSE, "status %d", pcb, err);
-    struct io_ctx_s *io = (struct io_ctx_s *)io_ctx;
 
-    if (err == ERR_OK && p == NULL) {
-        TNL_LOG(DEBUG, "client sent FIN: client=%s, service=%s", io->tnlr_io->client, io->tnlr_io->service_name);
-        LOG_STATE(DEBUG, "FIN received", pcb);
-        io->close_write_fn(io->ziti_io);
-        return err;
+    // otherwise multiple segments are copied to one pbuf. `p` is left intact, since it is kept if the write is refused
+    struct pbuf *wr_p = p;
+    if (nbufs == 0 && p->next != NULL) {
+        if ((wr_p = pbuf_clone(PBUF_RAW, PBUF_RAM, p)) == NULL) {
+            TNL_LOG(WARN, "failed to coalesce %d bytes: client=%s, service=%s", p->tot_len, io->tnlr_io->client, io->tnlr_io->service_name);
+            return ERR_MEM;
+        }
     }
 
-    p = pbuf_coalesce(p, PBUF_RAW);
-    u16_t len = p->len;
     struct write_ctx_s *wr_ctx = calloc(1, sizeof(struct write_ctx_s));
-    wr_ctx->pbuf = p;
+    wr_ctx->pbuf = wr_p;
     wr_ctx->tcp = pcb;
     wr_ctx->ack = tunneler_tcp_ack;
-    ssize_t s = io->write_fn(io->ziti_io, wr_ctx, p->payload, len);
+    wr_ctx->latency = tnl_latency_acquire(io->tnlr_io->latency);
+    // time spent waiting out backpressure counts towards the write
+    wr_ctx->start_ns = io->tnlr_io->blocked_ns ? io->tnlr_io->blocked_ns : uv_hrtime();
+    ssize_t s = nbufs > 0 ? io->writev_fn(io->ziti_io, wr_ctx, bufs, nbufs)
+                          : io->write_fn(io->ziti_io, wr_ctx, wr_p->payload, wr_p->len);
     if (s == ERR_WOULDBLOCK) {
-        // apply backpressure -- let LWIP keep the data and retry later
         TNL_LOG(VERBOSE, "ziti_write indicated backpressure: service=%s, client=%s", io->tnlr_io->service_name, io->tnlr_io->client);
+        io->tnlr_io->blocked_ns = wr_ctx->start_ns;
+        io->tnlr_io->rwnd.blocked = true;
+        tnl_latency_release(wr_ctx->latency);
         free(wr_ctx);
+        if (wr_p != p) pbuf_free(wr_p);
         return ERR_WOULDBLOCK;
     } else if (s < 0) {
         TNL_LOG(ERR, "ziti_write failed: service=%s, client=%s, ret=%ld", io->tnlr_io->service_name, io->tnlr_io->client, s);
@@ -166,9 +481,141 @@ static err_t on_tcp_client_data(void *io_ctx, struct tcp_pcb *pcb, struct pbuf *
         tcp_abort(io->tnlr_io->tcp);
         io->tnlr_io->tcp = NULL;
         io->close_fn(io->ziti_io);
+        tnl_latency_release(wr_ctx->latency);
         free(wr_ctx);
+        if (wr_p != p) pbuf_free(wr_p);
         pbuf_free(p);
         return ERR_ABRT;
+    } else if (s > 0) {
+        // writev_fn queued part of the chain before failing. the queued part still references `p`, which is
+        // released by tunneler_tcp_ack once it completes, after the pcb is gone
+        TNL_LOG(ERR, "ziti_write failed after %zd of %d bytes: service=%s, client=%s", s, p->tot_len, io->tnlr_io->service_name, io->tnlr_io->client);
+        wr_ctx->tcp = NULL;
+        tcp_abort(io->tnlr_io->tcp);
+        io->tnlr_io->tcp = NULL;
+        io->close_fn(io->ziti_io);
+        return ERR_ABRT;
+    }
+    // the copy (or the chain itself) is released by tunneler_tcp_ack
+    if (wr_p != p) pbuf_free(p);
+    if (io->tnlr_io->blocked_ns != 0) {
+        io->tnlr_io->blocked_total_ns += uv_hrtime() - io->tnlr_io->blocked_ns;
+        io->tnlr_io->blocked_ns = 0;
+    }
+    return ERR_OK;
+}
+
+/**
+ * write client data that ziti refused earlier, in order, until ziti refuses again.
+ * returns ERR_ABRT if the connection was aborted.
+ */
+static err_t flush_pending(struct io_ctx_s *io, struct tcp_pcb *pcb) {
+    tunneler_io_context tnlr_io = io->tnlr_io;
+    while (!STAILQ_EMPTY(&tnlr_io->pending)) {
+        struct tnl_pending_s *pending = STAILQ_FIRST(&tnlr_io->pending);
+        STAILQ_REMOVE_HEAD(&tnlr_io->pending, entries);
+        err_t err = write_client_data(io, pcb, pending->p);
+        if (err == ERR_WOULDBLOCK || err == ERR_MEM) {
+            STAILQ_INSERT_HEAD(&tnlr_io->pending, pending, entries);
+            return ERR_OK;
+        }
+        free(pending);
+        if (err == ERR_ABRT) {
+            return err;
+        }
+    }
+    if (tnlr_io->pending_fin) {
+        tnlr_io->pending_fin = false;
+        LOG_STATE(DEBUG, "FIN received", pcb);
+        io->close_write_fn(io->ziti_io);
+    }
+    return ERR_OK;
+}
+
+/**
+ * called by lwip when a client writes to an intercepted connection.
+ * pbuf will be null if client has closed the connection.
+ *
+ * data that ziti refuses is kept on the connection's pending queue (rather than returned to lwip, which
+ * would only offer it again on the next segment or timer tick) and written as soon as ziti drains.
+ * the client's window is not credited until the data is written, so the queue is bounded by the window.
+ */
+static err_t on_tcp_client_data(void *io_ctx, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+    if (io_ctx == NULL) {
+        TNL_LOG(INFO, "conn was closed err=%d", err);
+        if (p != NULL) {
+            pbuf_free(p);
+        }
+        return ERR_CONN;
+    }
+    LOG_STATE(VERBOSE, "status %d", pcb, err);
+    struct io_ctx_s *io = (struct io_ctx_s *)io_ctx;
+    tunneler_io_context tnlr_io = io->tnlr_io;
+
+    if (err == ERR_OK && p == NULL) {
+        TNL_LOG(DEBUG, "client sent FIN: client=%s, service=%s", tnlr_io->client, tnlr_io->service_name);
+        if (!STAILQ_EMPTY(&tnlr_io->pending)) {
+            // ziti gets the FIN after the pending data
+            tnlr_io->pending_fin = true;
+            return ERR_OK;
+        }
+        LOG_STATE(DEBUG, "FIN received", pcb);
+        io->close_write_fn(io->ziti_io);
+        return err;
+    }
+
+    if (STAILQ_EMPTY(&tnlr_io->pending)) {
+        err_t s = write_client_data(io, pcb, p);
+        if (s != ERR_WOULDBLOCK) {
+            // on ERR_MEM lwip keeps the data and offers it again
+            return s;
+        }
+    }
+
+    struct tnl_pending_s *pending = malloc(sizeof(struct tnl_pending_s));
+    if (pending == NULL) {
+        return ERR_MEM;
+    }
+    pending->p = p;
+    STAILQ_INSERT_TAIL(&tnlr_io->pending, pending, entries);
+    return ERR_OK;
+}
+
+/** called by lwip periodically. retries pending data in case ziti refused it for lack of memory */
+static err_t on_tcp_client_poll(void *io_ctx, struct tcp_pcb *pcb) {
+    struct io_ctx_s *io = io_ctx;
+    if (io == NULL || io->tnlr_io == NULL || STAILQ_EMPTY(&io->tnlr_io->pending)) {
+        return ERR_OK;
+    }
+    return flush_pending(io, pcb);
+}
+
+void tunneler_tcp_resume_writes(struct io_ctx_s *io) {
+    if (io->tnlr_io->tcp == NULL || STAILQ_EMPTY(&io->tnlr_io->pending)) {
+        return;
+    }
+    flush_pending(io, io->tnlr_io->tcp);
+}
+
+/** called by lwip when the client acks data that we sent */
+static err_t on_tcp_client_sent(void *io_ctx, struct tcp_pcb *pcb, u16_t len) {
+    // lwip has freed the acked segments. this is done even when the io context is gone, since a pcb that
+    // was closed by ziti keeps sending its queued data
+    tx_release_acked(pcb);
+
+    struct io_ctx_s *io = io_ctx;
+    if (io == NULL || io->tnlr_io == NULL) {
+        return ERR_OK;
+    }
+    tunneler_io_context tnlr_io = io->tnlr_io;
+    while (tnlr_io->unacked_count > 0) {
+        uint8_t i = tnlr_io->unacked_head;
+        if ((s32_t) (pcb->lastack - tnlr_io->unacked[i].seq) < 0) {
+            break;
+        }
+        tnl_latency_record(tnlr_io->latency, tnl_stage_client_ack, tnlr_io->unacked[i].ns);
+        tnlr_io->unacked_head = (i + 1) % TNL_LATENCY_UNACKED;
+        tnlr_io->unacked_count--;
     }
     return ERR_OK;
 }
@@ -203,18 +650,55 @@ ssize_t tunneler_tcp_write(struct tcp_pcb *pcb, const void *data, size_t len) {
     if (qlen > TCP_SND_QUEUELEN) {
         TNL_LOG(WARN, "sndqueuelen limit reached (%d > %d)", qlen, TCP_SND_QUEUELEN);
     }
+    if (!tunneler_pool_available(MEMP_TCP_SEG)) {
+        // the caller will retry
+        TNL_LOG(VERBOSE, "tcp segment limit reached");
+        return 0;
+    }
     // avoid ERR_MEM.
     size_t sendlen = MIN(len, tcp_sndbuf(pcb));
     LOG_STATE(TRACE, "sendlen=%zd", pcb, sendlen);
     if (sendlen > 0) {
-        err_t w_err = tcp_write(pcb, data, (u16_t) sendlen,
-                                TCP_WRITE_FLAG_COPY); // TODO hold data until client acks... via on_client_ack maybe? then we wouldn't need to copy here.
-        if (w_err != ERR_OK) {
+        struct tcp_tx_queue_s *txq = tcp_ext_arg_get(pcb, tcp_tx_arg_id);
+        if (txq == NULL) {
+            if ((txq = malloc(sizeof(struct tcp_tx_queue_s))) == NULL) {
+                TNL_LOG(ERR, "failed to allocate write queue");
+                return -1;
+            }
+            STAILQ_INIT(txq);
+            tcp_ext_arg_set(pcb, tcp_tx_arg_id, txq);
+        }
+        struct tcp_tx_buf_s *tx = malloc(sizeof(struct tcp_tx_buf_s) + sendlen);
+        if (tx == NULL) {
+            TNL_LOG(ERR, "failed to allocate %zd byte write buffer", sendlen);
+            return -1;
+        }
+        memcpy(tx->data, data, sendlen);
+
+        err_t w_err = tcp_write(pcb, tx->data, (u16_t) sendlen, 0);
+        if (w_err == ERR_MEM) {
+            // out of segments or queue space. lwip did not keep a reference, and the caller will retry
+            TNL_LOG(VERBOSE, "tcp_write would block (%zd bytes)", len);
+            free(tx);
+            return 0;
+        } else if (w_err != ERR_OK) {
             TNL_LOG(ERR, "failed to tcp_write %d (%ld, %zd)", w_err, sendlen, len);
+            free(tx);
             return -1;
         }
+        tx->end = pcb->snd_lbb;
+        STAILQ_INSERT_TAIL(txq, tx, entries);
 
-        if (tcp_output(pcb) != ERR_OK) {
+        struct io_ctx_s *io = pcb->callback_arg;
+        if (io != NULL && io->tnlr_io != NULL && io->tnlr_io->unacked_count < TNL_LATENCY_UNACKED) {
+            tunneler_io_context tnlr_io = io->tnlr_io;
+            uint8_t i = (tnlr_io->unacked_head + tnlr_io->unacked_count) % TNL_LATENCY_UNACKED;
+            tnlr_io->unacked[i].seq = pcb->snd_lbb;
+            tnlr_io->unacked[i].ns = uv_hrtime();
+            tnlr_io->unacked_count++;
+        }
+
+        if (!mark_dirty(pcb) && tcp_output(pcb) != ERR_OK) {
             TNL_LOG(ERR, "failed to tcp_output");
             return -1;
         }
@@ -224,7 +708,24 @@ ssize_t tunneler_tcp_write(struct tcp_pcb *pcb, const void *data, size_t len) {
 
 void tunneler_tcp_ack(struct write_ctx_s *write_ctx) {
     struct write_ctx_s *wr_ctx = write_ctx;
-    tcp_recved(wr_ctx->tcp, wr_ctx->pbuf->len);
+    if (wr_ctx->tcp == NULL) { // the connection was aborted while the write was in flight
+        pbuf_free(wr_ctx->pbuf);
+        return;
+    }
+    struct io_ctx_s *io = wr_ctx->tcp->callback_arg;
+    u32_t credit = wr_ctx->pbuf->tot_len;
+    if (io != NULL && io->tnlr_io != NULL) {
+        credit = rwnd_credit(io->tnlr_io, wr_ctx->tcp, credit, wr_ctx->start_ns);
+        // window updates are sent with the next output flush
+        io->tnlr_io->rwnd.credit += credit;
+        if (mark_dirty(wr_ctx->tcp)) {
+            credit = 0;
+        } else {
+            credit = io->tnlr_io->rwnd.credit;
+            io->tnlr_io->rwnd.credit = 0;
+        }
+    }
+    tcp_recved_all(wr_ctx->tcp, credit);
     pbuf_free(wr_ctx->pbuf);
 }
 
@@ -287,8 +788,11 @@ void tunneler_tcp_dial_completed(struct io_ctx_s *io, bool ok) {
         TNL_LOG(VERBOSE, "ziti dial failed. not sending SYN to client.");
         return;
     }
+    tnl_latency_record(io->tnlr_io->latency, tnl_stage_dial, io->tnlr_io->dial_ns);
     ip_set_option(pcb, SOF_KEEPALIVE);
     tcp_recv(pcb, on_tcp_client_data);
+    tcp_sent(pcb, on_tcp_client_sent);
+    tcp_poll(pcb, on_tcp_client_poll, 1);
 
     /* Send a SYN|ACK together with the MSS option. */
     err_t rc = tcp_enqueue_flags(pcb, TCP_SYN | TCP_ACK);
@@ -297,6 +801,7 @@ void tunneler_tcp_dial_completed(struct io_ctx_s *io, bool ok) {
         return;
     }
 
+    io->tnlr_io->synack_ns = uv_hrtime();
     tcp_output(io->tnlr_io->tcp);
 }
 
@@ -312,6 +817,10 @@ static tunneler_io_context new_tunneler_io_context(tunneler_context tnlr_ctx, co
     snprintf(ctx->intercepted, sizeof(ctx->intercepted), "tcp:%s:%d", dst, pcb->local_port);
     ctx->proto = tun_tcp;
     ctx->tcp = pcb;
+    ctx->latency = tnl_latency_for_service(service_name);
+    ctx->dial_ns = uv_hrtime();
+    ctx->rwnd.size = pcb->rcv_wnd;
+    STAILQ_INIT(&ctx->pending);
     return ctx;
 }
 
@@ -384,36 +893,23 @@ u8_t recv_tcp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, const ip_
         return 0;
     }
 
-    /* pass the segment to lwip if a matching active connection exists */
-    for (struct tcp_pcb *tpcb = tcp_active_pcbs, *prev = NULL; tpcb != NULL; tpcb = tpcb->next) {
-        if (tpcb->remote_port == src_p &&
-            tpcb->local_port == dst_p &&
-            ip_addr_cmp(&tpcb->remote_ip, &src) &&
-            ip_addr_cmp(&tpcb->local_ip, &dst)) {
-            TNL_LOG(VERBOSE, "received SYN on active connection: client=tcp:%s:%d, service=%s", src_str, src_p, intercept_ctx->service_name);
-            /* Move this PCB to the front of the list so that subsequent
-               lookups will be faster (we exploit locality in TCP segment
-               arrivals). */
-            LWIP_ASSERT("tcp_input: pcb->next != pcb (before cache)", tpcb->next != tpcb);
-            if (prev != NULL) {
-                prev->next = tpcb->next;
-                tpcb->next = tcp_active_pcbs;
-                tcp_active_pcbs = tpcb;
-            } else {
-                TCP_STATS_INC(tcp.cachehit);
-            }
-            LWIP_ASSERT("tcp_input: pcb->next != pcb (after cache)", tpcb->next != tpcb);
-            return 0;
-        }
-        prev = tpcb;
+    /* pass the segment to lwip if a matching active connection exists. pcbs in TIME_WAIT are not active */
+    struct tnl_flow_s *flow = tnl_flow_find(&tcp_flows, &dst, dst_p, &src, src_p);
+    if (flow != NULL && ((struct tcp_pcb *) flow->pcb)->state != TIME_WAIT) {
+        TNL_LOG(VERBOSE, "received SYN on active connection: client=tcp:%s:%d, service=%s", src_str, src_p, intercept_ctx->service_name);
+        return 0;
     }
 
     /* we know this is a SYN segment for an intercepted address, and we will process it */
     ziti_sdk_dial_cb zdial = intercept_ctx->dial_fn ? intercept_ctx->dial_fn : tnlr_ctx->opts.ziti_dial;
     pbuf_remove_header(p, iphdr_hlen);
+    if (!tunneler_pool_available(MEMP_TCP_PCB) && !kill_oldest_timewait()) {
+        TNL_LOG(ERR, "TCP connection limit reached. dropping SYN from tcp:%s:%d, service=%s", src_str, src_p, intercept_ctx->service_name);
+        goto done;
+    }
     struct tcp_pcb *npcb = new_tcp_pcb(src, dst, tcphdr, p);
     if (npcb == NULL) {
-        TNL_LOG(ERR, "failed to allocate tcp pcb - TCP connection limit is %d", MEMP_NUM_TCP_PCB);
+        TNL_LOG(ERR, "failed to allocate tcp pcb");
         goto done;
     }
 
@@ -429,6 +925,8 @@ u8_t recv_tcp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, const ip_
     }
     io->ziti_ctx = intercept_ctx->app_intercept_ctx;
     io->write_fn = intercept_ctx->write_fn ? intercept_ctx->write_fn : tnlr_ctx->opts.ziti_write;
+    // an intercept that overrides the write callback gets contiguous data
+    io->writev_fn = intercept_ctx->write_fn ? NULL : tnlr_ctx->opts.ziti_writev;
     io->close_write_fn = intercept_ctx->close_write_fn ? intercept_ctx->close_write_fn : tnlr_ctx->opts.ziti_close_write;
     io->close_fn = intercept_ctx->close_fn ? intercept_ctx->close_fn : tnlr_ctx->opts.ziti_close;
 
@@ -486,4 +984,9 @@ void tunneler_tcp_get_conn(tunnel_ip_conn *conn, struct tcp_pcb *pcb) {
         service = io->tnlr_io->service_name;
     }
     conn->service = strdup(service);
+    if (io && io->tnlr_io) {
+        uint64_t blocked_ns = io->tnlr_io->blocked_total_ns;
+        if (io->tnlr_io->blocked_ns) blocked_ns += uv_hrtime() - io->tnlr_io->blocked_ns;
+        conn->blocked_ms = (model_number) (blocked_ns / 1000000);
+    }
 }
@@ -31,6 +31,16 @@ extern u8_t recv_tcp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, co
 
 extern void tunneler_tcp_ack(struct write_ctx_s *write_ctx);
 
+/** send the data and window updates that were queued on tcp connections since the last flush */
+extern void tunneler_tcp_flush_output(void);
+/** release the connection's share of the receive window budget */
+extern void tunneler_tcp_free_window(tunneler_io_context tnlr_io);
+/** `idle` is started while output is queued, so the loop does not block before the next flush */
+extern void tunneler_tcp_set_output_idle(uv_idle_t *idle);
+
+/** write client data that ziti refused earlier */
+extern void tunneler_tcp_resume_writes(struct io_ctx_s *io);
+
 extern int tunneler_tcp_close(struct tcp_pcb *pcb);
 
 extern int tunneler_tcp_close_write(struct tcp_pcb *pcb);
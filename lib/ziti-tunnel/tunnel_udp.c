@@ -15,14 +15,116 @@
  */
 
 #include <string.h>
+#include <inttypes.h>
 
 #include "tunnel_udp.h"
 #include "ziti_tunnel_priv.h"
 
 #define UDP_TIMEOUT 30000
+#define UDP_QUEUE_BYTES (64 * 1024)
+
+/** flows that have been idle for less than this are never reclaimed to make room for new ones */
+#define UDP_RECLAIM_MIN_IDLE 1000
+
+/** intercepted connections, indexed by 4-tuple */
+static struct tnl_flow_table_s udp_flows;
+
+/** intercepted connections, least recently active first */
+static TAILQ_HEAD(udp_lru_s, tunneler_io_ctx_s) udp_lru = TAILQ_HEAD_INITIALIZER(udp_lru);
+
+/** flow counts of a service. an entry is removed once the service is no longer intercepted and its last flow is gone */
+struct tnl_udp_service_s {
+    size_t flows;
+    uint64_t reclaimed; // idle flows that were closed to make room for a new flow
+    uint64_t refused;   // new flows that were dropped at a limit
+    bool retired;       // the service is no longer intercepted
+};
+static model_map udp_services;
+static int udp_service_limit; // 0 = no limit
+
+void tunneler_udp_set_service_limit(int limit) {
+    udp_service_limit = limit > 0 ? limit : 0;
+}
+
+static struct tnl_udp_service_s *udp_service(const char *service_name) {
+    struct tnl_udp_service_s *svc = model_map_get(&udp_services, service_name);
+    if (svc == NULL) {
+        svc = calloc(1, sizeof(struct tnl_udp_service_s));
+        if (svc == NULL) {
+            return NULL;
+        }
+        model_map_set(&udp_services, service_name, svc);
+    }
+    svc->retired = false;
+    return svc;
+}
+
+void tunneler_udp_remove_service(const char *service_name) {
+    struct tnl_udp_service_s *svc = model_map_get(&udp_services, service_name);
+    if (svc == NULL) {
+        return;
+    }
+    if (svc->flows == 0) {
+        model_map_remove(&udp_services, service_name);
+        free(svc);
+    } else {
+        svc->retired = true;
+    }
+}
+
+/** unregister a pcb from lwip, the flow table, and the flow counts */
+static void remove_udp_pcb(struct udp_pcb *pcb) {
+    struct tnl_flow_s *flow = tnl_flow_find(&udp_flows, &pcb->local_ip, pcb->local_port, &pcb->remote_ip, pcb->remote_port);
+    if (flow != NULL && flow->pcb == pcb) {
+        tnl_flow_remove(&udp_flows, flow);
+    }
+    struct io_ctx_s *io = pcb->recv_arg;
+    if (io != NULL && io->tnlr_io != NULL && io->tnlr_io->udp_service != NULL) {
+        TAILQ_REMOVE(&udp_lru, io->tnlr_io, udp_lru);
+        struct tnl_udp_service_s *svc = io->tnlr_io->udp_service;
+        io->tnlr_io->udp_service = NULL;
+        if (--svc->flows == 0 && svc->retired) {
+            model_map_remove(&udp_services, io->tnlr_io->service_name);
+            free(svc);
+        }
+    }
+    udp_remove(pcb);
+}
+
+/**
+ * close the least recently active flow (of `svc`, or of any service if `svc` is NULL) if it has been idle for at
+ * least UDP_RECLAIM_MIN_IDLE. its pcb is released immediately; the ziti side is closed as if it had timed out.
+ * returns false if there is no such flow.
+ */
+static bool reclaim_idle_flow(uv_loop_t *loop, struct tnl_udp_service_s *svc) {
+    uint64_t now = uv_now(loop);
+    tunneler_io_context tnlr_io;
+    TAILQ_FOREACH(tnlr_io, &udp_lru, udp_lru) {
+        if (now - tnlr_io->last_active < UDP_RECLAIM_MIN_IDLE) {
+            return false; // the rest are more recent
+        }
+        if (svc == NULL || tnlr_io->udp_service == svc) {
+            break;
+        }
+    }
+    if (tnlr_io == NULL) {
+        return false;
+    }
+
+    struct udp_pcb *pcb = tnlr_io->udp;
+    struct io_ctx_s *io = pcb->recv_arg;
+    TNL_LOG(DEBUG, "reclaiming flow idle for %" PRIu64 "ms: client[%s] service[%s]", now - tnlr_io->last_active,
+            tnlr_io->client, tnlr_io->service_name);
+    tnlr_io->udp_service->reclaimed++;
+    tnl_timer_cancel(&tnlr_io->idle_timer);
+    remove_udp_pcb(pcb);
+    tnlr_io->udp = NULL;
+    io->close_fn(io->ziti_io);
+    return true;
+}
 
 // initiate orderly shutdown
-static void udp_timeout_cb(uv_timer_t *t) {
+static void udp_timeout_cb(struct tnl_timer_s *t) {
     struct io_ctx_s *io = t->data;
     tunneler_io_context  tnlr_io = io->tnlr_io;
     if (tnlr_io) {
@@ -32,8 +134,130 @@ static void udp_timeout_cb(uv_timer_t *t) {
     io->close_fn(io->ziti_io);
 }
 
+/** push the idle timeout of a connection out. this is a deadline update unless the timer is not scheduled yet */
+static void refresh_idle_timer(struct io_ctx_s *io) {
+    tunneler_io_context tnlr_io = io->tnlr_io;
+    tnlr_io->last_active = uv_now(tnlr_io->tnlr_ctx->loop);
+    if (tnlr_io->udp_service != NULL && TAILQ_NEXT(tnlr_io, udp_lru) != NULL) {
+        TAILQ_REMOVE(&udp_lru, tnlr_io, udp_lru);
+        TAILQ_INSERT_TAIL(&udp_lru, tnlr_io, udp_lru);
+    }
+    if (tnlr_io->idle_timeout > 0) {
+        tnl_timer_schedule(tnlr_io->tnlr_ctx->loop, &tnlr_io->idle_timer, tnlr_io->idle_timeout, udp_timeout_cb, io);
+    }
+}
+
+/**
+ * write one datagram to ziti. returns ERR_OK if ziti took it, ERR_WOULDBLOCK if ziti applied backpressure
+ * (`p` is left with the caller), or another error if the write failed (`p` is freed).
+ */
+static err_t write_datagram(struct io_ctx_s *io, struct pbuf *p) {
+    TNL_LOG(TRACE, "writing %d bytes to ziti src[%s] dst[%s] service[%s]", p->len,
+            io->tnlr_io->client, io->tnlr_io->intercepted, io->tnlr_io->service_name);
+    struct write_ctx_s *wr_ctx = calloc(1, sizeof(struct write_ctx_s));
+    wr_ctx->pbuf = p;
+    wr_ctx->udp = io->tnlr_io->udp;
+    wr_ctx->ack = tunneler_udp_ack;
+    wr_ctx->latency = tnl_latency_acquire(io->tnlr_io->latency);
+    wr_ctx->start_ns = uv_hrtime();
+
+    ssize_t s = io->write_fn(io->ziti_io, wr_ctx, p->payload, p->len);
+    if (s == ERR_WOULDBLOCK) {
+        tnl_latency_release(wr_ctx->latency);
+        free(wr_ctx);
+        return ERR_WOULDBLOCK;
+    } else if (s < 0) {
+        tunneler_udp_ack(wr_ctx);
+        tnl_latency_release(wr_ctx->latency);
+        free(wr_ctx);
+        TNL_LOG(ERR, "ziti_write failed: service=%s, client=%s, ret=%ld", io->tnlr_io->service_name, io->tnlr_io->client, s);
+        return ERR_CONN;
+    }
+    return ERR_OK;
+}
+
+/** drop a datagram that does not fit in the send queue */
+static void drop_datagram(tunneler_io_context tnlr_io, struct pbuf *p) {
+    if (!tnlr_io->dropping) {
+        TNL_LOG(WARN, "ziti_write stalled: dropping UDP datagrams until buffers are released service=%s, client=%s",
+                tnlr_io->service_name, tnlr_io->client);
+        tnlr_io->dropping = true;
+    }
+    tnlr_io->dropped++;
+    pbuf_free(p);
+}
+
+/** memory that a queued datagram is charged for */
+#define PENDING_SIZE(p) ((p)->len + sizeof(struct pbuf) + sizeof(struct tnl_pending_s))
+
+/**
+ * queue a datagram behind the ones that ziti refused, making room according to the drop policy.
+ * the datagram is copied to a pbuf of its own size, so queued datagrams do not hold the receive buffers
+ * (shared by all flows) that they were read into.
+ */
+static void enqueue_datagram(struct io_ctx_s *io, struct pbuf *p) {
+    tunneler_io_context tnlr_io = io->tnlr_io;
+    const tunneler_sdk_options *opts = &tnlr_io->tnlr_ctx->opts;
+    size_t max = opts->udp_queue_bytes > 0 ? (size_t) opts->udp_queue_bytes : UDP_QUEUE_BYTES;
+
+    if (opts->udp_drop_policy == UDP_DROP_HEAD) {
+        while (tnlr_io->pending_bytes + PENDING_SIZE(p) > max && !STAILQ_EMPTY(&tnlr_io->pending)) {
+            struct tnl_pending_s *oldest = STAILQ_FIRST(&tnlr_io->pending);
+            STAILQ_REMOVE_HEAD(&tnlr_io->pending, entries);
+            tnlr_io->pending_bytes -= PENDING_SIZE(oldest->p);
+            drop_datagram(tnlr_io, oldest->p);
+            free(oldest);
+        }
+    }
+    if (tnlr_io->pending_bytes + PENDING_SIZE(p) > max) {
+        drop_datagram(tnlr_io, p);
+        return;
+    }
+    struct pbuf *q = pbuf_alloc(PBUF_RAW, p->len, PBUF_RAM);
+    struct tnl_pending_s *pending = malloc(sizeof(struct tnl_pending_s));
+    if (q == NULL || pending == NULL) {
+        if (q != NULL) pbuf_free(q);
+        free(pending);
+        drop_datagram(tnlr_io, p);
+        return;
+    }
+    memcpy(q->payload, p->payload, p->len);
+    pbuf_free(p);
+    pending->p = q;
+    STAILQ_INSERT_TAIL(&tnlr_io->pending, pending, entries);
+    tnlr_io->pending_bytes += PENDING_SIZE(q);
+}
+
+/** write queued datagrams, in order, until ziti refuses again */
+static void flush_datagrams(struct io_ctx_s *io) {
+    tunneler_io_context tnlr_io = io->tnlr_io;
+    while (!STAILQ_EMPTY(&tnlr_io->pending)) {
+        struct tnl_pending_s *pending = STAILQ_FIRST(&tnlr_io->pending);
+        err_t err = write_datagram(io, pending->p);
+        if (err == ERR_WOULDBLOCK) {
+            return;
+        }
+        STAILQ_REMOVE_HEAD(&tnlr_io->pending, entries);
+        tnlr_io->pending_bytes -= PENDING_SIZE(pending->p);
+        free(pending);
+        if (err != ERR_OK) {
+            io->close_fn(io->ziti_io);
+            return;
+        }
+    }
+    if (tnlr_io->dropping) {
+        TNL_LOG(INFO, "ziti_write un-stalled: service=%s client=%s dropped=%" PRIu64, tnlr_io->service_name,
+                tnlr_io->client, tnlr_io->dropped);
+        tnlr_io->dropping = false;
+    }
+}
+
+/**
+ * datagrams are written to ziti one message each, since the hosting side delivers every ziti message as a
+ * datagram. datagrams that ziti refuses are held on the connection's pending queue, up to udp_queue_bytes,
+ * and written when ziti drains (tunneler_udp_resume_writes). the drop policy only applies when the queue is full.
+ */
 static void to_ziti(struct io_ctx_s *io, struct pbuf *p) {
-    static bool log_stalled_warns = true;
     if (io == NULL) {
         TNL_LOG(ERR, "null io");
         if (p != NULL) {
@@ -48,42 +272,38 @@ static void to_ziti(struct io_ctx_s *io, struct pbuf *p) {
     }
 
     struct pbuf *recv_data = p;
-    uv_timer_start(io->tnlr_io->conn_timer, udp_timeout_cb, UDP_TIMEOUT, 0);
+    refresh_idle_timer(io);
 
     do {
-        TNL_LOG(TRACE, "writing %d bytes to ziti src[%s] dst[%s] service[%s]", recv_data->len,
-                io->tnlr_io->client, io->tnlr_io->intercepted, io->tnlr_io->service_name);
-        struct write_ctx_s *wr_ctx = calloc(1, sizeof(struct write_ctx_s));
-        wr_ctx->pbuf = recv_data;
-        wr_ctx->udp = io->tnlr_io->udp;
-        wr_ctx->ack = tunneler_udp_ack;
-        struct pbuf *next = recv_data->next;
+        struct pbuf *datagram = recv_data;
+        recv_data = recv_data->next;
         // break the chain to prevent pbuf_free from iterating and freeing subsequent pbufs
-        recv_data->next = NULL;
-        recv_data = next;
-
-        ssize_t s = io->write_fn(io->ziti_io, wr_ctx, wr_ctx->pbuf->payload, wr_ctx->pbuf->len);
-        if (s == ERR_WOULDBLOCK) {
-            tunneler_udp_ack(wr_ctx);
-            free(wr_ctx);
-            if (log_stalled_warns) {
-                TNL_LOG(WARN, "ziti_write stalled: dropping UDP packets until buffers are released service=%s, client=%s, ret=%ld",
-                        io->tnlr_io->service_name, io->tnlr_io->client, s);
-            }
-            break;
-        } else if (s < 0) {
-            tunneler_udp_ack(wr_ctx);
-            free(wr_ctx);
-            TNL_LOG(ERR, "ziti_write failed: service=%s, client=%s, ret=%ld", io->tnlr_io->service_name, io->tnlr_io->client, s);
+        datagram->next = NULL;
+
+        if (!STAILQ_EMPTY(&io->tnlr_io->pending)) {
+            enqueue_datagram(io, datagram);
+            continue;
+        }
+        err_t err = write_datagram(io, datagram);
+        if (err == ERR_WOULDBLOCK) {
+            enqueue_datagram(io, datagram);
+        } else if (err != ERR_OK) {
             io->close_fn(io->ziti_io);
+            if (recv_data != NULL) {
+                pbuf_free(recv_data);
+            }
             break;
-        } else if (s == 0 && !log_stalled_warns) {
-            TNL_LOG(INFO, "ziti_write un-stalled: service=%s client=%s", io->tnlr_io->service_name, io->tnlr_io->client);
-            log_stalled_warns = true;
         }
     } while (recv_data != NULL);
 }
 
+void tunneler_udp_resume_writes(struct io_ctx_s *io) {
+    if (io->tnlr_io->udp == NULL || STAILQ_EMPTY(&io->tnlr_io->pending)) {
+        return;
+    }
+    flush_datagrams(io);
+}
+
 /** called by lwip when a packet arrives from a connected client and the ziti service is connected */
 void on_udp_client_data(void *io_context, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
     if (io_context == NULL) {
@@ -92,13 +312,6 @@ void on_udp_client_data(void *io_context, struct udp_pcb *pcb, struct pbuf *p, c
     }
     TNL_LOG(VERBOSE, "%d bytes from %s:%d", p->len, ipaddr_ntoa(addr), port);
 
-    struct io_ctx_s *io = io_context;
-    if (!io->tnlr_io->conn_timer) {
-        io->tnlr_io->conn_timer = calloc(1, sizeof(uv_timer_t));
-        io->tnlr_io->conn_timer->data = io;
-        uv_timer_init(io->tnlr_io->tnlr_ctx->loop, io->tnlr_io->conn_timer);
-    }
-
     to_ziti(io_context, p);
 }
 
@@ -107,18 +320,23 @@ void tunneler_udp_ack(struct write_ctx_s *write_ctx) {
 }
 
 int tunneler_udp_close(struct udp_pcb *pcb) {
+    if (pcb == NULL) {
+        return 0; // reclaimed
+    }
     struct io_ctx_s *io_ctx = pcb->recv_arg;
     tunneler_io_context tnlr_io_ctx = io_ctx->tnlr_io;
     TNL_LOG(DEBUG, "closing src[%s] dst[%s] service[%s]",
             tnlr_io_ctx->client, tnlr_io_ctx->intercepted, tnlr_io_ctx->service_name);
-    udp_remove(pcb);
+    remove_udp_pcb(pcb);
     return 0;
 }
 
 void tunneler_udp_dial_completed(struct io_ctx_s *io, bool ok) {
     if (!ok) {
         ziti_tunneler_close(io->tnlr_io);
+        return;
     }
+    tnl_latency_record(io->tnlr_io->latency, tnl_stage_dial, io->tnlr_io->dial_ns);
 }
 
 /** called by lwip when a udp datagram arrives. return 1 to indicate that the IP packet was consumed. */
@@ -165,22 +383,8 @@ u8_t recv_udp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, const ip_
     TNL_LOG(TRACE, "received datagram src[%s:%d] dst[%s:%d]", src_str, src_p, dst_str, dst_p);
 
     /* first see if this datagram belongs to an active connection */
-    for (struct udp_pcb *con_pcb = udp_pcbs, *prev = NULL; con_pcb != NULL; con_pcb = con_pcb->next) {
-        if (con_pcb->remote_port == src_p &&
-            con_pcb->local_port == dst_p &&
-            ip_addr_cmp(&con_pcb->remote_ip, &src) &&
-            ip_addr_cmp(&con_pcb->local_ip, &dst)) {
-            if (prev != NULL) {
-                /* move the pcb to the front of udp_pcbs so that is found faster next time */
-                prev->next = con_pcb->next;
-                con_pcb->next = udp_pcbs;
-                udp_pcbs = con_pcb;
-            } else {
-                UDP_STATS_INC(udp.cachehit);
-            }
-            return 0; // let lwip process the datagram
-        }
-        prev = con_pcb;
+    if (tnl_flow_find(&udp_flows, &dst, dst_p, &src, src_p) != NULL) {
+        return 0; // let lwip process the datagram
     }
 
     /* is the dest address being intercepted? */
@@ -192,10 +396,30 @@ u8_t recv_udp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, const ip_
 
     ziti_sdk_dial_cb zdial = intercept_ctx->dial_fn ? intercept_ctx->dial_fn : tnlr_ctx->opts.ziti_dial;
 
+    /* make room for the connection if its service, or the tunneler, is at its limit */
+    struct tnl_udp_service_s *svc = udp_service(intercept_ctx->service_name);
+    if (svc == NULL) {
+        TNL_LOG(ERR, "failed to allocate flow counts for service[%s]", intercept_ctx->service_name);
+        pbuf_free(p);
+        return 1;
+    }
+    if (udp_service_limit > 0 && svc->flows >= (size_t) udp_service_limit && !reclaim_idle_flow(tnlr_ctx->loop, svc)) {
+        TNL_LOG(ERR, "UDP connection limit for service reached. dropping datagram from udp:%s:%d, service=%s", src_str, src_p, intercept_ctx->service_name);
+        svc->refused++;
+        pbuf_free(p);
+        return 1;
+    }
+    if (!tunneler_pool_available(MEMP_UDP_PCB) && !reclaim_idle_flow(tnlr_ctx->loop, NULL)) {
+        TNL_LOG(ERR, "UDP connection limit reached. dropping datagram from udp:%s:%d, service=%s", src_str, src_p, intercept_ctx->service_name);
+        svc->refused++;
+        pbuf_free(p);
+        return 1;
+    }
+
     /* make a new pcb for this connection and register it with lwip */
     struct udp_pcb *npcb = udp_new();
     if (npcb == NULL) {
-        TNL_LOG(ERR, "unable to allocate UDP pcb - UDP connection limit is %d", MEMP_NUM_UDP_PCB);
+        TNL_LOG(ERR, "unable to allocate UDP pcb");
         pbuf_free(p);
         return 1;
     }
@@ -204,6 +428,13 @@ u8_t recv_udp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, const ip_
     err_t err = udp_connect(npcb, &src, src_p);
     if (err != ERR_OK) {
         TNL_LOG(ERR, "failed to udp_connect %s:%d: err: %d", src_str, src_p, err);
+        remove_udp_pcb(npcb);
+        pbuf_free(p);
+        return 1;
+    }
+
+    if (tnl_flow_insert(&udp_flows, &dst, dst_p, &src, src_p, npcb) == NULL) {
+        TNL_LOG(ERR, "failed to allocate flow table entry");
         udp_remove(npcb);
         pbuf_free(p);
         return 1;
@@ -214,23 +445,26 @@ u8_t recv_udp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, const ip_
     struct io_ctx_s *io = calloc(1, sizeof(struct io_ctx_s));
     if (io == NULL) {
         TNL_LOG(ERR, "failed to allocate io_context");
-        udp_remove(npcb);
+        remove_udp_pcb(npcb);
         pbuf_free(p);
         return 1;
     }
     io->tnlr_io = (tunneler_io_context)calloc(1, sizeof(struct tunneler_io_ctx_s));
     if (io->tnlr_io == NULL) {
         TNL_LOG(ERR, "failed to allocate tunneler io context");
-        udp_remove(npcb);
+        remove_udp_pcb(npcb);
         pbuf_free(p);
         return 1;
     }
     io->tnlr_io->tnlr_ctx = tnlr_ctx;
     io->tnlr_io->proto = tun_udp;
+    STAILQ_INIT(&io->tnlr_io->pending);
     io->tnlr_io->service_name = strdup(intercept_ctx->service_name);
     snprintf(io->tnlr_io->client, sizeof(io->tnlr_io->client), "udp:%s:%d", src_str, src_p);
     snprintf(io->tnlr_io->intercepted, sizeof(io->tnlr_io->intercepted), "udp:%s:%d", dst_str, dst_p);
     io->tnlr_io->udp = npcb;
+    io->tnlr_io->latency = tnl_latency_for_service(intercept_ctx->service_name);
+    io->tnlr_io->dial_ns = uv_hrtime();
     io->ziti_ctx = intercept_ctx->app_intercept_ctx;
     io->write_fn = intercept_ctx->write_fn ? intercept_ctx->write_fn : tnlr_ctx->opts.ziti_write;
     io->close_fn = intercept_ctx->close_fn ? intercept_ctx->close_fn : tnlr_ctx->opts.ziti_close;
@@ -240,11 +474,15 @@ u8_t recv_udp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, const ip_
             intercept_ctx->service_name);
 
     udp_recv(npcb, on_udp_client_data, io);
+    io->tnlr_io->udp_service = svc;
+    io->tnlr_io->last_active = uv_now(tnlr_ctx->loop);
+    svc->flows++;
+    TAILQ_INSERT_TAIL(&udp_lru, io->tnlr_io, udp_lru);
 
     void *ziti_io_ctx = zdial(intercept_ctx->app_intercept_ctx, io);
     if (ziti_io_ctx == NULL) {
         TNL_LOG(ERR, "ziti_dial(%s) failed", intercept_ctx->service_name);
-        udp_remove(npcb);
+        remove_udp_pcb(npcb);
         pbuf_free(p);
         free_tunneler_io_context(&io->tnlr_io);
         free(io);
@@ -254,9 +492,28 @@ u8_t recv_udp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, const ip_
     return 0; /* lwip will call on_udp_client_data_enqueue for this packet */
 }
 
+/**
+ * if the netif driver can gather, the datagram is sent from the caller's buffer: lwip chains the UDP/IP
+ * headers in a pbuf of their own in front of it, and the driver writes both with one writev. lwip does not
+ * hold on to `data` after udp_sendto_if_src returns (the netif shim copies packets that it batches).
+ * otherwise it is copied once, into a pbuf with room for the headers, and written as one buffer.
+ */
 ssize_t tunneler_udp_write(struct udp_pcb *pcb, const void *data, size_t len) {
-    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
-    memcpy(p->payload, data, len);
+    if (pcb == NULL) {
+        TNL_LOG(DEBUG, "udp flow was reclaimed");
+        return -1;
+    }
+    struct io_ctx_s *io = pcb->recv_arg;
+    struct pbuf *p;
+    if (io->tnlr_io->tnlr_ctx->opts.netif_driver->writev != NULL) {
+        p = pbuf_alloc_reference((void *) data, len, PBUF_REF);
+    } else if ((p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM)) != NULL) {
+        memcpy(p->payload, data, len);
+    }
+    if (p == NULL) {
+        TNL_LOG(ERR, "failed to allocate pbuf for %zu byte datagram: client=%s", len, io->tnlr_io->client);
+        return -1;
+    }
     /* use udp_sendto_if_src even though local and remote addresses are in pcb, because
      * udp_send verifies that the dest IP matches the netif's IP, and fails with ERR_RTE.
      */
@@ -265,10 +522,7 @@ ssize_t tunneler_udp_write(struct udp_pcb *pcb, const void *data, size_t len) {
     if (err != ERR_OK) {
         return -1;
     }
-    struct io_ctx_s *io = pcb->recv_arg;
-    if (io->tnlr_io->idle_timeout > 0) {
-        uv_timer_start(io->tnlr_io->conn_timer, udp_timeout_cb, io->tnlr_io->idle_timeout, 0);
-    }
+    refresh_idle_timer(io);
     return len;
 }
 
@@ -309,4 +563,27 @@ void tunneler_udp_get_conn(tunnel_ip_conn *conn, struct udp_pcb *pcb) {
         service = io->tnlr_io->service_name;
     }
     conn->service = strdup(service);
+    if (io && io->tnlr_io) {
+        conn->dropped = (model_number) io->tnlr_io->dropped;
+    }
+}
+
+void tunneler_udp_get_service_stats(tunnel_udp_service_stats_array *stats) {
+    if (*stats) {
+        free_tunnel_udp_service_stats_array(stats);
+    }
+    *stats = calloc(model_map_size(&udp_services) + 1, sizeof(tunnel_udp_service_stats *));
+
+    int i = 0;
+    const char *service;
+    struct tnl_udp_service_s *svc;
+    MODEL_MAP_FOREACH(service, svc, &udp_services) {
+        tunnel_udp_service_stats *s = calloc(1, sizeof(tunnel_udp_service_stats));
+        s->service = strdup(service);
+        s->flows = (model_number) svc->flows;
+        s->limit = (model_number) udp_service_limit;
+        s->reclaimed = (model_number) svc->reclaimed;
+        s->refused = (model_number) svc->refused;
+        (*stats)[i++] = s;
+    }
 }
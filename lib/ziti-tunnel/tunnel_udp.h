@@ -25,7 +25,11 @@ extern ssize_t tunneler_udp_write(struct udp_pcb *pcb, const void *data, size_t
 extern void tunneler_udp_dial_completed(struct io_ctx_s *io, bool ok);
 extern u8_t recv_udp(void *tnlr_ctx_arg, struct raw_pcb *pcb, struct pbuf *p, const ip_addr_t *addr);
 extern void tunneler_udp_ack(struct write_ctx_s *write_ctx);
+/** write queued datagrams that ziti refused earlier */
+extern void tunneler_udp_resume_writes(struct io_ctx_s *io);
 extern int tunneler_udp_close(struct udp_pcb *pcb);
+/** limit the udp connections of each service. the least recently active idle connection is closed to make room */
+extern void tunneler_udp_set_service_limit(int limit);
 /** return list of io contexts for active connections to the given service. caller must free the returned pointer */
 extern struct io_ctx_list_s *tunneler_udp_active(const void *zi_ctx);
 
@@ -46,6 +46,7 @@ const char *SRC_PORT_KEY = "src_port";
 const char *SOURCE_IP_KEY = "source_ip";
 
 static void run_packet_loop(uv_loop_t *loop, tunneler_context tnlr_ctx);
+static void set_pool_limit(memp_t pool, int limit);
 
 STAILQ_HEAD(tlnr_ctx_list_s, tunneler_ctx_s) tnlr_ctx_list_head = STAILQ_HEAD_INITIALIZER(tnlr_ctx_list_head);
 
@@ -87,7 +88,7 @@ tunneler_context ziti_tunneler_init(tunneler_sdk_options *opts, uv_loop_t *loop)
     }
 
     LIST_INIT(&ctx->intercepts);
-    ctx->intercepts_cache.impl = NULL;
+    ctx->intercepts_cache = NULL;
 
     run_packet_loop(loop, ctx);
 
@@ -159,22 +160,67 @@ void ziti_tunneler_exclude_route(tunneler_context tnlr_ctx, const char *dst) {
 
 static void tunneler_kill_active(const void *ztx);
 
+/** frees the queue poll handles once the last one is closed */
+static void on_netif_queue_closed(uv_handle_t *h) {
+    tunneler_context tnlr_ctx = h->data;
+    if (--tnlr_ctx->netif_queues == 0) {
+        free(tnlr_ctx->netif_queue_reqs);
+        tnlr_ctx->netif_queue_reqs = NULL;
+    }
+}
+
+/** stops reading packets from the netif */
+static void stop_netif_polling(tunneler_context tnlr_ctx) {
+    if (tnlr_ctx->netif_poll_req.type == UV_POLL && !uv_is_closing((uv_handle_t *) &tnlr_ctx->netif_poll_req)) {
+        uv_poll_stop(&tnlr_ctx->netif_poll_req);
+        uv_close((uv_handle_t *) &tnlr_ctx->netif_poll_req, NULL);
+    }
+    if (tnlr_ctx->netif_queue_reqs != NULL && !uv_is_closing((uv_handle_t *) &tnlr_ctx->netif_queue_reqs[0])) {
+        for (int i = 0; i < tnlr_ctx->netif_queues; i++) {
+            uv_poll_t *req = &tnlr_ctx->netif_queue_reqs[i];
+            uv_poll_stop(req);
+            req->data = tnlr_ctx; // no longer the queue, since the handle won't be polled again
+            uv_close((uv_handle_t *) req, on_netif_queue_closed);
+        }
+    }
+}
+
 void ziti_tunneler_shutdown(tunneler_context tnlr_ctx) {
     TNL_LOG(DEBUG, "tnlr_ctx %p", tnlr_ctx);
 
+    stop_netif_polling(tnlr_ctx);
+
     while (!LIST_EMPTY(&tnlr_ctx->intercepts)) {
         intercept_ctx_t *i = LIST_FIRST(&tnlr_ctx->intercepts);
         tunneler_kill_active(i->app_intercept_ctx);
         LIST_REMOVE(i, entries);
+        i->intercepting = false;
     }
+    invalidate_intercept_lookups(tnlr_ctx);
 }
 
 /** called by tunneler application when data has been successfully written to ziti */
 void ziti_tunneler_ack(struct write_ctx_s *write_ctx) {
+    tnl_latency_record(write_ctx->latency, tnl_stage_ziti_write, write_ctx->start_ns);
+    tnl_latency_release(write_ctx->latency);
     write_ctx->ack(write_ctx);
     free(write_ctx);
 }
 
+void ziti_tunneler_resume_writes(struct io_ctx_s *io) {
+    if (io == NULL || io->tnlr_io == NULL) {
+        return;
+    }
+    switch (io->tnlr_io->proto) {
+        case tun_tcp:
+            tunneler_tcp_resume_writes(io);
+            break;
+        case tun_udp:
+            tunneler_udp_resume_writes(io);
+            break;
+    }
+}
+
 const char *get_intercepted_address(const struct tunneler_io_ctx_s * tnlr_io) {
     if (tnlr_io == NULL) {
         return NULL;
@@ -197,6 +243,14 @@ void free_tunneler_io_context(tunneler_io_context *tnlr_io_ctx_p) {
     if (*tnlr_io_ctx_p != NULL) {
         tunneler_io_context io = *tnlr_io_ctx_p;
         if (io->service_name != NULL) free((char*)io->service_name);
+        tnl_latency_release(io->latency);
+        if (io->proto == tun_tcp) tunneler_tcp_free_window(io);
+        while (!STAILQ_EMPTY(&io->pending)) {
+            struct tnl_pending_s *pending = STAILQ_FIRST(&io->pending);
+            STAILQ_REMOVE_HEAD(&io->pending, entries);
+            pbuf_free(pending->p);
+            free(pending);
+        }
         free(io);
         *tnlr_io_ctx_p = NULL;
     }
@@ -252,12 +306,14 @@ intercept_ctx_t* intercept_ctx_new(tunneler_context tnlr_ctx, const char *app_id
 
 void intercept_ctx_set_match_addr(intercept_ctx_t *intercept, intercept_match_addr_fn pred) {
     intercept->match_addr = pred;
+    if (intercept->intercepting) invalidate_intercept_lookups(intercept->tnlr_ctx);
 }
 
 void intercept_ctx_add_protocol(intercept_ctx_t *ctx, const char *protocol) {
     protocol_t *proto = calloc(1, sizeof(protocol_t));
     proto->protocol = strdup(protocol);
     STAILQ_INSERT_TAIL(&ctx->protocols, proto, entries);
+    if (ctx->intercepting) invalidate_intercept_lookups(ctx->tnlr_ctx);
 }
 
 void intercept_ctx_add_address(intercept_ctx_t *i_ctx, const ziti_address *za) {
@@ -268,6 +324,7 @@ void intercept_ctx_add_address(intercept_ctx_t *i_ctx, const ziti_address *za) {
     memcpy(&a->za, za, sizeof(ziti_address));
     ziti_address_print(a->str, sizeof(a->str), za);
     STAILQ_INSERT_TAIL(&i_ctx->addresses, a, entries);
+    if (i_ctx->intercepting) invalidate_intercept_lookups(i_ctx->tnlr_ctx);
 }
 
 void intercept_ctx_add_allowed_source_address(intercept_ctx_t *i_ctx, const ziti_address *za) {
@@ -278,6 +335,7 @@ void intercept_ctx_add_allowed_source_address(intercept_ctx_t *i_ctx, const ziti
     memcpy(&a->za, za, sizeof(ziti_address));
     ziti_address_print(a->str, sizeof(a->str), za);
     STAILQ_INSERT_TAIL(&i_ctx->allowed_source_addresses, a, entries);
+    if (i_ctx->intercepting) invalidate_intercept_lookups(i_ctx->tnlr_ctx);
 }
 
 port_range_t *parse_port_range(uint16_t low, uint16_t high) {
@@ -301,6 +359,7 @@ port_range_t *parse_port_range(uint16_t low, uint16_t high) {
 port_range_t *intercept_ctx_add_port_range(intercept_ctx_t *i_ctx, uint16_t low, uint16_t high) {
     port_range_t *pr = parse_port_range(low, high);
     STAILQ_INSERT_TAIL(&i_ctx->port_ranges, pr, entries);
+    if (i_ctx->intercepting) invalidate_intercept_lookups(i_ctx->tnlr_ctx);
     return pr;
 }
 
@@ -318,7 +377,6 @@ int ziti_tunneler_intercept(tunneler_context tnlr_ctx, intercept_ctx_t *i_ctx) {
         return -1;
     }
 
-    model_map_clear(&tnlr_ctx->intercepts_cache, NULL);
     address_t *address;
     STAILQ_FOREACH(address, &i_ctx->addresses, entries) {
         protocol_t *proto;
@@ -339,6 +397,8 @@ int ziti_tunneler_intercept(tunneler_context tnlr_ctx, intercept_ctx_t *i_ctx) {
     }
 
     LIST_INSERT_HEAD(&tnlr_ctx->intercepts, (struct intercept_ctx_s *)i_ctx, entries);
+    i_ctx->intercepting = true;
+    intercept_lookups_add(tnlr_ctx, i_ctx);
 
     return 0;
 }
@@ -392,9 +452,19 @@ intercept_ctx_t * ziti_tunnel_find_intercept(tunneler_context tnlr_ctx, void *zi
 
 // when called due to service unavailable we want to remove from tnlr_ctx.
 // when called due to conflict we want to mark as disabled
+/** true if the service is still intercepted by another identity */
+static bool service_intercepted(tunneler_context tnlr_ctx, const char *service_name) {
+    struct intercept_ctx_s *intercept;
+    LIST_FOREACH(intercept, &tnlr_ctx->intercepts, entries) {
+        if (intercept->service_name != NULL && strcmp(intercept->service_name, service_name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void ziti_tunneler_stop_intercepting(tunneler_context tnlr_ctx, void *zi_ctx) {
     TNL_LOG(DEBUG, "removing intercept for service_ctx[%p]", zi_ctx);
-    model_map_clear(&tnlr_ctx->intercepts_cache, NULL);
     struct intercept_ctx_s *intercept = ziti_tunnel_find_intercept(tnlr_ctx, zi_ctx);
 
     if (intercept != NULL) {
@@ -402,12 +472,18 @@ void ziti_tunneler_stop_intercepting(tunneler_context tnlr_ctx, void *zi_ctx) {
         tunneler_kill_active(zi_ctx);
 
         LIST_REMOVE(intercept, entries);
+        intercept->intercepting = false;
+        intercept_lookups_remove(tnlr_ctx, intercept);
 
         struct address_s *address;
         STAILQ_FOREACH(address, &intercept->addresses, entries) {
             delete_route(tnlr_ctx->opts.netif_driver, address);
         }
 
+        if (intercept->service_name != NULL && !service_intercepted(tnlr_ctx, intercept->service_name)) {
+            tnl_latency_remove_service(intercept->service_name);
+            tunneler_udp_remove_service(intercept->service_name);
+        }
         free_intercept(intercept);
     }
 
@@ -416,6 +492,22 @@ void ziti_tunneler_stop_intercepting(tunneler_context tnlr_ctx, void *zi_ctx) {
 
 }
 
+void ziti_tunneler_begin_intercept_batch(tunneler_context tnlr_ctx) {
+    if (tnlr_ctx == NULL) {
+        return;
+    }
+    tnlr_ctx->intercept_batch++;
+}
+
+void ziti_tunneler_commit_intercept_batch(tunneler_context tnlr_ctx) {
+    if (tnlr_ctx == NULL || tnlr_ctx->intercept_batch == 0) {
+        return;
+    }
+    if (--tnlr_ctx->intercept_batch == 0) {
+        intercept_lookups_commit(tnlr_ctx);
+    }
+}
+
 /** called by tunneler application when data is read from a ziti connection */
 ssize_t ziti_tunneler_write(tunneler_io_context tnlr_io_ctx, const void *data, size_t len) {
     if (tnlr_io_ctx == NULL) {
@@ -458,10 +550,7 @@ int ziti_tunneler_close(tunneler_io_context tnlr_io_ctx) {
             break;
     }
 
-    if (tnlr_io_ctx->conn_timer) {
-        uv_close((uv_handle_t *) tnlr_io_ctx->conn_timer, (uv_close_cb) free);
-        tnlr_io_ctx->conn_timer = NULL;
-    }
+    tnl_timer_cancel(&tnlr_io_ctx->idle_timer);
 
     free_tunneler_io_context(&tnlr_io_ctx);
     return 0;
@@ -497,6 +586,17 @@ static void on_tun_data(uv_poll_t * req, int status, int events) {
     }
 }
 
+static void on_tun_queue_data(uv_poll_t * req, int status, int events) {
+    if (status != 0) {
+        TNL_LOG(WARN, "not sure why status is %d", status);
+        return;
+    }
+
+    if (events & UV_READABLE) {
+        netif_shim_input_queue(netif_default, req->data);
+    }
+}
+
 static void check_lwip_timeouts(uv_timer_t * timer) {
     // if timer is not active it may have been a while since
     // we run timers, let LWIP adjust timeouts
@@ -548,6 +648,11 @@ static struct raw_pcb * init_protocol_handler(u8_t proto, raw_recv_fn recv_fn, v
     return pcb;
 }
 
+/** called by libuv after i/o callbacks, so writes from ziti that arrived in one loop iteration are sent together */
+static void on_tcp_output_check(uv_check_t *check) {
+    tunneler_tcp_flush_output();
+}
+
 static void run_packet_loop(uv_loop_t *loop, tunneler_context tnlr_ctx) {
     tunneler_sdk_options opts = tnlr_ctx->opts;
     if (opts.ziti_close == NULL || opts.ziti_close_write == NULL ||  opts.ziti_write == NULL ||
@@ -564,12 +669,35 @@ static void run_packet_loop(uv_loop_t *loop, tunneler_context tnlr_ctx) {
         exit(1);
     }
 
+    netif_shim_set_read_budget(opts.netif_read_max_packets, opts.netif_read_max_usec);
+    set_pool_limit(MEMP_TCP_PCB, opts.max_tcp_connections);
+    set_pool_limit(MEMP_UDP_PCB, opts.max_udp_connections);
+    set_pool_limit(MEMP_PBUF_POOL, opts.max_pool_pbufs);
+    set_pool_limit(MEMP_TCP_SEG, opts.max_tcp_segments);
+    tunneler_udp_set_service_limit(opts.max_udp_service_connections);
+
     netif_set_default(&tnlr_ctx->netif);
     netif_set_link_up(&tnlr_ctx->netif);
     netif_set_up(&tnlr_ctx->netif);
 
+    int queues = netif_driver->queue_count ? netif_driver->queue_count(netif_driver->handle) : 1;
+
     if (netif_driver->setup) {
         netif_driver->setup(netif_driver->handle, loop, on_packet, netif_default);
+    } else if (netif_driver->uv_poll_init && queues > 1) {
+        tnlr_ctx->netif_queue_reqs = calloc(queues, sizeof(uv_poll_t));
+        tnlr_ctx->netif_queues = queues;
+        for (int i = 0; i < queues; i++) {
+            netif_handle queue = netif_driver->get_queue(netif_driver->handle, i);
+            uv_poll_t *req = &tnlr_ctx->netif_queue_reqs[i];
+            netif_driver->uv_poll_init(queue, loop, req);
+            req->data = queue;
+            if (uv_poll_start(req, UV_READABLE, on_tun_queue_data) != 0) {
+                TNL_LOG(ERR, "failed to start poll handle for tun queue %d", i);
+                exit(1);
+            }
+        }
+        TNL_LOG(INFO, "polling %d tun queues", queues);
     } else if (netif_driver->uv_poll_init) {
         netif_driver->uv_poll_init(netif_driver->handle, loop, &tnlr_ctx->netif_poll_req);
         if (uv_poll_start(&tnlr_ctx->netif_poll_req, UV_READABLE, on_tun_data) != 0) {
@@ -592,6 +720,13 @@ static void run_packet_loop(uv_loop_t *loop, tunneler_context tnlr_ctx) {
     // don't run LWIP timers until we have active TCP connections
     uv_timer_init(loop, &tnlr_ctx->lwip_timer_req);
     uv_unref((uv_handle_t *) &tnlr_ctx->lwip_timer_req);
+
+    uv_check_init(loop, &tnlr_ctx->tcp_output_req);
+    uv_check_start(&tnlr_ctx->tcp_output_req, on_tcp_output_check);
+    uv_unref((uv_handle_t *) &tnlr_ctx->tcp_output_req);
+    uv_idle_init(loop, &tnlr_ctx->tcp_output_idle);
+    uv_unref((uv_handle_t *) &tnlr_ctx->tcp_output_idle);
+    tunneler_tcp_set_output_idle(&tnlr_ctx->tcp_output_idle);
 }
 
 typedef struct ziti_tunnel_async_call_s {
@@ -653,32 +788,87 @@ void ziti_tunnel_async_send(tunneler_context tctx, ziti_tunnel_async_fn f, void
 #define _str(x) #x
 #define str(x) _str(x)
 
+/**
+ * lwip allocates pool elements on demand (MEMP_MEM_MALLOC), so the pools that grow with the
+ * number of connections are limited here instead of by their compile time size.
+ * tcp segments are only limited where the tunneler queues them (tunneler_tcp_write). segments
+ * that lwip allocates itself, for control flags and out-of-order data, are not limited.
+ */
+static struct pool_limit_s {
+    memp_t pool;
+    const char *name;
+    u32_t limit;
+    uint64_t exhausted;
+} pool_limits[] = {
+        { MEMP_PBUF_POOL, _str(MEMP_PBUF_POOL), PBUF_POOL_SIZE },
+        { MEMP_TCP_PCB, _str(MEMP_TCP_PCB), MEMP_NUM_TCP_PCB },
+        { MEMP_UDP_PCB, _str(MEMP_UDP_PCB), MEMP_NUM_UDP_PCB },
+        { MEMP_TCP_SEG, _str(MEMP_TCP_SEG), MEMP_NUM_TCP_SEG },
+};
+
+static void set_pool_limit(memp_t pool, int limit) {
+    if (limit <= 0) {
+        return;
+    }
+    for (int p = 0; p < sizeof(pool_limits) / sizeof(pool_limits[0]); p++) {
+        if (pool_limits[p].pool == pool) {
+            TNL_LOG(INFO, "%s limit is %d", pool_limits[p].name, limit);
+            pool_limits[p].limit = (u32_t) limit;
+        }
+    }
+}
+
+bool tunneler_pool_available(memp_t pool) {
+    for (int p = 0; p < sizeof(pool_limits) / sizeof(pool_limits[0]); p++) {
+        if (pool_limits[p].pool == pool) {
+            if (memp_pools[pool]->stats->used < pool_limits[p].limit) {
+                return true;
+            }
+            pool_limits[p].exhausted++;
+            return false;
+        }
+    }
+    return true;
+}
+
 IMPL_MODEL(tunnel_ip_mem_pool, TNL_IP_MEM_POOL)
 IMPL_MODEL(tunnel_ip_conn, TNL_IP_CONN)
+IMPL_MODEL(tunnel_netif_stats, TNL_NETIF_STATS)
+IMPL_MODEL(tunnel_latency_stage, TNL_LATENCY_STAGE)
+IMPL_MODEL(tunnel_service_latency, TNL_SERVICE_LATENCY)
+IMPL_MODEL(tunnel_intercept_cache_stats, TNL_INTERCEPT_CACHE_STATS)
+IMPL_MODEL(tunnel_udp_service_stats, TNL_UDP_SERVICE_STATS)
 IMPL_MODEL(tunnel_ip_stats, TNL_IP_STATS)
 
-static void ziti_tunnel_get_ip_mem_pool(tunnel_ip_mem_pool *pool, int pool_id, const char *pool_name) {
+static void ziti_tunnel_get_ip_mem_pool(tunnel_ip_mem_pool *pool, const struct pool_limit_s *limit) {
     if (!pool) return;
-    TNL_LOG(VERBOSE, "getting IP mem pool %s", pool_name);
-    pool->name = strdup(pool_name);
-    pool->used = memp_pools[pool_id]->stats->used;
-    pool->max = memp_pools[pool_id]->stats->max;
-    pool->avail = memp_pools[pool_id]->stats->avail;
+    TNL_LOG(VERBOSE, "getting IP mem pool %s", limit->name);
+    pool->name = strdup(limit->name);
+    pool->used = memp_pools[limit->pool]->stats->used;
+    pool->max = memp_pools[limit->pool]->stats->max;
+    pool->limit = limit->limit;
+    pool->avail = pool->used < pool->limit ? pool->limit - pool->used : 0;
+    // allocations that were refused at the limit, and allocations that failed
+    pool->exhausted = (model_number) (limit->exhausted + memp_pools[limit->pool]->stats->err);
 }
 
 void ziti_tunnel_get_ip_stats(tunnel_ip_stats *stats) {
     if (!stats) return;
     TNL_LOG(DEBUG, "collecting ip statistics");
-    if (stats->pools) free(stats->pools);
-    stats->pools = calloc(4, sizeof(tunnel_ip_mem_pool *));
-    stats->pools[0] = calloc(1, sizeof(tunnel_ip_mem_pool));
-    ziti_tunnel_get_ip_mem_pool(stats->pools[0], MEMP_PBUF_POOL, _str(MEMP_PBUF_POOL));
-    stats->pools[1] = calloc(1, sizeof(tunnel_ip_mem_pool));
-    ziti_tunnel_get_ip_mem_pool(stats->pools[1], MEMP_TCP_PCB, _str(MEMP_TCP_PCB));
-    stats->pools[2] = calloc(1, sizeof(tunnel_ip_mem_pool));
-    ziti_tunnel_get_ip_mem_pool(stats->pools[2], MEMP_UDP_PCB, _str(MEMP_UDP_PCB));
-
-    int max_conns = MEMP_NUM_TCP_PCB + MEMP_NUM_UDP_PCB + 1;
+    if (stats->pools) free_tunnel_ip_mem_pool_array(&stats->pools);
+    int num_pools = sizeof(pool_limits) / sizeof(pool_limits[0]);
+    stats->pools = calloc(num_pools + 1, sizeof(tunnel_ip_mem_pool *));
+    for (int p = 0; p < num_pools; p++) {
+        stats->pools[p] = calloc(1, sizeof(tunnel_ip_mem_pool));
+        ziti_tunnel_get_ip_mem_pool(stats->pools[p], &pool_limits[p]);
+    }
+
+    // the pools are not fixed size, so count the connections
+    int max_conns = 1;
+    for (struct tcp_pcb *tpcb = tcp_tw_pcbs; tpcb != NULL; tpcb = tpcb->next) max_conns++;
+    for (struct tcp_pcb *tpcb = tcp_active_pcbs; tpcb != NULL; tpcb = tpcb->next) max_conns++;
+    for (struct udp_pcb *upcb = udp_pcbs; upcb != NULL; upcb = upcb->next) max_conns++;
+    if (stats->connections) free_tunnel_ip_conn_array(&stats->connections);
     stats->connections = calloc(max_conns, sizeof(tunnel_ip_conn *));
 
     int i= 0;
@@ -695,6 +885,18 @@ void ziti_tunnel_get_ip_stats(tunnel_ip_stats *stats) {
         stats->connections[i] = calloc(1, sizeof(tunnel_ip_conn));
         tunneler_udp_get_conn(stats->connections[i++], upcb);
     }
+
+    if (stats->netif) free_tunnel_netif_stats_ptr(stats->netif);
+    stats->netif = calloc(1, sizeof(tunnel_netif_stats));
+    netif_shim_get_stats(stats->netif);
+
+    tnl_latency_get_stats(&stats->latency);
+
+    if (stats->intercept_cache) free_tunnel_intercept_cache_stats_ptr(stats->intercept_cache);
+    stats->intercept_cache = calloc(1, sizeof(tunnel_intercept_cache_stats));
+    intercept_cache_get_stats(stats->intercept_cache);
+
+    tunneler_udp_get_service_stats(&stats->udp_services);
 }
 
 
@@ -19,6 +19,7 @@
 
 #include "ziti/ziti_tunnel.h"
 #include "lwip/netif.h"
+#include "lwip/memp.h"
 
 #include "ziti/ziti_model.h"
 
@@ -111,6 +112,7 @@ struct intercept_ctx_s {
     ziti_sdk_close_cb close_fn;
 
     LIST_ENTRY(intercept_ctx_s) entries;
+    bool intercepting; // on tnlr_ctx->intercepts
 
     intercept_match_addr_fn match_addr;
 };
@@ -127,20 +129,114 @@ typedef struct tunneler_ctx_s {
     uv_loop_t *loop;
     uv_sem_t sem;
     uv_poll_t netif_poll_req;
+    uv_poll_t *netif_queue_reqs; // one poll handle per queue when the driver has more than one
+    int netif_queues;
     uv_timer_t lwip_timer_req;
+    uv_check_t tcp_output_req; // flushes tcp output once per loop iteration
+    uv_idle_t tcp_output_idle; // active while tcp output is queued
     LIST_HEAD(intercept_ctx_list_s, intercept_ctx_s) intercepts;
-    model_map intercepts_cache; // cached intercept_ctx lookup keyed by [proto]:[ip]:[port]
+    struct intercept_cache_s *intercepts_cache; // cached intercept_ctx lookups keyed by (proto, ip, port)
+    struct intercept_classifier_s *classifier; // compiled from intercepts. NULL until the next lookup after a change
+    int intercept_batch;                       // nesting depth of open intercept batches
+    size_t intercept_batch_changes;
 } *tunneler_context;
 
 /** return the intercept context for a packet based on its destination ip:port */
 extern intercept_ctx_t *
 lookup_intercept_by_address(tunneler_context tnlr_ctx, const char *protocol, ip_addr_t *src_addr, ip_addr_t *dst_addr, uint16_t dst_port);
 
+/** discard compiled and cached intercept lookups. called when an intercept on tnlr_ctx->intercepts is changed in place */
+extern void invalidate_intercept_lookups(tunneler_context tnlr_ctx);
+/** update the lookup structures for an intercept that was added to or removed from tnlr_ctx->intercepts */
+extern void intercept_lookups_add(tunneler_context tnlr_ctx, intercept_ctx_t *intercept);
+extern void intercept_lookups_remove(tunneler_context tnlr_ctx, intercept_ctx_t *intercept);
+/** apply the changes of a closed intercept batch */
+extern void intercept_lookups_commit(tunneler_context tnlr_ctx);
+
+/** get a cached lookup. returns false if the key is not cached. `*intercept` is set to NULL for cached misses */
+extern bool intercept_cache_get(tunneler_context tnlr_ctx, const char *protocol, const ip_addr_t *dst_addr,
+                                uint16_t dst_port, intercept_ctx_t **intercept);
+extern void intercept_cache_flush(tunneler_context tnlr_ctx);
+extern void intercept_cache_get_stats(tunnel_intercept_cache_stats *stats);
+
+/** discard the compiled intercept classifier. it is rebuilt from tnlr_ctx->intercepts by the next lookup */
+extern void intercept_classifier_invalidate(tunneler_context tnlr_ctx);
+/** (re)build the classifier from tnlr_ctx->intercepts */
+extern int intercept_classifier_compile(tunneler_context tnlr_ctx);
+/** update a compiled classifier in place. `intercept` must be at the head of tnlr_ctx->intercepts when it is added */
+extern void intercept_classifier_add(tunneler_context tnlr_ctx, intercept_ctx_t *intercept);
+extern void intercept_classifier_remove(tunneler_context tnlr_ctx, intercept_ctx_t *intercept);
+/**
+ * return the best matching intercept for a packet, using (and compiling if needed) the intercept classifier.
+ * `src_dependent` is set if a source address whitelist was consulted, i.e. the result may differ for other sources.
+ */
+extern intercept_ctx_t *intercept_classifier_lookup(tunneler_context tnlr_ctx, const char *protocol,
+                                                    const ziti_address *src_za, ip_addr_t *dst_addr, uint16_t dst_port,
+                                                    bool *src_dependent);
+
+/** a connection in a flow table. `pcb` is the lwip pcb of the connection */
+struct tnl_flow_s {
+    ip_addr_t local_ip;   // the intercepted address
+    ip_addr_t remote_ip;  // the client
+    u16_t local_port;
+    u16_t remote_port;
+    uint32_t hash;
+    void *pcb;
+    struct tnl_flow_s *next;
+};
+
+/** hash index of the connections of one protocol. zero initialized tables are empty */
+struct tnl_flow_table_s {
+    struct tnl_flow_s **buckets;
+    size_t size;  // power of two, 0 until the first insert
+    size_t count;
+};
+
+/** returns NULL if memory could not be allocated */
+extern struct tnl_flow_s *tnl_flow_insert(struct tnl_flow_table_s *table, const ip_addr_t *local_ip, u16_t local_port,
+                                          const ip_addr_t *remote_ip, u16_t remote_port, void *pcb);
+/** unlink and free `flow` */
+extern void tnl_flow_remove(struct tnl_flow_table_s *table, struct tnl_flow_s *flow);
+/** returns the most recently inserted flow with the given tuple, or NULL */
+extern struct tnl_flow_s *tnl_flow_find(const struct tnl_flow_table_s *table, const ip_addr_t *local_ip, u16_t local_port,
+                                        const ip_addr_t *remote_ip, u16_t remote_port);
+
 typedef enum {
     tun_tcp,
     tun_udp
 } tunneler_proto_type;
 
+struct tnl_timer_s;
+typedef void (*tnl_timer_cb)(struct tnl_timer_s *timer);
+
+/** a timer on the shared timing wheel. zero initialized timers are not scheduled */
+struct tnl_timer_s {
+    uint64_t deadline;  // loop time (ms)
+    tnl_timer_cb cb;
+    void *data;
+    struct tnl_timer_s *next;
+    struct tnl_timer_s **prev; // NULL when not scheduled
+};
+
+/**
+ * call `cb` once `timeout_ms` has passed, at a resolution of a few hundred ms.
+ * rescheduling a timer that is already scheduled only updates its deadline
+ */
+extern void tnl_timer_schedule(uv_loop_t *loop, struct tnl_timer_s *timer, uint32_t timeout_ms, tnl_timer_cb cb, void *data);
+extern void tnl_timer_cancel(struct tnl_timer_s *timer);
+
+/** most segments of a received chain that are written to ziti as a vector. longer chains are coalesced */
+#define TNL_WRITEV_MAX 16
+
+/** client data (tcp segments, or udp datagrams) that ziti_write refused, waiting for ziti to drain */
+struct tnl_pending_s {
+    struct pbuf *p;
+    STAILQ_ENTRY(tnl_pending_s) entries;
+};
+
+/** writes to a client that are timed until they are acked. more writes than this are not sampled */
+#define TNL_LATENCY_UNACKED 8
+
 struct tunneler_io_ctx_s {
     tunneler_context tnlr_ctx;
     char *service_name;
@@ -151,11 +247,50 @@ struct tunneler_io_ctx_s {
         struct tcp_pcb *tcp;
         struct udp_pcb *udp;
     };
-    uv_timer_t *conn_timer;
+    struct tnl_timer_s idle_timer;
     uint32_t idle_timeout;
+    uint64_t last_active;  // udp only. loop time (ms) of the last datagram in either direction
+    struct tnl_udp_service_s *udp_service; // udp only. set while the flow is counted against its service
+    TAILQ_ENTRY(tunneler_io_ctx_s) udp_lru; // udp flows, least recently active first
+
+    struct tnl_service_latency_s *latency;
+    uint64_t dial_ns;      // when the dial started
+    uint64_t synack_ns;    // when the SYN/ACK was sent
+    uint64_t blocked_ns;   // when ziti_write started applying backpressure
+    uint64_t blocked_total_ns; // time spent in earlier periods of backpressure
+    STAILQ_HEAD(, tnl_pending_s) pending; // refused client data, in order
+    bool pending_fin;      // the client's FIN arrived behind pending data
+    size_t pending_bytes;  // udp only. tcp data is bounded by the receive window
+    uint64_t dropped;      // udp datagrams dropped because the queue was full
+    bool dropping;         // datagrams were dropped since the queue was last empty
+    struct {
+        u32_t seq;         // sequence number that follows the written data
+        uint64_t ns;
+    } unacked[TNL_LATENCY_UNACKED]; // writes to the client that are waiting for an ACK
+    uint8_t unacked_head;
+    uint8_t unacked_count;
+
+    struct tnl_rwnd_s {
+        u32_t size;            // receive window offered to the client
+        u32_t debt;            // credit to withhold from acked writes after the window shrank
+        u32_t credit;          // acked credit that is given to the client at the next output flush
+        uint64_t rate;         // bytes per second drained by ziti (ewma)
+        uint64_t min_delay_ns; // lowest ziti write latency since min_delay_since
+        uint64_t min_delay_since;
+        uint64_t sample_ns;    // when the current drain rate sample started
+        uint64_t sample_bytes;
+        uint64_t shrink_ns;    // when the window last shrank
+        bool blocked;          // ziti_write applied backpressure since the last ack
+    } rwnd;
 };
 
 extern void check_tnlr_timer(tunneler_context tnlr_ctx);
+
+/**
+ * returns false, and counts an exhaustion event, if `pool` has reached the limit set in tunneler_sdk_options.
+ * lwip allocates pool elements on demand, so this must be checked before allocating from a limited pool.
+ */
+extern bool tunneler_pool_available(memp_t pool);
 extern void free_tunneler_io_context(tunneler_io_context *tnlr_io_ctx_p);
 
 extern void free_intercept(intercept_ctx_t *intercept);
@@ -171,8 +306,62 @@ struct write_ctx_s {
         struct udp_pcb *udp;
     };
     ack_fn ack;
+    struct tnl_service_latency_s *latency;
+    uint64_t start_ns;
+};
+
+/** read packets from one queue of a multi-queue driver */
+extern void netif_shim_input_queue(struct netif *netif, netif_handle queue);
+
+/** limit the packets and time spent reading in a single input event. values <= 0 keep the current setting */
+extern void netif_shim_set_read_budget(int max_packets, int max_usec);
+
+extern void netif_shim_get_stats(tunnel_netif_stats *stats);
+
+/** receive buffers in the pool that received packets are read into, and how many of them are not in use */
+extern int netif_shim_rx_capacity(void);
+extern int netif_shim_rx_headroom(void);
+/** tcp payload that a receive buffer carries in a full-sized segment */
+extern int netif_shim_rx_payload(void);
+
+extern void tunneler_udp_get_service_stats(tunnel_udp_service_stats_array *stats);
+/** stop reporting the flow counts of a service that is no longer intercepted, once its last flow is gone */
+extern void tunneler_udp_remove_service(const char *service_name);
+
+#define TNL_HIST_SUB_BUCKET_BITS 3
+#define TNL_HIST_SUB_BUCKETS (1 << TNL_HIST_SUB_BUCKET_BITS)
+#define TNL_HIST_BUCKETS (32 * TNL_HIST_SUB_BUCKETS) // microseconds up to ~9 hours
+
+typedef enum {
+    tnl_stage_dial,       // SYN (or first datagram) received -> ziti_tunneler_dial_completed
+    tnl_stage_handshake,  // SYN/ACK sent -> client ACK
+    tnl_stage_ziti_write, // client data handed to ziti_write -> ziti_tunneler_ack
+    tnl_stage_client_ack, // ziti data written to the client -> client ACK
+    tnl_stage_count
+} tnl_latency_stage;
+
+struct tnl_histogram_s {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[TNL_HIST_BUCKETS];
 };
 
+struct tnl_service_latency_s {
+    struct tnl_histogram_s stages[tnl_stage_count];
+    int refs; // the service map, connections and in-flight writes that record into the histograms
+};
+
+/** returns the histograms for a service, with a reference that the caller drops with tnl_latency_release */
+extern struct tnl_service_latency_s *tnl_latency_for_service(const char *service_name);
+extern struct tnl_service_latency_s *tnl_latency_acquire(struct tnl_service_latency_s *latency);
+extern void tnl_latency_release(struct tnl_service_latency_s *latency);
+/** stop reporting a service. its histograms are freed when the last reference to them is released */
+extern void tnl_latency_remove_service(const char *service_name);
+/** record the time elapsed since `start_ns` (from uv_hrtime). nothing is recorded if `latency` is null or `start_ns` is 0 */
+extern void tnl_latency_record(struct tnl_service_latency_s *latency, tnl_latency_stage stage, uint64_t start_ns);
+extern void tnl_latency_get_stats(tunnel_service_latency_array *stats);
+
 extern int add_route(netif_driver tun, address_t *dest);
 
 extern int delete_route(netif_driver tun, address_t *dest);
@@ -0,0 +1,183 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <ziti/ziti_log.h>
+
+#include "offload.h"
+
+#define MAX_PACKET 0xffff
+#define UDP_HDR_LEN 8
+
+struct tun_gso_s {
+    uint8_t pkt[MAX_PACKET];
+    size_t len;
+    size_t l4_off;     // offset of the udp header
+    size_t gso_size;   // payload bytes per datagram
+    size_t next;       // offset of the next payload chunk
+    uint16_t ip_id;
+};
+
+static inline uint16_t get16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline void put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, size_t len) {
+    while (len > 1) {
+        sum += get16(p);
+        p += 2;
+        len -= 2;
+    }
+    if (len > 0) {
+        sum += p[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t) ~sum;
+}
+
+static void ip4_set_csum(uint8_t *ip) {
+    size_t hlen = (ip[0] & 0x0f) * 4;
+    put16(ip + 10, 0);
+    put16(ip + 10, csum_fold(csum_add(0, ip, hlen)));
+}
+
+/* fill in a checksum that the kernel left partial (seeded with the pseudo-header sum) */
+static void complete_csum(uint8_t *pkt, size_t len, const struct virtio_net_hdr *hdr) {
+    size_t start = hdr->csum_start;
+    size_t off = start + hdr->csum_offset;
+    if (off + 2 > len) {
+        return;
+    }
+    put16(pkt + off, csum_fold(csum_add(0, pkt + start, len - start)));
+}
+
+tun_gso *tun_gso_new(void) {
+    return calloc(1, sizeof(tun_gso));
+}
+
+void tun_gso_free(tun_gso *gso) {
+    free(gso);
+}
+
+bool tun_gso_pending(const tun_gso *gso) {
+    return gso != NULL && gso->next < gso->len;
+}
+
+int tun_gso_drain(tun_gso *gso, uv_buf_t *bufs, int nbufs) {
+    int count = 0;
+    size_t hlen = gso->l4_off + UDP_HDR_LEN;
+    bool ip4 = (gso->pkt[0] >> 4) == 4;
+
+    while (count < nbufs && tun_gso_pending(gso)) {
+        size_t plen = gso->len - gso->next;
+        if (plen > gso->gso_size) plen = gso->gso_size;
+        size_t seg_len = hlen + plen;
+
+        uv_buf_t *b = &bufs[count++];
+        if (seg_len > b->len) {
+            // report the size so the caller can grow its buffers
+            b->len = seg_len;
+            gso->next += plen;
+            continue;
+        }
+
+        uint8_t *seg = (uint8_t *) b->base;
+        memcpy(seg, gso->pkt, hlen);
+        memcpy(seg + hlen, gso->pkt + gso->next, plen);
+        gso->next += plen;
+
+        uint8_t *udp = seg + gso->l4_off;
+        uint32_t sum;
+        if (ip4) {
+            put16(seg + 2, (uint16_t) seg_len);
+            put16(seg + 4, gso->ip_id++);
+            ip4_set_csum(seg);
+            sum = csum_add(0, seg + 12, 8);
+        } else {
+            put16(seg + 4, (uint16_t) (seg_len - 40));
+            sum = csum_add(0, seg + 8, 32);
+        }
+        put16(udp + 4, (uint16_t) (UDP_HDR_LEN + plen));
+        put16(udp + 6, 0);
+        sum += IPPROTO_UDP + UDP_HDR_LEN + plen;
+        uint16_t csum = csum_fold(csum_add(sum, udp, UDP_HDR_LEN + plen));
+        put16(udp + 6, csum == 0 ? 0xffff : csum);
+
+        b->len = seg_len;
+    }
+    return count;
+}
+
+int tun_vnet_rx(const struct virtio_net_hdr *hdr, uv_buf_t *bufs, int nbufs, tun_gso *gso) {
+    uint8_t *pkt = (uint8_t *) bufs[0].base;
+    size_t len = bufs[0].len;
+    uint8_t gso_type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+    switch (gso_type) {
+        case VIRTIO_NET_HDR_GSO_NONE:
+            if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+                complete_csum(pkt, len, hdr);
+            }
+            return 1;
+
+        case VIRTIO_NET_HDR_GSO_TCPV4:
+        case VIRTIO_NET_HDR_GSO_TCPV6:
+            if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+                complete_csum(pkt, len, hdr);
+            }
+            if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4) {
+                put16(pkt + 2, (uint16_t) len);
+                ip4_set_csum(pkt);
+            } else {
+                put16(pkt + 4, (uint16_t) (len - 40));
+            }
+            return 1;
+
+#ifdef VIRTIO_NET_HDR_GSO_UDP_L4
+        case VIRTIO_NET_HDR_GSO_UDP_L4: {
+            if (gso == NULL || hdr->gso_size == 0 || hdr->csum_start + UDP_HDR_LEN > len) {
+                return 0;
+            }
+            memcpy(gso->pkt, pkt, len);
+            gso->len = len;
+            gso->l4_off = hdr->csum_start;
+            gso->gso_size = hdr->gso_size;
+            gso->next = gso->l4_off + UDP_HDR_LEN;
+            gso->ip_id = get16(pkt + 4);
+            return tun_gso_drain(gso, bufs, nbufs);
+        }
+#endif
+
+        default:
+            ZITI_LOG(DEBUG, "dropping packet with unsupported gso_type %d", hdr->gso_type);
+            return 0;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef ZITI_TUNNELER_SDK_TUN_OFFLOAD_H
+#define ZITI_TUNNELER_SDK_TUN_OFFLOAD_H
+
+#include <stdbool.h>
+#include <linux/virtio_net.h>
+#include <uv.h>
+
+/** segments of a UDP super-packet that did not fit in the caller's buffers */
+typedef struct tun_gso_s tun_gso;
+
+tun_gso *tun_gso_new(void);
+void tun_gso_free(tun_gso *gso);
+bool tun_gso_pending(const tun_gso *gso);
+
+/** copy pending segments into `bufs`. returns the number of buffers filled */
+int tun_gso_drain(tun_gso *gso, uv_buf_t *bufs, int nbufs);
+
+/**
+ * process a packet that was read with a virtio_net_hdr into `bufs[0]`: complete partial checksums, and split
+ * UDP super-packets into datagrams (using `bufs[1..nbufs-1]` and `gso` for the overflow).
+ * TCP super-segments are passed through whole, since lwip accepts segments larger than its MSS.
+ * returns the number of buffers filled, or 0 if the packet was dropped.
+ */
+int tun_vnet_rx(const struct virtio_net_hdr *hdr, uv_buf_t *bufs, int nbufs, tun_gso *gso);
+
+#endif //ZITI_TUNNELER_SDK_TUN_OFFLOAD_H
@@ -16,11 +16,13 @@
 
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 //#include <linux/if.h>
 #include <linux/if_tun.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
@@ -30,9 +32,13 @@
 #include <ziti/ziti_log.h>
 #include <ziti/ziti_dns.h>
 
+#include "offload.h"
 #include "resolvers.h"
 #include "tun.h"
 #include "utils.h"
+#if HAVE_LIBURING
+#include "tun_uring.h"
+#endif
 
 #ifndef DEVTUN
 #define DEVTUN "/dev/net/tun"
@@ -74,6 +80,21 @@ static int tun_close(struct netif_handle_s *tun) {
         return 0;
     }
 
+#if HAVE_LIBURING
+    tun_uring_close(tun);
+#endif
+
+    for (int i = 1; i < tun->num_queues; i++) {
+        if (tun->queues[i] != NULL) {
+            close(tun->queues[i]->fd);
+            tun_gso_free(tun->queues[i]->gso);
+            free(tun->queues[i]->rx_spill);
+            free(tun->queues[i]);
+        }
+    }
+    tun_gso_free(tun->gso);
+    free(tun->rx_spill);
+
     if (tun->fd > 0) {
         r = close(tun->fd);
     }
@@ -82,14 +103,145 @@ static int tun_close(struct netif_handle_s *tun) {
     return r;
 }
 
+static int tun_queue_count(netif_handle tun) {
+    return tun->num_queues;
+}
+
+static netif_handle tun_get_queue(netif_handle tun, int queue) {
+    if (queue < 0 || queue >= tun->num_queues) {
+        return NULL;
+    }
+    return tun->queues[queue];
+}
+
+/* max buffers in a gathered write, including the vnet header */
+#define TUN_MAX_IOV 64
+
+static int tun_read_batch(netif_handle tun, uv_buf_t *bufs, int nbufs);
+
+static const struct virtio_net_hdr tx_vnet_hdr = {
+    .gso_type = VIRTIO_NET_HDR_GSO_NONE,
+};
+
 ssize_t tun_read(netif_handle tun, void *buf, size_t len) {
+    if (tun->vnet_hdr) {
+        uv_buf_t b = uv_buf_init(buf, len);
+        int n = tun_read_batch(tun, &b, 1);
+        return n == 1 ? (ssize_t) b.len : n;
+    }
     return read(tun->fd, buf, len);
 }
 
 ssize_t tun_write(netif_handle tun, const void *buf, size_t len) {
+    if (tun->vnet_hdr) {
+        struct iovec iov[2] = {
+            { .iov_base = (void *) &tx_vnet_hdr, .iov_len = sizeof(tx_vnet_hdr) },
+            { .iov_base = (void *) buf, .iov_len = len },
+        };
+        ssize_t nw = writev(tun->fd, iov, 2);
+        return nw > 0 ? nw - (ssize_t) sizeof(tx_vnet_hdr) : nw;
+    }
     return write(tun->fd, buf, len);
 }
 
+/* uv_buf_t is layout-compatible with struct iovec on unix */
+static ssize_t tun_writev(netif_handle tun, const uv_buf_t *bufs, int nbufs) {
+    if (tun->vnet_hdr) {
+        struct iovec iov[TUN_MAX_IOV];
+        if (nbufs >= TUN_MAX_IOV) {
+            return -EMSGSIZE;
+        }
+        iov[0].iov_base = (void *) &tx_vnet_hdr;
+        iov[0].iov_len = sizeof(tx_vnet_hdr);
+        memcpy(iov + 1, bufs, nbufs * sizeof(struct iovec));
+        ssize_t nw = writev(tun->fd, iov, nbufs + 1);
+        return nw > 0 ? nw - (ssize_t) sizeof(tx_vnet_hdr) : nw;
+    }
+    return writev(tun->fd, (const struct iovec *) bufs, nbufs);
+}
+
+/**
+ * the tun character device delivers exactly one packet per read(2), so a batch is a run of reads on the
+ * (non-blocking) fd that stops as soon as the queue is empty.
+ * with IFF_VNET_HDR a read can return a super-packet that is split into several buffers. the part of a super-packet
+ * that does not fit the caller's buffer is read into the spill buffer, and the packet is returned from there. the
+ * batch ends with it, since the spill buffer is reused by the next read.
+ */
+static int tun_read_batch(netif_handle tun, uv_buf_t *bufs, int nbufs) {
+    int count = 0;
+    if (tun_gso_pending(tun->gso)) {
+        count = tun_gso_drain(tun->gso, bufs, nbufs);
+    }
+
+    while (count < nbufs) {
+        struct virtio_net_hdr hdr;
+        size_t cap = bufs[count].len;
+        struct iovec iov[3] = {
+            { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+            { .iov_base = bufs[count].base, .iov_len = cap },
+        };
+        int iovcnt = 2;
+        if (tun->rx_spill != NULL && cap < TUN_RX_SPILL_SIZE) {
+            iov[2].iov_base = tun->rx_spill + cap;
+            iov[2].iov_len = TUN_RX_SPILL_SIZE - cap;
+            iovcnt = 3;
+        }
+        ssize_t nr = tun->vnet_hdr ? readv(tun->fd, iov, iovcnt) : readv(tun->fd, iov + 1, 1);
+        if (nr < 0) {
+            if (errno == EINTR) continue;
+            if (count == 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -errno;
+            }
+            break;
+        }
+        if (tun->vnet_hdr) {
+            nr -= (ssize_t) sizeof(hdr);
+        }
+        if (nr <= 0) {
+            break;
+        }
+
+        uv_buf_t head = bufs[count];
+        bool spilled = iovcnt == 3 && (size_t) nr > cap;
+        if (spilled) {
+            // move the head of the packet next to the rest of it
+            memcpy(tun->rx_spill, bufs[count].base, cap);
+            bufs[count].base = (char *) tun->rx_spill;
+        }
+        bufs[count].len = (size_t) nr;
+        if (tun->vnet_hdr && (spilled || (size_t) nr <= cap)) {
+            int n = tun_vnet_rx(&hdr, bufs + count, nbufs - count, tun->gso);
+            if (n == 0) {
+                bufs[count] = head; // dropped, so the buffer is still free
+                spilled = false;
+            }
+            count += n;
+        } else {
+            count++;
+        }
+        if (spilled) {
+            break;
+        }
+    }
+    return count;
+}
+
+static int tun_write_batch(netif_handle tun, const uv_buf_t *bufs, int nbufs) {
+    int count = 0;
+    while (count < nbufs) {
+        ssize_t nw = tun_write(tun, bufs[count].base, bufs[count].len);
+        if (nw < 0) {
+            if (errno == EINTR) continue;
+            if (count == 0) {
+                return -errno;
+            }
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
 int tun_uv_poll_init(netif_handle tun, uv_loop_t *loop, uv_poll_t *tun_poll_req) {
     return uv_poll_init(loop, tun_poll_req, tun->fd);
 }
@@ -407,7 +559,37 @@ static const char *get_tun_name(netif_handle tun) {
     return tun->name;
 }
 
-netif_driver tun_open(uv_loop_t *loop, uint32_t tun_ip, uint32_t dns_ip, const char *dns_block, char *error, size_t error_len) {
+/**
+ * let the kernel pass TCP/UDP super-segments with partial checksums. the vnet header is always present once the
+ * device was created with IFF_VNET_HDR, even if the offload flags are not accepted.
+ * returns the offload flags that were accepted.
+ */
+static unsigned int enable_offload(struct netif_handle_s *tun) {
+    unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+#if defined(TUN_F_USO4) && defined(TUN_F_USO6)
+    if (ioctl(tun->fd, TUNSETOFFLOAD, offloads | TUN_F_USO4 | TUN_F_USO6) == 0) {
+        offloads |= TUN_F_USO4 | TUN_F_USO6;
+    } else
+#endif
+    if (ioctl(tun->fd, TUNSETOFFLOAD, offloads) < 0) {
+        ZITI_LOG(WARN, "failed to enable offload on %s: %s", tun->name, strerror(errno));
+        offloads = 0;
+    }
+    ZITI_LOG(INFO, "%s offload flags: 0x%x", tun->name, offloads);
+
+    for (int i = 0; i < tun->num_queues; i++) {
+        tun->queues[i]->vnet_hdr = true;
+        tun->queues[i]->gso = tun_gso_new();
+        if (offloads != 0 && (tun->queues[i]->rx_spill = malloc(TUN_RX_SPILL_SIZE)) == NULL) {
+            ZITI_LOG(WARN, "failed to allocate spill buffer for %s, disabling offload", tun->name);
+            ioctl(tun->fd, TUNSETOFFLOAD, 0);
+            offloads = 0;
+        }
+    }
+    return offloads;
+}
+
+netif_driver tun_open(uv_loop_t *loop, uint32_t tun_ip, uint32_t dns_ip, const char *dns_block, const tun_opts *opts, char *error, size_t error_len) {
     if (error != NULL) {
         memset(error, 0, error_len * sizeof(char));
     }
@@ -428,8 +610,20 @@ netif_driver tun_open(uv_loop_t *loop, uint32_t tun_ip, uint32_t dns_ip, const c
         return NULL;
     }
 
+    int queues = opts != NULL && opts->queues > 1 ? opts->queues : 1;
+    if (queues > TUN_MAX_QUEUES) {
+        ZITI_LOG(WARN, "limiting tun queues to %d", TUN_MAX_QUEUES);
+        queues = TUN_MAX_QUEUES;
+    }
+
     struct ifreq ifr = { .ifr_name = "ziti%d",
                          .ifr_flags = IFF_TUN | IFF_NO_PI };
+    if (queues > 1) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+    if (opts != NULL && opts->offload) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
 
     if (ioctl(tun->fd, TUNSETIFF, &ifr) < 0) {
         if (error != NULL) {
@@ -440,6 +634,34 @@ netif_driver tun_open(uv_loop_t *loop, uint32_t tun_ip, uint32_t dns_ip, const c
     }
 
     strncpy(tun->name, ifr.ifr_name, sizeof(tun->name));
+    tun->queues[0] = tun;
+    tun->num_queues = 1;
+
+    // attach the remaining queues to the device that was just created
+    while (tun->num_queues < queues) {
+        struct netif_handle_s *q = calloc(1, sizeof(struct netif_handle_s));
+        if (q == NULL || (q->fd = open(DEVTUN, O_RDWR|O_CLOEXEC)) < 0 || ioctl(q->fd, TUNSETIFF, &ifr) < 0) {
+            if (error != NULL) {
+                snprintf(error, error_len, "failed to open tun queue %d:%s", tun->num_queues, strerror(errno));
+            }
+            if (q != NULL && q->fd > 0) close(q->fd);
+            free(q);
+            tun_close(tun);
+            return NULL;
+        }
+        strncpy(q->name, tun->name, sizeof(q->name));
+        q->queues[0] = q;
+        q->num_queues = 1;
+        tun->queues[tun->num_queues++] = q;
+    }
+    if (queues > 1) {
+        ZITI_LOG(INFO, "opened %s with %d queues", tun->name, tun->num_queues);
+    }
+
+    unsigned int offloads = 0;
+    if (ifr.ifr_flags & IFF_VNET_HDR) {
+        offloads = enable_offload(tun);
+    }
 
     struct netif_driver_s *driver = calloc(1, sizeof(struct netif_driver_s));
     if (driver == NULL) {
@@ -453,13 +675,37 @@ netif_driver tun_open(uv_loop_t *loop, uint32_t tun_ip, uint32_t dns_ip, const c
     driver->handle       = tun;
     driver->read         = tun_read;
     driver->write        = tun_write;
+    driver->writev       = tun_writev;
+    driver->read_batch   = tun_read_batch;
+    driver->write_batch  = tun_write_batch;
     driver->uv_poll_init = tun_uv_poll_init;
+    driver->queue_count  = tun_queue_count;
+    driver->get_queue    = tun_get_queue;
     driver->add_route    = tun_add_route;
     driver->delete_route = tun_delete_route;
     driver->close        = tun_close;
     driver->exclude_rt   = tun_exclude_rt;
     driver->commit_routes = tun_commit_routes;
     driver->get_name = get_tun_name;
+    if (offloads & (TUN_F_TSO4 | TUN_F_TSO6)) {
+        // super-segments are returned from the spill buffer, so the shim only reads into mtu-sized buffers
+        driver->max_packet_size = TUN_RX_SPILL_SIZE;
+    }
+
+    if (opts != NULL && opts->io_uring) {
+#if HAVE_LIBURING
+        if (tun_uring_init(tun, driver, error, error_len) != 0) {
+            free(driver);
+            tun_close(tun);
+            return NULL;
+        }
+#else
+        snprintf(error, error_len, "io_uring support is not available in this build");
+        free(driver);
+        tun_close(tun);
+        return NULL;
+#endif
+    }
 
     __attribute__((cleanup(cleanup_sock))) int netdev = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
     if (netdev == -1) {
@@ -18,16 +18,40 @@
 #define ZITI_TUNNELER_SDK_TUN_H
 
 //#include <linux/if.h>
+#include <stdbool.h>
 #include <net/if.h>
 #include "ziti/netif_driver.h"
 
+/** max number of queues opened on an IFF_MULTI_QUEUE device */
+#define TUN_MAX_QUEUES 16
+
+/** size of the buffer that holds a super-segment that does not fit the caller's buffer */
+#define TUN_RX_SPILL_SIZE 0xffff
+
+typedef struct tun_opts_s {
+    int queues; // open the device with IFF_MULTI_QUEUE and this many queues. 0 or 1 opens a single-queue device
+    bool offload; // enable IFF_VNET_HDR and TSO/USO so the kernel can pass super-segments
+    bool io_uring; // use io_uring instead of poll + read/write. requires a build with liburing
+} tun_opts;
+
 struct netif_handle_s {
     int  fd;
     char name[IFNAMSIZ];
 
     model_map *route_updates;
+
+    // queues[0] is this handle. additional queues share the device but have their own fd
+    int num_queues;
+    struct netif_handle_s *queues[TUN_MAX_QUEUES];
+
+    // packets are prefixed with a virtio_net_hdr
+    bool vnet_hdr;
+    struct tun_gso_s *gso;
+    uint8_t *rx_spill; // a super-segment is returned from here, so reads only need mtu-sized buffers
+
+    struct tun_uring_s *uring;
 };
 
-extern netif_driver tun_open(struct uv_loop_s *loop, uint32_t tun_ip, uint32_t dns_ip, const char *cidr, char *error, size_t error_len);
+extern netif_driver tun_open(struct uv_loop_s *loop, uint32_t tun_ip, uint32_t dns_ip, const char *cidr, const tun_opts *opts, char *error, size_t error_len);
 
 #endif //ZITI_TUNNELER_SDK_TUN_H
@@ -0,0 +1,350 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <liburing.h>
+
+#include <ziti/model_collections.h>
+#include <ziti/ziti_log.h>
+
+#include "offload.h"
+#include "tun_uring.h"
+
+/* reads kept in flight per queue */
+#define URING_RX_DEPTH 64
+/* writes in flight per queue. packets are written synchronously when all tx buffers are busy */
+#define URING_TX_DEPTH 256
+
+#define VNET_HDR_LEN sizeof(struct virtio_net_hdr)
+#define URING_RX_BUF_SIZE (0xffff + VNET_HDR_LEN)
+#define URING_TX_BUF_SIZE 2048
+
+#define TX_FLAG (1ULL << 63)
+
+struct tun_uring_s {
+    struct io_uring ring;
+    int efd;
+    uint8_t *rx_mem;
+    uint8_t *tx_mem;
+    int tx_free[URING_TX_DEPTH];
+    int tx_free_count;
+};
+
+static inline uint8_t *rx_buf(struct tun_uring_s *u, int i) {
+    return u->rx_mem + (size_t) i * URING_RX_BUF_SIZE;
+}
+
+static inline uint8_t *tx_buf(struct tun_uring_s *u, int i) {
+    return u->tx_mem + (size_t) i * URING_TX_BUF_SIZE;
+}
+
+static struct io_uring_sqe *get_sqe(struct tun_uring_s *u) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+    if (sqe == NULL) {
+        io_uring_submit(&u->ring);
+        sqe = io_uring_get_sqe(&u->ring);
+    }
+    return sqe;
+}
+
+static void queue_read(netif_handle tun, int i) {
+    struct tun_uring_s *u = tun->uring;
+    struct io_uring_sqe *sqe = get_sqe(u);
+    if (sqe == NULL) {
+        ZITI_LOG(ERROR, "%s: no submission entry for read", tun->name);
+        return;
+    }
+    io_uring_prep_read_fixed(sqe, tun->fd, rx_buf(u, i), URING_RX_BUF_SIZE, 0, i);
+    io_uring_sqe_set_data(sqe, (void *) (uintptr_t) i);
+}
+
+/* copy a completed read into the caller's buffers. returns the number of buffers filled */
+static int deliver(netif_handle tun, const uint8_t *data, size_t len, uv_buf_t *bufs, int nbufs) {
+    struct virtio_net_hdr hdr;
+    if (tun->vnet_hdr) {
+        if (len < VNET_HDR_LEN) {
+            return 0;
+        }
+        memcpy(&hdr, data, VNET_HDR_LEN);
+        data += VNET_HDR_LEN;
+        len -= VNET_HDR_LEN;
+    }
+
+    if (len > bufs[0].len) {
+        if (tun->rx_spill == NULL || len > TUN_RX_SPILL_SIZE) {
+            bufs[0].len = len; // truncated, let the caller grow its buffers
+            return 1;
+        }
+        // the read buffer is requeued right away, so a super-segment is returned from the spill buffer
+        bufs[0].base = (char *) tun->rx_spill;
+    }
+    memcpy(bufs[0].base, data, len);
+    bufs[0].len = len;
+
+    return tun->vnet_hdr ? tun_vnet_rx(&hdr, bufs, nbufs, tun->gso) : 1;
+}
+
+static int uring_read_batch(netif_handle tun, uv_buf_t *bufs, int nbufs) {
+    struct tun_uring_s *u = tun->uring;
+    eventfd_t events;
+    eventfd_read(u->efd, &events);
+
+    int count = 0;
+    if (tun_gso_pending(tun->gso)) {
+        count = tun_gso_drain(tun->gso, bufs, nbufs);
+    }
+
+    int requeued = 0;
+    struct io_uring_cqe *cqe;
+    while (count < nbufs && io_uring_peek_cqe(&u->ring, &cqe) == 0) {
+        uint64_t data = (uint64_t) (uintptr_t) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&u->ring, cqe);
+
+        if (data & TX_FLAG) {
+            if (res < 0) {
+                ZITI_LOG(DEBUG, "%s: write failed: %s", tun->name, strerror(-res));
+            }
+            u->tx_free[u->tx_free_count++] = (int) (data & ~TX_FLAG);
+            continue;
+        }
+
+        int i = (int) data;
+        bool spilled = false;
+        if (res > 0) {
+            uv_buf_t head = bufs[count];
+            int n = deliver(tun, rx_buf(u, i), (size_t) res, bufs + count, nbufs - count);
+            if (n == 0) {
+                bufs[count] = head; // dropped, so the buffer is still free
+            }
+            spilled = n > 0 && bufs[count].base != head.base;
+            count += n;
+        } else if (res < 0 && res != -EAGAIN && res != -EINTR) {
+            ZITI_LOG(WARN, "%s: read failed: %s", tun->name, strerror(-res));
+        }
+        queue_read(tun, i);
+        requeued++;
+        if (spilled) {
+            break; // the spill buffer is reused by the next completion
+        }
+    }
+
+    if (requeued > 0) {
+        io_uring_submit(&u->ring);
+    }
+
+    // completions that did not fit in this batch will not signal the eventfd again
+    if (io_uring_cq_ready(&u->ring) > 0) {
+        eventfd_write(u->efd, 1);
+    }
+    return count;
+}
+
+static ssize_t uring_read(netif_handle tun, void *buf, size_t len) {
+    uv_buf_t b = uv_buf_init(buf, len);
+    int n = uring_read_batch(tun, &b, 1);
+    return n == 1 ? (ssize_t) b.len : n;
+}
+
+/* write one packet gathered from `bufs`. the tx buffer is released when the write completes */
+static ssize_t uring_queue_write(netif_handle tun, const uv_buf_t *bufs, int nbufs, bool *queued) {
+    struct tun_uring_s *u = tun->uring;
+    size_t hdr_len = tun->vnet_hdr ? VNET_HDR_LEN : 0;
+    size_t len = 0;
+    for (int i = 0; i < nbufs; i++) {
+        len += bufs[i].len;
+    }
+
+    *queued = false;
+    struct io_uring_sqe *sqe = NULL;
+    if (u->tx_free_count > 0 && hdr_len + len <= URING_TX_BUF_SIZE) {
+        sqe = get_sqe(u);
+    }
+
+    if (sqe == NULL) {
+        // oversized packet or all tx buffers busy
+        struct virtio_net_hdr hdr = { .gso_type = VIRTIO_NET_HDR_GSO_NONE };
+        struct iovec iov[nbufs + 1];
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = hdr_len;
+        memcpy(iov + 1, bufs, nbufs * sizeof(struct iovec));
+        ssize_t nw = hdr_len ? writev(tun->fd, iov, nbufs + 1) : writev(tun->fd, iov + 1, nbufs);
+        return nw > 0 ? nw - (ssize_t) hdr_len : -errno;
+    }
+
+    int t = u->tx_free[--u->tx_free_count];
+    uint8_t *b = tx_buf(u, t);
+    memset(b, 0, hdr_len);
+    size_t off = hdr_len;
+    for (int i = 0; i < nbufs; i++) {
+        memcpy(b + off, bufs[i].base, bufs[i].len);
+        off += bufs[i].len;
+    }
+
+    io_uring_prep_write_fixed(sqe, tun->fd, b, off, 0, URING_RX_DEPTH + t);
+    io_uring_sqe_set_data(sqe, (void *) (uintptr_t) (TX_FLAG | t));
+    *queued = true;
+    return (ssize_t) len;
+}
+
+static int uring_write_batch(netif_handle tun, const uv_buf_t *bufs, int nbufs) {
+    int count = 0;
+    int queued_count = 0;
+    for (; count < nbufs; count++) {
+        bool queued;
+        ssize_t rc = uring_queue_write(tun, &bufs[count], 1, &queued);
+        if (rc < 0) {
+            ZITI_LOG(DEBUG, "%s: write failed: %s", tun->name, strerror((int) -rc));
+        }
+        queued_count += queued;
+    }
+
+    if (queued_count > 0) {
+        io_uring_submit(&tun->uring->ring);
+    }
+    return count;
+}
+
+static ssize_t uring_write(netif_handle tun, const void *buf, size_t len) {
+    uv_buf_t b = uv_buf_init((char *) buf, len);
+    return uring_write_batch(tun, &b, 1) == 1 ? (ssize_t) len : -1;
+}
+
+static ssize_t uring_writev(netif_handle tun, const uv_buf_t *bufs, int nbufs) {
+    bool queued;
+    ssize_t rc = uring_queue_write(tun, bufs, nbufs, &queued);
+    if (queued) {
+        io_uring_submit(&tun->uring->ring);
+    }
+    return rc;
+}
+
+static int uring_uv_poll_init(netif_handle tun, uv_loop_t *loop, uv_poll_t *tun_poll_req) {
+    return uv_poll_init(loop, tun_poll_req, tun->uring->efd);
+}
+
+static void uring_free(struct tun_uring_s *u) {
+    if (u == NULL) {
+        return;
+    }
+    if (u->ring.ring_fd > 0) {
+        io_uring_queue_exit(&u->ring);
+    }
+    if (u->efd > 0) {
+        close(u->efd);
+    }
+    free(u->rx_mem);
+    free(u->tx_mem);
+    free(u);
+}
+
+static int uring_open(netif_handle tun, char *error, size_t error_len) {
+    struct tun_uring_s *u = calloc(1, sizeof(struct tun_uring_s));
+    struct iovec iov[URING_RX_DEPTH + URING_TX_DEPTH];
+    int rc;
+
+    if (u == NULL) {
+        snprintf(error, error_len, "failed to allocate io_uring resources");
+        return -1;
+    }
+
+    u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    u->rx_mem = malloc((size_t) URING_RX_DEPTH * URING_RX_BUF_SIZE);
+    u->tx_mem = malloc((size_t) URING_TX_DEPTH * URING_TX_BUF_SIZE);
+    if (u->efd < 0 || u->rx_mem == NULL || u->tx_mem == NULL) {
+        snprintf(error, error_len, "failed to allocate io_uring resources");
+        uring_free(u);
+        return -1;
+    }
+
+    if ((rc = io_uring_queue_init(URING_RX_DEPTH + URING_TX_DEPTH, &u->ring, 0)) < 0) {
+        snprintf(error, error_len, "io_uring_queue_init failed: %s", strerror(-rc));
+        u->ring.ring_fd = -1;
+        uring_free(u);
+        return -1;
+    }
+    // reads of the non-blocking tun fd are only poll-armed by the kernel with fast poll. without it they would
+    // complete with EAGAIN and be resubmitted in a loop
+    if (!(u->ring.features & IORING_FEAT_FAST_POLL)) {
+        snprintf(error, error_len, "io_uring fast poll is not supported by this kernel");
+        uring_free(u);
+        return -1;
+    }
+
+    for (int i = 0; i < URING_RX_DEPTH; i++) {
+        iov[i].iov_base = rx_buf(u, i);
+        iov[i].iov_len = URING_RX_BUF_SIZE;
+    }
+    for (int i = 0; i < URING_TX_DEPTH; i++) {
+        iov[URING_RX_DEPTH + i].iov_base = tx_buf(u, i);
+        iov[URING_RX_DEPTH + i].iov_len = URING_TX_BUF_SIZE;
+        u->tx_free[u->tx_free_count++] = URING_TX_DEPTH - 1 - i;
+    }
+
+    if ((rc = io_uring_register_buffers(&u->ring, iov, URING_RX_DEPTH + URING_TX_DEPTH)) < 0 ||
+        (rc = io_uring_register_eventfd(&u->ring, u->efd)) < 0) {
+        snprintf(error, error_len, "io_uring setup failed: %s", strerror(-rc));
+        uring_free(u);
+        return -1;
+    }
+
+    // keep the tun fd non-blocking, so io_uring arms a poll for reads instead of punting them to io-wq workers
+    int flags = fcntl(tun->fd, F_GETFL);
+    if (flags >= 0 && !(flags & O_NONBLOCK)) {
+        fcntl(tun->fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    tun->uring = u;
+    for (int i = 0; i < URING_RX_DEPTH; i++) {
+        queue_read(tun, i);
+    }
+    io_uring_submit(&u->ring);
+    return 0;
+}
+
+int tun_uring_init(struct netif_handle_s *tun, struct netif_driver_s *driver, char *error, size_t error_len) {
+    for (int i = 0; i < tun->num_queues; i++) {
+        if (uring_open(tun->queues[i], error, error_len) != 0) {
+            tun_uring_close(tun);
+            return -1;
+        }
+    }
+
+    driver->read         = uring_read;
+    driver->write        = uring_write;
+    driver->writev       = uring_writev;
+    driver->read_batch   = uring_read_batch;
+    driver->write_batch  = uring_write_batch;
+    driver->uv_poll_init = uring_uv_poll_init;
+
+    ZITI_LOG(INFO, "%s: using io_uring with %d reads in flight per queue", tun->name, URING_RX_DEPTH);
+    return 0;
+}
+
+void tun_uring_close(struct netif_handle_s *tun) {
+    for (int i = 0; i < tun->num_queues; i++) {
+        uring_free(tun->queues[i]->uring);
+        tun->queues[i]->uring = NULL;
+    }
+}
@@ -0,0 +1,32 @@
+/*
+ Copyright NetFoundry Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ https://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef ZITI_TUNNELER_SDK_TUN_URING_H
+#define ZITI_TUNNELER_SDK_TUN_URING_H
+
+#include <stddef.h>
+#include "tun.h"
+
+/**
+ * switch an open tun device (and all of its queues) to io_uring i/o. reads are kept in flight in registered
+ * buffers and completions are signalled to the uv loop through an eventfd.
+ * returns 0 on success, or -1 with `error` set; the driver is left unchanged on failure.
+ */
+int tun_uring_init(struct netif_handle_s *tun, struct netif_driver_s *driver, char *error, size_t error_len);
+
+void tun_uring_close(struct netif_handle_s *tun);
+
+#endif //ZITI_TUNNELER_SDK_TUN_URING_H
@@ -129,6 +129,17 @@ static char *configured_cidr = NULL;
 static char *configured_log_level = NULL;
 static char *configured_proxy = NULL;
 static char *ipc_discriminator = NULL;
+static int netif_read_max_packets = 0;
+static int netif_read_max_usec = 0;
+static int max_tcp_connections = 0;
+static int max_udp_connections = 0;
+static int max_pool_pbufs = 0;
+static int max_udp_service_connections = 0;
+static int udp_queue_bytes = 0;
+static udp_drop_policy_e udp_drop_policy = UDP_DROP_TAIL;
+#if __linux__
+static tun_opts linux_tun_opts;
+#endif
 
 //timer
 static uv_timer_t metrics_timer;
@@ -858,7 +869,7 @@ static int run_tunnel(uv_loop_t *ziti_loop, uint32_t tun_ip, uint32_t dns_ip, co
 #if __APPLE__ && __MACH__
     tun = utun_open(tun_error, sizeof(tun_error), ip_range);
 #elif __linux__
-    tun = tun_open(ziti_loop, tun_ip, dns_ip, dns_subnet, tun_error, sizeof(tun_error));
+    tun = tun_open(ziti_loop, tun_ip, dns_ip, dns_subnet, &linux_tun_opts, tun_error, sizeof(tun_error));
 #elif _WIN32
     tun = tun_open(ziti_loop, tun_ip, dns_subnet, tun_error, sizeof(tun_error));
 #else
@@ -1112,8 +1123,16 @@ static tunneler_context initialize_tunneler(netif_driver tun, uv_loop_t* ziti_lo
             .ziti_close = ziti_sdk_c_close,
             .ziti_close_write = ziti_sdk_c_close_write,
             .ziti_write = ziti_sdk_c_write,
-            .ziti_host = ziti_sdk_c_host
-
+            .ziti_writev = ziti_sdk_c_writev,
+            .ziti_host = ziti_sdk_c_host,
+            .netif_read_max_packets = netif_read_max_packets,
+            .netif_read_max_usec = netif_read_max_usec,
+            .max_tcp_connections = max_tcp_connections,
+            .max_udp_connections = max_udp_connections,
+            .max_pool_pbufs = max_pool_pbufs,
+            .max_udp_service_connections = max_udp_service_connections,
+            .udp_queue_bytes = udp_queue_bytes,
+            .udp_drop_policy = udp_drop_policy,
     };
 
     if (is_host_only()) {
@@ -1163,9 +1182,16 @@ static struct option run_options[] = {
         { "dns-ip-range", required_argument, NULL, 'd'},
         { "dns-upstream", required_argument, NULL, 'u'},
         { "proxy", required_argument, NULL, 'x' },
+        { "read-budget", required_argument, NULL, 'B' },
+        { "conn-limits", required_argument, NULL, 'C' },
+        { "udp-queue", required_argument, NULL, 'q' },
+        { "udp-service-limit", required_argument, NULL, 'S' },
 #if __linux__
         { "diverter", required_argument, NULL, 'D' },
         { "diverter-fw", required_argument, NULL, 'f' },
+        { "tun-queues", required_argument, NULL, 'Q' },
+        { "tun-offload", no_argument, NULL, 'O' },
+        { "tun-io-uring", no_argument, NULL, 'U' },
 #endif
 };
 
@@ -1234,11 +1260,11 @@ static int run_opts(int argc, char *argv[]) {
     bool identity_provided = false;
 
 #if __linux__
-#define DIVERTER_SHORT_OPTS "D:f:"
+#define DIVERTER_SHORT_OPTS "D:f:Q:OU"
 #else
 #define DIVERTER_SHORT_OPTS ""
 #endif
-    while ((c = getopt_long(argc, argv, "i:I:v:r:d:u:x:"DIVERTER_SHORT_OPTS,
+    while ((c = getopt_long(argc, argv, "i:I:v:r:d:u:x:B:C:q:S:"DIVERTER_SHORT_OPTS,
                             run_options, &option_index)) != -1) {
         switch (c) {
 #if __linux__
@@ -1251,6 +1277,22 @@ static int run_opts(int argc, char *argv[]) {
                 firewall = true;
                 diverter_if = optarg;
                 break;
+            case 'Q': {
+                long queues = strtol(optarg, NULL, 10);
+                if (queues < 1 || queues > TUN_MAX_QUEUES) {
+                    fprintf(stderr, "--tun-queues must be between 1 and %d\n", TUN_MAX_QUEUES);
+                    errors++;
+                    break;
+                }
+                linux_tun_opts.queues = (int) queues;
+                break;
+            }
+            case 'O':
+                linux_tun_opts.offload = true;
+                break;
+            case 'U':
+                linux_tun_opts.io_uring = true;
+                break;
 #endif
             case 'i': {
                 struct cfg_instance_s *inst = calloc(1, sizeof(struct cfg_instance_s));
@@ -1286,6 +1328,58 @@ static int run_opts(int argc, char *argv[]) {
             case 'x':
                 configured_proxy = optarg;
                 break;
+            case 'B': { // packets[:usec]
+                char *end;
+                netif_read_max_packets = (int) strtol(optarg, &end, 10);
+                if (*end == ':') {
+                    netif_read_max_usec = (int) strtol(end + 1, &end, 10);
+                }
+                if (*end != '\0' || netif_read_max_packets < 0 || netif_read_max_usec < 0) {
+                    fprintf(stderr, "invalid read budget '%s', expected <packets>[:<usec>]\n", optarg);
+                    errors++;
+                }
+                break;
+            }
+            case 'C': { // tcp[:udp[:pbufs]]
+                char *end;
+                max_tcp_connections = (int) strtol(optarg, &end, 10);
+                if (*end == ':') {
+                    max_udp_connections = (int) strtol(end + 1, &end, 10);
+                }
+                if (*end == ':') {
+                    max_pool_pbufs = (int) strtol(end + 1, &end, 10);
+                }
+                if (*end != '\0' || max_tcp_connections < 0 || max_udp_connections < 0 || max_pool_pbufs < 0) {
+                    fprintf(stderr, "invalid connection limits '%s', expected <tcp>[:<udp>[:<pbufs>]]\n", optarg);
+                    errors++;
+                }
+                break;
+            }
+            case 'q': { // bytes[:head|tail]
+                char *end;
+                udp_queue_bytes = (int) strtol(optarg, &end, 10);
+                if (strcmp(end, ":head") == 0) {
+                    udp_drop_policy = UDP_DROP_HEAD;
+                } else if (strcmp(end, ":tail") == 0 || *end == '\0') {
+                    udp_drop_policy = UDP_DROP_TAIL;
+                } else {
+                    end = NULL;
+                }
+                if (end == NULL || udp_queue_bytes < 0) {
+                    fprintf(stderr, "invalid udp queue '%s', expected <bytes>[:head|:tail]\n", optarg);
+                    errors++;
+                }
+                break;
+            }
+            case 'S': {
+                char *end;
+                max_udp_service_connections = (int) strtol(optarg, &end, 10);
+                if (*end != '\0' || max_udp_service_connections < 0) {
+                    fprintf(stderr, "invalid udp service limit '%s', expected <connections>\n", optarg);
+                    errors++;
+                }
+                break;
+            }
             default: {
                 fprintf(stderr, "Unknown option '%c'\n", c);
                 errors++;
@@ -2509,16 +2603,19 @@ static CommandLine enroll_cmd = make_command(
     "\t-v|--verbose N\tset log level, higher level -- more verbose (default 3)\n",
     parse_enroll_opts, enroll);
 #if __linux__
-#define DIVERTER_OPTS_SUMMARY "[-D|--diverter <interface list>] [-f|--diverter-fw <interface list>] "
+#define DIVERTER_OPTS_SUMMARY "[-D|--diverter <interface list>] [-f|--diverter-fw <interface list>] [-Q|--tun-queues N] [-O|--tun-offload] [-U|--tun-io-uring] "
 #define DIVERTER_OPTS_DETAIL "\t-D|--diverter <interface list>\tset diverter mode to true on <interface list>\n" \
-                             "\t-f|--diverter-fw <interface list>\tset diverter to true in firewall mode on <interface list>)\n"
+                             "\t-f|--diverter-fw <interface list>\tset diverter to true in firewall mode on <interface list>)\n" \
+                             "\t-Q|--tun-queues N\topen the tun device with N queues (IFF_MULTI_QUEUE) that are polled independently (default 1)\n" \
+                             "\t-O|--tun-offload\tenable IFF_VNET_HDR with TSO/USO so the kernel can pass TCP/UDP super-segments\n" \
+                             "\t-U|--tun-io-uring\tread and write the tun device with io_uring (if built with liburing)\n"
 #else
 #define DIVERTER_OPTS_SUMMARY ""
 #define DIVERTER_OPTS_DETAIL ""
 #endif
 
 static CommandLine run_cmd = make_command("run", "run Ziti tunnel (required superuser access)",
-                                          "-i <id.file> [-r N] [-v N] [-d|--dns-ip-range N.N.N.N/N] " DIVERTER_OPTS_SUMMARY "[-u|--dns-upstream N.N.N.N]\n",
+                                          "-i <id.file> [-r N] [-v N] [-d|--dns-ip-range N.N.N.N/N] " DIVERTER_OPTS_SUMMARY "[-u|--dns-upstream N.N.N.N] [-B|--read-budget N[:usec]] [-C|--conn-limits N[:N[:N]]] [-q|--udp-queue N[:head|tail]] [-S|--udp-service-limit N]\n",
                                           "\t-i|--identity <identity>\trun with provided identity file (required)\n"
                                           "\t-I|--identity-dir <dir>\tload identities from provided directory\n"
                                           "\t-x|--proxy type://[username[:password]@]hostname_or_ip:port\tproxy to use when"
@@ -2528,7 +2625,14 @@ static CommandLine run_cmd = make_command("run", "run Ziti tunnel (required supe
                                           "\t-d|--dns-ip-range <ip range>\tspecify CIDR block in which service DNS names"
                                           " are assigned in N.N.N.N/n format (default " DEFAULT_DNS_CIDR ")\n"
                                           DIVERTER_OPTS_DETAIL
-                                          "\t-u|--dns-upstream <ip addr>\tresolver listening on 53/udp for DNS queries that do not match a Ziti service\n",
+                                          "\t-u|--dns-upstream <ip addr>\tresolver listening on 53/udp for DNS queries that do not match a Ziti service\n"
+                                          "\t-B|--read-budget N[:usec]\tmax packets (and microseconds) spent reading the tun device per event (default 128:2000)\n"
+                                          "\t-C|--conn-limits tcp[:udp[:pbufs]]\tmax intercepted tcp and udp connections, and pbufs for packets"
+                                          " copied from the tun device. 0 keeps the built-in limit\n"
+                                          "\t-q|--udp-queue bytes[:head|tail]\tdatagrams queued per udp connection while ziti applies backpressure"
+                                          " (default 65536), and whether the oldest (head) or newest (tail) are dropped when it is full (default tail)\n"
+                                          "\t-S|--udp-service-limit N\tmax intercepted udp connections per service. the least recently active"
+                                          " idle connection is closed to make room for a new one (default 0, no limit)\n",
                                           run_opts, run);
 static CommandLine run_host_cmd = make_command("run-host", "run Ziti tunnel to host services",
                                           "-i <id.file> [-r N] [-v N]",